@@ -9,6 +9,7 @@
 #include "descriptor_types.h"
 
 typedef struct USBEndpoint USBEndpoint;
+typedef struct USBController USBController;
 
 
 typedef struct __attribute__((packed))
@@ -89,6 +90,11 @@ typedef void (*USBEvent_cb)(void);
 typedef void (*Endpoint_cb)(USBEndpoint *const endpoint);
 typedef void *(*Alloc_cb)(size_t num_bytes, size_t alignment);
 
+typedef enum {
+    USB_PHY_INTERNAL = 0,   // USB0: high-speed PHY, USB1: full-speed PHY
+    USB_PHY_ULPI = 1,       // USB1 only: external ULPI PHY (high speed)
+} USBPhy;
+
 typedef struct
 {
     USBDescriptorDevice *descriptor;
@@ -106,6 +112,9 @@ typedef struct
     USBEvent_cb suspend;
     USBEvent_cb attach;
     USBEvent_cb detach;
+    USBEvent_cb events_pending;     // deferred completions need processing
+    USBPhy phy;                     // transceiver of the controller
+    const USBController *hw;        // set by usb_device_init()
 } USBDevice;
 
 
@@ -133,6 +142,8 @@ USBEndpoint* usb_endpoint_get_out_ep(const USBEndpoint *const endpoint);
 bool usb_device_is_suspended(USBDevice* const device);
 bool usb_device_is_attached(USBDevice* const device);
 
+// Set the priority of the USB interrupts before this: the queue API masks
+// them at the priority read here
 void usb_run(USBDevice *const device);
 void usb_stop(USBDevice* const device);
     
@@ -143,6 +154,18 @@ USBRequestStatus usb_standard_request(USBEndpoint *const endpoint,
 
 typedef void (*transfer_completion_cb)(void *, int);
 
+// Passed to the completion callback instead of the number of bytes when a
+// transfer did not complete, and as the status of a USBCompletionEvent
+typedef enum {
+    USB_TRANSFER_OK = 0,
+    USB_TRANSFER_FLUSHED = -1,              // usb_endpoint_flush()
+    USB_TRANSFER_CANCELLED = -2,            // usb_transfer_cancel()
+    USB_TRANSFER_TIMEOUT = -3,              // usb_queue_set_timeout()
+    USB_TRANSFER_HALTED = -4,               // e.g. babble, endpoint halted
+    USB_TRANSFER_BUFFER_ERROR = -5,         // buffer over- or underrun
+    USB_TRANSFER_TRANSACTION_ERROR = -6,    // isochronous transaction error
+} USBTransferStatus;
+
 int usb_transfer_schedule(
     const USBEndpoint *const endpoint,
     void *const data,
@@ -150,6 +173,36 @@ int usb_transfer_schedule(
     const transfer_completion_cb completion_cb,
     void *const user_data);
 
+// Identifies one scheduled transfer, for usb_transfer_cancel()
+typedef uint32_t USBTransferHandle;
+#define USB_TRANSFER_HANDLE_NONE 0
+
+/**
+ * Like usb_transfer_schedule(), but returns a handle of the transfer. The
+ * handle stays unique to the transfer after it completes, even when its
+ * pool slot is reused.
+ *
+ * @return  the handle, or USB_TRANSFER_HANDLE_NONE if the pool of the
+ *          endpoint is full.
+ */
+USBTransferHandle usb_transfer_schedule_handle(
+    const USBEndpoint *const endpoint,
+    void *const data,
+    const uint32_t maximum_length,
+    const transfer_completion_cb completion_cb,
+    void *const user_data);
+
+/**
+ * Schedule a transfer, sleeping (WFI) until the pool of the endpoint has
+ * room for it.
+ *
+ * Never waits in interrupt context or in a callback run by usb_poll(): a
+ * full pool cannot drain while the USB events are not handled, so it
+ * returns -1 immediately instead. Neither does it wait while the device
+ * is detached or suspended.
+ *
+ * @return  0 on success, -1 if the pool is full and it can not wait.
+ */
 int usb_transfer_schedule_block(
     const USBEndpoint *const endpoint,
     void *const data,
@@ -157,6 +210,277 @@ int usb_transfer_schedule_block(
     const transfer_completion_cb completion_cb,
     void *const user_data);
 
+// Longest timeout of usb_transfer_schedule_wait()
+#define USB_TRANSFER_WAIT_MAX_MS 2047
+
+/**
+ * Like usb_transfer_schedule_block(), but gives up after timeout_ms
+ * milliseconds. Time is measured on the USB frame counter, which wraps
+ * every 2048ms: the timeout can be at most USB_TRANSFER_WAIT_MAX_MS. The
+ * counter only runs while the bus is active, which is why the wait ends
+ * when the device is detached or suspended. Waking up relies on interrupts
+ * (the USB completion or e.g. a system tick).
+ *
+ * @return  0 on success, -1 on timeout, a timeout above
+ *          USB_TRANSFER_WAIT_MAX_MS or if usb_transfer_schedule_block()
+ *          would fail.
+ */
+int usb_transfer_schedule_wait(
+    const USBEndpoint *const endpoint,
+    void *const data,
+    const uint32_t maximum_length,
+    const transfer_completion_cb completion_cb,
+    void *const user_data,
+    const uint32_t timeout_ms);
+
+/**
+ * Register a callback that is invoked when transfers of the endpoint
+ * complete (or are flushed) after a submission was rejected for lack of
+ * pool space. This allows producers to retry from the callback instead of
+ * waiting. Called from the context that runs the completion callbacks (see
+ * usb_queue_set_deferred_completion()); pass NULL to disable.
+ */
+void usb_queue_set_space_available_cb(USBEndpoint *const endpoint,
+    const Endpoint_cb space_available);
+
+typedef struct
+{
+    void *data;
+    uint32_t maximum_length;
+    transfer_completion_cb completion_cb;
+    void *user_data;
+} USBTransferRequest;
+
+/**
+ * Schedule several transfers on an endpoint at once.
+ *
+ * The transfers are linked together and handed to the controller with a
+ * single append or prime, which is much cheaper than calling
+ * usb_transfer_schedule() for each of them. Each transfer still gets its
+ * own completion callback, in order.
+ *
+ * @return  0 on success, -1 if the pool of the endpoint does not have
+ *          room for all transfers (nothing is scheduled in that case).
+ */
+int usb_transfer_schedule_batch(
+    const USBEndpoint *const endpoint,
+    const USBTransferRequest *const transfers,
+    const size_t count);
+
+/**
+ * Like usb_transfer_schedule_batch(), but also stores the handle of each
+ * transfer in handles (count entries), see usb_transfer_schedule_handle().
+ */
+int usb_transfer_schedule_batch_handles(
+    const USBEndpoint *const endpoint,
+    const USBTransferRequest *const transfers,
+    const size_t count,
+    USBTransferHandle *const handles);
+
+/**
+ * Cancel one transfer of an endpoint, identified by the handle that
+ * usb_transfer_schedule_handle() returned for it. Its callback is
+ * invoked with USB_TRANSFER_CANCELLED, or a USB_TRANSFER_CANCELLED event is
+ * posted. The other transfers stay queued and keep streaming.
+ *
+ * A transfer the controller has not reached yet is simply unlinked. If the
+ * controller is already working on it, the endpoint is flushed and
+ * restarted behind it: part of its data may have been transferred.
+ * Transfers that already finished are completed normally first.
+ *
+ * @return  0 on success, -1 if no such transfer is queued (it may have
+ *          completed already).
+ */
+int usb_transfer_cancel(
+    const USBEndpoint *const endpoint,
+    const USBTransferHandle handle);
+
+/**
+ * Give every transfer scheduled on the endpoint from now on a deadline,
+ * microframes (125us units, at most 8191) after it was scheduled. A
+ * transfer still queued at its deadline is cancelled as by
+ * usb_transfer_cancel(), with status USB_TRANSFER_TIMEOUT. This keeps a
+ * host that stops reading from backing up the pool with stale data.
+ * Pass 0 to disable (the default).
+ *
+ * Deadlines are checked in order from the head of the queue by
+ * usb_queue_check_timeouts(), which runs on every SOF interrupt (see
+ * usb_set_sof_interrupt()). Time is measured on the USB frame counter,
+ * which only runs while the bus is active.
+ */
+void usb_queue_set_timeout(USBEndpoint *const endpoint,
+    const uint32_t microframes);
+
+/**
+ * Expire the transfers of a controller that passed their deadline. Called
+ * from the SOF interrupt; without it, call this at least every second
+ * (e.g. from a system tick) for timeouts to work.
+ */
+void usb_queue_check_timeouts(USBDevice *const device);
+
+typedef enum {
+    USB_IRQ_EVERY_TRANSFER = 0,     // interrupt when any transfer completes
+    USB_IRQ_EVERY_N = 1,            // every n-th transfer of a batch
+    USB_IRQ_LAST_OF_BATCH = 2,      // only the last transfer of a batch
+} USBIrqPolicy;
+
+/**
+ * Select which transfers of an endpoint raise an interrupt on completion.
+ *
+ * Transfers without an interrupt are completed (and their callbacks
+ * invoked, in order) when a later transfer interrupts. The last transfer
+ * of every usb_transfer_schedule() or usb_transfer_schedule_batch() call
+ * always interrupts, so completions are never held back indefinitely: the
+ * policy only makes a difference for batches.
+ *
+ * @param n     Interrupt interval for USB_IRQ_EVERY_N, ignored otherwise.
+ */
+void usb_queue_set_irq_policy(USBEndpoint *const endpoint,
+    const USBIrqPolicy policy, const uint32_t n);
+
+typedef struct
+{
+    uint64_t bytes;                 // bytes of completed transfers
+    uint32_t transfers;             // completed transfers
+    uint32_t short_packets;         // transfers ended early by a short packet
+    uint32_t pool_exhausted;        // submissions rejected for lack of pool space
+    uint32_t max_depth;             // most transfers queued at once
+    uint64_t latency_microframes;   // schedule to completion, summed over transfers
+} USBQueueStats;
+
+/**
+ * Read the transfer statistics of an endpoint.
+ *
+ * Statistics are only collected when mcu_usb is compiled with
+ * MCU_USB_QUEUE_STATS defined. Latency is measured on the USB frame counter
+ * (125us units) and assumes transfers complete within 2 seconds.
+ *
+ * @return  true on success, false if statistics are not compiled in
+ *          (stats is zeroed in that case).
+ */
+bool usb_queue_get_stats(USBEndpoint *const endpoint, USBQueueStats *const stats);
+
+/**
+ * Clear the statistics of an endpoint. max_depth restarts at the number of
+ * transfers currently queued.
+ */
+void usb_queue_reset_stats(USBEndpoint *const endpoint);
+
+typedef struct
+{
+    uint32_t halted;                // USB_TRANSFER_HALTED
+    uint32_t buffer_errors;         // USB_TRANSFER_BUFFER_ERROR
+    uint32_t transaction_errors;    // USB_TRANSFER_TRANSACTION_ERROR
+} USBQueueErrors;
+
+/**
+ * Read the error counters of an endpoint (always collected).
+ *
+ * A failed dTD completes its transfer with the matching USBTransferStatus
+ * and the endpoint restarts at the next queued transfer, so one bad
+ * transaction does not stall the stream. Isochronous slots are not failed:
+ * they complete with the data of their microframe and are counted here
+ * and in USBIsoStats.errors.
+ */
+void usb_queue_get_errors(const USBEndpoint *const endpoint,
+    USBQueueErrors *const errors);
+
+/**
+ * Pool occupancy of an endpoint, in dTDs: a transfer takes one dTD per
+ * started 16K of data. These are O(1) and safe to call from any context,
+ * e.g. for flow control.
+ */
+uint32_t usb_queue_free_slots(const USBEndpoint *const endpoint);
+uint32_t usb_queue_used_slots(const USBEndpoint *const endpoint);
+
+/**
+ * High-water mark of usb_queue_used_slots() since the endpoint was created
+ * or usb_queue_reset_max_used_slots() was called.
+ */
+uint32_t usb_queue_max_used_slots(const USBEndpoint *const endpoint);
+void usb_queue_reset_max_used_slots(const USBEndpoint *const endpoint);
+
+typedef struct
+{
+    USBEndpoint *endpoint;
+    void *user_data;
+    uint32_t transferred;   // bytes (before the error, if any)
+    int32_t status;         // USBTransferStatus
+    uint32_t frame;         // FRINDEX at completion (125us units)
+} USBCompletionEvent;
+
+// Single producer (the USB interrupt), single consumer ring of completion
+// events. This is an opaque datatype. Thou shall not touch these members.
+typedef struct
+{
+    USBCompletionEvent *events;
+    uint32_t mask;
+    volatile uint32_t head;     // next event to write, producer only
+    volatile uint32_t tail;     // next event to read, consumer only
+    volatile uint32_t dropped;
+} USBEventRing;
+
+/**
+ * Initialize an event ring.
+ *
+ * @param events    Storage for the events.
+ * @param size      Number of events, must be a power of two.
+ *
+ * @return  0 on success, -1 if size is not a power of two.
+ */
+int usb_event_ring_init(USBEventRing *const ring,
+    USBCompletionEvent *const events, const uint32_t size);
+
+/**
+ * Copy up to max_count of the oldest events to events and remove them
+ * from the ring. Lock-free, call from a single consumer context.
+ *
+ * @return  Number of events copied.
+ */
+size_t usb_event_ring_read(USBEventRing *const ring,
+    USBCompletionEvent *const events, const size_t max_count);
+
+/**
+ * Number of events waiting in the ring.
+ */
+uint32_t usb_event_ring_count(const USBEventRing *const ring);
+
+/**
+ * Number of events lost because the ring was full.
+ */
+uint32_t usb_event_ring_dropped(const USBEventRing *const ring);
+
+/**
+ * Post completions of an endpoint to an event ring instead of invoking
+ * the completion callbacks of its transfers. An event is posted for every
+ * transfer, also those without a callback. Several endpoints of a device
+ * may share a ring. Pass NULL to return to callbacks.
+ */
+void usb_queue_set_event_ring(USBEndpoint *const endpoint,
+    USBEventRing *const ring);
+
+/**
+ * Defer the completion callbacks of an endpoint to usb_process_events().
+ *
+ * The USB interrupt then only retires finished dTDs and records which
+ * endpoints have completions, so its duration no longer depends on the
+ * callbacks. Transfers stay allocated until their callback ran. The
+ * events_pending callback of the device is invoked (from the interrupt)
+ * when there is something to process, e.g. to wake up a task.
+ *
+ * Not for control endpoints: the standard requests rely on their
+ * completions in interrupt context.
+ */
+void usb_queue_set_deferred_completion(USBEndpoint *const endpoint,
+    const bool deferred);
+
+/**
+ * Run the deferred completion callbacks of a device, in order per endpoint.
+ * Call from the main loop or a task, not from interrupt context.
+ */
+void usb_process_events(USBDevice *const device);
+bool usb_events_pending(const USBDevice *const device);
+
 void usb_queue_transfer_complete(USBEndpoint *const endpoint);
 
 int usb_transfer_schedule_ack(const USBEndpoint* const endpoint);
@@ -167,11 +491,77 @@ void usb_control_in_complete(USBEndpoint *const endpoint);
 
 void usb_control_out_complete(USBEndpoint *const endpoint);
 
+/**
+ * Set the interrupt threshold (USBCMD ITC) of a controller.
+ *
+ * The controller then holds back transfer interrupts for up to the given
+ * number of microframes (125us each), so one interrupt can handle several
+ * completed transfers. Supported values are 0 (interrupt immediately, the
+ * default), 1, 2, 4, 8, 16, 32 and 64; others are rounded up.
+ */
+void usb_set_interrupt_threshold(USBDevice* const device, uint8_t microframes);
+
+/**
+ * Enable the start of frame interrupt, which calls the start_of_frame
+ * callback of the device and checks transfer timeouts. It fires every
+ * microframe (125us) at high speed and every frame (1ms) at full speed.
+ */
+void usb_set_sof_interrupt(USBDevice* const device, const bool enabled);
+
+typedef enum {
+    USB_SERVICE_INTERRUPT = 0,      // events are handled by the USB interrupt
+    USB_SERVICE_POLL = 1,           // no USB interrupt: call usb_poll()
+    USB_SERVICE_ADAPTIVE = 2,       // interrupt at low, poll at high event rates
+} USBServiceMode;
+
+/**
+ * Select how the events of a controller are handled. usb_device_init()
+ * resets it to USB_SERVICE_INTERRUPT.
+ *
+ * USB_SERVICE_POLL disables the USB interrupt: the application handles
+ * the events by calling usb_poll() from its main loop, saving the interrupt
+ * entry and exit per event.
+ *
+ * USB_SERVICE_ADAPTIVE starts out on the interrupt. When a frame (1ms)
+ * sees USB_ADAPTIVE_IRQS_PER_FRAME interrupts, the interrupt is disabled
+ * and usb_poll() takes over, until USB_ADAPTIVE_IDLE_POLLS calls in a row
+ * found nothing to do. The application must call usb_poll() regularly
+ * whenever usb_is_polling() is true.
+ *
+ * Blocking schedules call usb_poll() themselves while polling.
+ */
+void usb_set_service_mode(USBDevice* const device, const USBServiceMode mode);
+
+/**
+ * Handle the pending events of a controller, like its interrupt handler
+ * does, with the USB interrupts masked. Completion callbacks run from
+ * here, so like in the interrupt they must not wait for USB events (see
+ * usb_transfer_schedule_block()). Safe to call in any mode, but not from
+ * interrupt context.
+ *
+ * @return  true if there were events.
+ */
+bool usb_poll(USBDevice* const device);
+
+/**
+ * Whether usb_poll() currently has to handle the events of a controller.
+ */
+bool usb_is_polling(const USBDevice* const device);
+
 void usb_disable_phy_clock();
 void usb_enable_phy_clock();
 void usb_set_vbus_charge(USBDevice* const device, bool enabled);
 void usb_set_vbus_discharge(USBDevice* const device, bool enabled);
 
+/**
+ * USB1 only: tell the controller whether VBUS is present (SCU SFSUSB.VBUS),
+ * for boards that do not route the USB1_VBUS pin. The controller only
+ * connects to the bus while VBUS is valid; usb_device_init() assumes it is.
+ * USB1 has no VBUS interrupts, so the attach and detach callbacks are
+ * USB0 only: poll usb_device_is_attached() instead.
+ */
+void usb_set_vbus_valid(USBDevice* const device, bool valid);
+
 // for debugging
 uint32_t queue_free_space(USBEndpoint *const endpoint);
 void usb_queue_flush_endpoint(const USBEndpoint* const endpoint);
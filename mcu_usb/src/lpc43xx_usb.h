@@ -7,13 +7,21 @@
 extern "C" {
 #endif
 
+#ifdef MCU_USB_HOST_SIM
+/* Host builds: register accesses go to the emulated controller,
+ * see tests/sim/usb_sim.h */
+volatile uint32_t *usb_sim_mmio32(uint32_t addr);
+#undef MMIO32
+#define MMIO32(addr)                    (*usb_sim_mmio32(addr))
+#endif
+
 #define PERIPH_BASE_AHB                 0x40000000
 #define USB0_BASE                       (PERIPH_BASE_AHB + 0x06000)
 #define USB1_BASE                       (PERIPH_BASE_AHB + 0x07000)
 
 #define BIT_MASK(base_name) \
-	(((1 << base_name##_WIDTH) - 1) << base_name##_SHIFT)
-#define BIT_ARG(base_name, x) ((x) << base_name##_SHIFT)
+	(((1U << base_name##_WIDTH) - 1) << base_name##_SHIFT)
+#define BIT_ARG(base_name, x) ((uint32_t)(x) << base_name##_SHIFT)
 
 /* USB device data structures */
 
@@ -40,13 +48,15 @@ extern "C" {
 	volatile uint32_t word;
 };
 
+/* - must be aligned on 32-byte boundaries, so arrays of them are packed
+ *   without crossing a 4kB page. */
 typedef struct USBTransferDescriptor USBTransferDescriptor;
 struct USBTransferDescriptor {
 	volatile USBTransferDescriptor *next_dtd_pointer;
 	union Capabilities capabilities;
 	volatile uint32_t buffer_pointer_page[5];
 	volatile uint32_t _reserved;
-};
+} ATTR_ALIGNED(32);
 
 #define USB_TD_NEXT_DTD_POINTER_TERMINATE_SHIFT (0)
 #define USB_TD_NEXT_DTD_POINTER_TERMINATE \
@@ -84,6 +94,8 @@ struct USBTransferDescriptor {
 
 /* --- Endpoint Queue Head (dQH) ------------------------------------------- */
 
+struct USBEndpoint;
+
 /* - must be aligned on 64-byte boundaries. */
 typedef struct {
 	volatile uint32_t capabilities;
@@ -93,7 +105,12 @@ typedef struct {
 	volatile uint32_t buffer_pointer_page[5];
 	volatile uint32_t _reserved_0;
 	volatile uint8_t setup[8];
-	volatile uint32_t _reserved_1[4];
+	union {
+		volatile uint32_t _reserved_1[4];
+		/* Not accessed by the controller: the endpoint that uses this
+		 * queue head, see usb_endpoint_init_without_descriptor() */
+		struct USBEndpoint *endpoint;
+	};
 } USBQueueHead;
 
 #define USB_QH_CAPABILITIES_IOS_SHIFT (15)
@@ -112,6 +129,30 @@ typedef struct {
 #define USB_QH_CAPABILITIES_MULT_MASK BIT_MASK(USB_QH_CAPABILITIES_MULT)
 #define USB_QH_CAPABILITIES_MULT(x) BIT_ARG(USB_QH_CAPABILITIES_MULT, x)
 
+/* --- Registers of either controller ------------------------------------- */
+
+/* USB0 and USB1 have the same register layout at a different base address
+ * (USB0_BASE, USB1_BASE). These take the base as argument, so one code
+ * path serves both controllers; the USB0_* field definitions below apply
+ * to either block. */
+#define USB_USBCMD_D(base)              MMIO32((base) + 0x140)
+#define USB_USBSTS_D(base)              MMIO32((base) + 0x144)
+#define USB_USBINTR_D(base)             MMIO32((base) + 0x148)
+#define USB_FRINDEX_D(base)             MMIO32((base) + 0x14C)
+#define USB_DEVICEADDR(base)            MMIO32((base) + 0x154)
+#define USB_ENDPOINTLISTADDR(base)      MMIO32((base) + 0x158)
+#define USB_ENDPTNAK(base)              MMIO32((base) + 0x178)
+#define USB_ENDPTNAKEN(base)            MMIO32((base) + 0x17C)
+#define USB_PORTSC1_D(base)             MMIO32((base) + 0x184)
+#define USB_USBMODE_D(base)             MMIO32((base) + 0x1A8)
+#define USB_ENDPTSETUPSTAT(base)        MMIO32((base) + 0x1AC)
+#define USB_ENDPTPRIME(base)            MMIO32((base) + 0x1B0)
+#define USB_ENDPTFLUSH(base)            MMIO32((base) + 0x1B4)
+#define USB_ENDPTSTAT(base)             MMIO32((base) + 0x1B8)
+#define USB_ENDPTCOMPLETE(base)         MMIO32((base) + 0x1BC)
+#define USB_ENDPTCTRL(base, logical_ep) MMIO32((base) + 0x1C0 + \
+							((logical_ep) * 4))
+
 /* --- USB0 registers ------------------------------------------------------ */
 
 /* Device/host capability registers */
@@ -2011,6 +2052,11 @@ to issue an interrupt the next time it advances asynchronous schedule */
 #define USB1_PORTSC1_D_PSPD_MASK (0x3 << USB1_PORTSC1_D_PSPD_SHIFT)
 #define USB1_PORTSC1_D_PSPD(x) ((x) << USB1_PORTSC1_D_PSPD_SHIFT)
 
+/* PTS: Parallel transceiver select (2: ULPI, 3: serial / full-speed PHY) */
+#define USB1_PORTSC1_D_PTS_SHIFT (30)
+#define USB1_PORTSC1_D_PTS_MASK (0x3U << USB1_PORTSC1_D_PTS_SHIFT)
+#define USB1_PORTSC1_D_PTS(x) ((uint32_t)(x) << USB1_PORTSC1_D_PTS_SHIFT)
+
 /* --- USB1_PORTSC1_H values ------------------------------------ */
 
 /* CCS: Current connect status */
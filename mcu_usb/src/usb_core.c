@@ -10,39 +10,74 @@
 #include "usb_queue.h"
 #include "usb_standard_request.h"
 #include "usb_endpoint.h"
+#include "usb_critical.h"
 
 
 USBQueueHead usb_qh0[12] ATTR_ALIGNED(2048);
 USBQueueHead usb_qh1[12] ATTR_ALIGNED(2048);
 
+const USBController usb_controllers[NUM_USB_CONTROLLERS] = {
+	{
+		.base = USB0_BASE,
+		.qh = usb_qh0,
+		.num_endpoints = NUM_USB0_ENDPOINTS,
+		.irq = USB0_IRQn,
+		.reset = RGU_USB0_RST,
+	},
+	{
+		.base = USB1_BASE,
+		.qh = usb_qh1,
+		.num_endpoints = NUM_USB1_ENDPOINTS,
+		.irq = USB1_IRQn,
+		.reset = RGU_USB1_RST,
+	},
+};
+
 static USBDevice *devices[NUM_USB_CONTROLLERS];
 
+#if defined(__ARM_ARCH_7M__) || defined (__ARM_ARCH_7EM__)
+uint32_t usb_critical_basepri;
+#endif
+
+// Who handles the events of a controller, see usb_set_service_mode()
+typedef struct {
+	USBServiceMode mode;
+	bool polling;           // interrupt disabled, usb_poll() handles events
+	uint16_t frame;         // frame (FRINDEX / 8) of the last interrupt
+	uint8_t irqs;           // interrupts in that frame
+	uint8_t idle_polls;     // polls in a row without events
+	volatile bool servicing; // usb_service() runs, e.g. a completion callback
+} USBService;
+
+static USBService services[NUM_USB_CONTROLLERS];
+
+// SCU SFSUSB: pins and power of the full-speed PHY of USB1
+#define SFSUSB_ESEA	(1 << 1)	// reserved, must be set for device mode
+#define SFSUSB_EPWR	(1 << 4)	// PHY powered (normal mode)
+#define SFSUSB_VBUS	(1 << 5)	// VBUS valid, if USB1_VBUS is not routed
+
 #define USB_QH_INDEX(endpoint_address) (((endpoint_address & 0xF) * 2) + ((endpoint_address >> 7) & 1))
 
-static USBQueueHead* usb_queue_head(
-	const uint_fast8_t endpoint_address,
-	const USBDevice* const device
-) {
-	USBQueueHead * endpoint_list = device->controller ? usb_qh1 : usb_qh0;
-	return &endpoint_list[USB_QH_INDEX(endpoint_address)];
-}
+// Bit of an endpoint in ENDPTCOMPLETE, ENDPTSETUPSTAT etc:
+// OUT endpoints at bits 0-5, IN endpoints at bits 16-21.
+#define USB_ENDPOINT_BIT(endpoint_address) (((endpoint_address & 0xF)) + (((endpoint_address >> 7) & 1) * 16))
 
-static USBEndpoint* usb_endpoint_from_address(
-	const uint_fast8_t endpoint_address,
-	const USBDevice* const device
+void usb_endpoint_bind(
+	USBEndpoint* const endpoint
 ) {
-	return (USBEndpoint*)usb_queue_head(endpoint_address, device)->_reserved_0;
+	endpoint->hw = &usb_controllers[endpoint->device->controller];
+	endpoint->qh = &endpoint->hw->qh[USB_QH_INDEX(endpoint->address)];
+	endpoint->mask = 1UL << USB_ENDPOINT_BIT(endpoint->address);
 }
 
-static uint_fast8_t usb_endpoint_address(
-    const USBTransferDirection direction,
-    const uint_fast8_t number
+// Endpoint of an event bit, through the queue head it is bound to
+static USBEndpoint* usb_endpoint_by_bit(
+	const USBDevice* const device,
+	const uint_fast8_t bit
 ) {
-    return ((direction == USB_TRANSFER_DIRECTION_IN) ? 0x80 : 0x00) + number;
+	return device->hw->qh[((bit & 0xF) * 2) + (bit >> 4)].endpoint;
 }
 
-
-
 static uint_fast8_t usb_endpoint_number(const uint_fast8_t endpoint_address) {
     return (endpoint_address & 0xF);
 }
@@ -53,51 +88,24 @@ static uint_fast8_t usb_endpoint_number(const uint_fast8_t endpoint_address) {
  * endpoint from its pair is in active. 
  */
 static void usb_endpoint_reset(const USBDevice* const device) {
-	if( device->controller == 0 ) {
-		USB0_ENDPTCTRL0 = USB0_ENDPTCTRL0_RXT1_0(USB_TRANSFER_TYPE_CONTROL) 
-			| USB0_ENDPTCTRL0_TXT1_0(USB_TRANSFER_TYPE_CONTROL);
-		USB0_ENDPTCTRL1 = USB0_ENDPTCTRL0_RXT1_0(USB_TRANSFER_TYPE_BULK) 
-			| USB0_ENDPTCTRL0_TXT1_0(USB_TRANSFER_TYPE_BULK);
-		USB0_ENDPTCTRL2 = USB0_ENDPTCTRL0_RXT1_0(USB_TRANSFER_TYPE_BULK) 
+	const uint32_t base = device->hw->base;
+	USB_ENDPTCTRL(base, 0) = USB0_ENDPTCTRL0_RXT1_0(USB_TRANSFER_TYPE_CONTROL) 
+		| USB0_ENDPTCTRL0_TXT1_0(USB_TRANSFER_TYPE_CONTROL);
+	for( uint_fast8_t i = 1; i < device->hw->num_endpoints; i++ ) {
+		USB_ENDPTCTRL(base, i) = USB0_ENDPTCTRL0_RXT1_0(USB_TRANSFER_TYPE_BULK) 
 			| USB0_ENDPTCTRL0_TXT1_0(USB_TRANSFER_TYPE_BULK);
-		USB0_ENDPTCTRL3 = USB0_ENDPTCTRL0_RXT1_0(USB_TRANSFER_TYPE_BULK) 
-			| USB0_ENDPTCTRL0_TXT1_0(USB_TRANSFER_TYPE_BULK);
-		USB0_ENDPTCTRL4 = USB0_ENDPTCTRL0_RXT1_0(USB_TRANSFER_TYPE_BULK) 
-			| USB0_ENDPTCTRL0_TXT1_0(USB_TRANSFER_TYPE_BULK);
-		USB0_ENDPTCTRL5 = USB0_ENDPTCTRL0_RXT1_0(USB_TRANSFER_TYPE_BULK) 
-			| USB0_ENDPTCTRL0_TXT1_0(USB_TRANSFER_TYPE_BULK);
-	}
-	if( device->controller == 1 ) {
-		USB1_ENDPTCTRL0 = USB1_ENDPTCTRL0_RXT1_0(USB_TRANSFER_TYPE_CONTROL) 
-			| USB1_ENDPTCTRL0_TXT1_0(USB_TRANSFER_TYPE_CONTROL);
-		USB1_ENDPTCTRL1 = USB1_ENDPTCTRL0_RXT1_0(USB_TRANSFER_TYPE_BULK) 
-			| USB1_ENDPTCTRL0_TXT1_0(USB_TRANSFER_TYPE_BULK);
-		USB1_ENDPTCTRL2 = USB0_ENDPTCTRL0_RXT1_0(USB_TRANSFER_TYPE_BULK) 
-			| USB1_ENDPTCTRL0_TXT1_0(USB_TRANSFER_TYPE_BULK);
-		USB1_ENDPTCTRL3 =USB0_ENDPTCTRL0_RXT1_0(USB_TRANSFER_TYPE_BULK) 
-			| USB1_ENDPTCTRL0_TXT1_0(USB_TRANSFER_TYPE_BULK);
 	}
 }
 
 static void usb_clear_pending_interrupts(const uint32_t mask,
                                          const USBDevice *const device)
 {
-    if (device->controller == 0)
-    {
-        USB0_ENDPTNAK = mask;
-        USB0_ENDPTNAKEN = mask;
-        USB0_USBSTS_D = mask;
-        USB0_ENDPTSETUPSTAT = USB0_ENDPTSETUPSTAT & mask;
-        USB0_ENDPTCOMPLETE = USB0_ENDPTCOMPLETE & mask;
-    }
-    if (device->controller == 1)
-    {
-        USB1_ENDPTNAK = mask;
-        USB1_ENDPTNAKEN = mask;
-        USB1_USBSTS_D = mask;
-        USB1_ENDPTSETUPSTAT = USB1_ENDPTSETUPSTAT & mask;
-        USB1_ENDPTCOMPLETE = USB1_ENDPTCOMPLETE & mask;
-    }
+    const uint32_t base = device->hw->base;
+    USB_ENDPTNAK(base) = mask;
+    USB_ENDPTNAKEN(base) = mask;
+    USB_USBSTS_D(base) = mask;
+    USB_ENDPTSETUPSTAT(base) = USB_ENDPTSETUPSTAT(base) & mask;
+    USB_ENDPTCOMPLETE(base) = USB_ENDPTCOMPLETE(base) & mask;
 }
 
 static void usb_clear_all_pending_interrupts(const USBDevice* const device) {
@@ -105,48 +113,33 @@ static void usb_clear_all_pending_interrupts(const USBDevice* const device) {
 }
 
 static void usb_wait_for_endpoint_priming_to_finish(const uint32_t mask,
-                                                    const USBDevice *const device)
+                                                    const USBController *const hw)
 {
     // Wait until controller has parsed new transfer descriptors and prepared
     // receive buffers.
-    if (device->controller == 0) {
-        while (USB0_ENDPTPRIME & mask);
-    }
-    if (device->controller == 1) {
-        while (USB1_ENDPTPRIME & mask);
-    }
+    while (USB_ENDPTPRIME(hw->base) & mask);
 }
 
-static void usb_flush_endpoints(const uint32_t mask, const USBDevice* const device) {
+static void usb_flush_endpoints(const uint32_t mask, const USBController* const hw) {
    // Clear any primed buffers. If a packet is in progress, that transfer
 	// will continue until completion.
-	if(device->controller == 0) {
-		USB0_ENDPTFLUSH = mask;		
-	}
-	if(device->controller == 1) {
-		USB1_ENDPTFLUSH = mask;
-	}
+	USB_ENDPTFLUSH(hw->base) = mask;
 }
 
-static void usb_wait_for_endpoint_flushing_to_finish(const uint32_t mask, const USBDevice* const device) {
+static void usb_wait_for_endpoint_flushing_to_finish(const uint32_t mask, const USBController* const hw) {
     // Wait until controller has flushed all endpoints / cleared any primed
 	// buffers.
-	if(device->controller == 0) {
-		while( USB0_ENDPTFLUSH & mask );		
-	}
-	if(device->controller == 1) {
-		while( USB1_ENDPTFLUSH & mask );
-	}
+	while( USB_ENDPTFLUSH(hw->base) & mask );
 }
 
-static void usb_flush_primed_endpoints(const uint32_t mask, const USBDevice* const device) {
-    usb_wait_for_endpoint_priming_to_finish(mask, device);
-	usb_flush_endpoints(mask, device);
-	usb_wait_for_endpoint_flushing_to_finish(mask, device);
+static void usb_flush_primed_endpoints(const uint32_t mask, const USBController* const hw) {
+    usb_wait_for_endpoint_priming_to_finish(mask, hw);
+	usb_flush_endpoints(mask, hw);
+	usb_wait_for_endpoint_flushing_to_finish(mask, hw);
 }
 
 static void usb_flush_all_primed_endpoints(const USBDevice* const device) {
-	usb_flush_primed_endpoints(0xFFFFFFFF, device);
+	usb_flush_primed_endpoints(0xFFFFFFFF, device->hw);
 }
 
 static void usb_endpoint_set_type(
@@ -154,31 +147,17 @@ static void usb_endpoint_set_type(
     const USBTransferType transfer_type
 ) {
     const uint_fast8_t endpoint_number = usb_endpoint_number(endpoint->address);
-	if(endpoint->device->controller == 0) {
-		if( usb_endpoint_is_in(endpoint->address) ) {
-			// clear transfer type bits
-			USB0_ENDPTCTRL(endpoint_number) &= ~(USB0_ENDPTCTRL_TXT1_0_MASK);
-			// set new transfer type bits
-			USB0_ENDPTCTRL(endpoint_number) |= (USB0_ENDPTCTRL_TXT1_0(transfer_type));
-		} else {
-			// clear transfer type bits
-			USB0_ENDPTCTRL(endpoint_number) &= ~(USB0_ENDPTCTRL_RXT_MASK);
-			// set new transfer type bits
-			USB0_ENDPTCTRL(endpoint_number) |= (USB0_ENDPTCTRL_RXT(transfer_type));
-		}
-	}
-	if(endpoint->device->controller == 1) {
-		if( usb_endpoint_is_in(endpoint->address) ) {
-			// clear transfer type bits
-			USB1_ENDPTCTRL(endpoint_number) &= ~(USB1_ENDPTCTRL_TXT1_0_MASK);
-			// set new transfer type bits
-			USB1_ENDPTCTRL(endpoint_number) |= (USB1_ENDPTCTRL_TXT1_0(transfer_type));
-		} else {
-			// clear transfer type bits
-			USB1_ENDPTCTRL(endpoint_number) &= ~(USB1_ENDPTCTRL_RXT_MASK);
-			// set new transfer type bits
-			USB1_ENDPTCTRL(endpoint_number) |= (USB1_ENDPTCTRL_RXT(transfer_type));
-		}
+	const uint32_t base = endpoint->hw->base;
+	if( usb_endpoint_is_in(endpoint->address) ) {
+		// clear transfer type bits
+		USB_ENDPTCTRL(base, endpoint_number) &= ~(USB0_ENDPTCTRL_TXT1_0_MASK);
+		// set new transfer type bits
+		USB_ENDPTCTRL(base, endpoint_number) |= (USB0_ENDPTCTRL_TXT1_0(transfer_type));
+	} else {
+		// clear transfer type bits
+		USB_ENDPTCTRL(base, endpoint_number) &= ~(USB0_ENDPTCTRL_RXT_MASK);
+		// set new transfer type bits
+		USB_ENDPTCTRL(base, endpoint_number) |= (USB0_ENDPTCTRL_RXT(transfer_type));
 	}
 }
 
@@ -186,56 +165,27 @@ static void usb_endpoint_enable(
     const USBEndpoint* const endpoint
 ) {
     const uint_fast8_t endpoint_number = usb_endpoint_number(endpoint->address);
-	if( endpoint->device->controller == 0 ) {
-		if( usb_endpoint_is_in(endpoint->address) ) {
-			USB0_ENDPTCTRL(endpoint_number) |= (USB0_ENDPTCTRL_TXE | USB0_ENDPTCTRL_TXR);
-		} else {
-			USB0_ENDPTCTRL(endpoint_number) |= (USB0_ENDPTCTRL_RXE | USB0_ENDPTCTRL_RXR);
-		}
-	}
-	if( endpoint->device->controller == 1 ) {
-		if( usb_endpoint_is_in(endpoint->address) ) {
-			USB1_ENDPTCTRL(endpoint_number) |= (USB1_ENDPTCTRL_TXE | USB1_ENDPTCTRL_TXR);
-		} else {
-			USB1_ENDPTCTRL(endpoint_number) |= (USB1_ENDPTCTRL_RXE | USB1_ENDPTCTRL_RXR);
-		}
+	const uint32_t base = endpoint->hw->base;
+	if( usb_endpoint_is_in(endpoint->address) ) {
+		USB_ENDPTCTRL(base, endpoint_number) |= (USB0_ENDPTCTRL_TXE | USB0_ENDPTCTRL_TXR);
+	} else {
+		USB_ENDPTCTRL(base, endpoint_number) |= (USB0_ENDPTCTRL_RXE | USB0_ENDPTCTRL_RXR);
 	}
 }
 
 static void usb_endpoint_clear_pending_interrupts(
     const USBEndpoint* const endpoint
 ) {
-    const uint_fast8_t endpoint_number = usb_endpoint_number(endpoint->address);
-	if(endpoint->device->controller == 0) {
-		if( usb_endpoint_is_in(endpoint->address) ) {
-			usb_clear_pending_interrupts(USB0_ENDPTCOMPLETE_ETCE(1 << endpoint_number),
-										 endpoint->device);
-		} else {
-			usb_clear_pending_interrupts(USB0_ENDPTCOMPLETE_ERCE(1 << endpoint_number),
-										 endpoint->device);
-		}
-	}
-	if(endpoint->device->controller == 1) {
-		if( usb_endpoint_is_in(endpoint->address) ) {
-			usb_clear_pending_interrupts(USB1_ENDPTCOMPLETE_ETCE(1 << endpoint_number),
-										 endpoint->device);
-		} else {
-			usb_clear_pending_interrupts(USB1_ENDPTCOMPLETE_ERCE(1 << endpoint_number),
-										 endpoint->device);
-		}
-	}
+	usb_clear_pending_interrupts(endpoint->mask,
+								 endpoint->device);
 }
 
 
 void usb_peripheral_reset(const USBDevice* const device) {
-	if( device->controller == 0 ) {    
-        Chip_RGU_TriggerReset(RGU_USB0_RST);
-        while(Chip_RGU_InReset(RGU_USB0_RST));
-    }
-    if( device->controller == 1 ) {
-        Chip_RGU_TriggerReset(RGU_USB1_RST);
-        while(Chip_RGU_InReset(RGU_USB1_RST));
-	}
+	// Also used before usb_device_init(), so device->hw may not be set
+	const USBController* const hw = &usb_controllers[device->controller];
+	Chip_RGU_TriggerReset(hw->reset);
+	while(Chip_RGU_InReset(hw->reset));
 }
 
 
@@ -243,19 +193,11 @@ void usb_endpoint_disable(
 	const USBEndpoint* const endpoint
 ) {
 	const uint_fast8_t endpoint_number = usb_endpoint_number(endpoint->address);
-	if(endpoint->device->controller == 0) {
-		if( usb_endpoint_is_in(endpoint->address) ) {
-			USB0_ENDPTCTRL(endpoint_number) &= ~(USB0_ENDPTCTRL_TXE);
-		} else {
-			USB0_ENDPTCTRL(endpoint_number) &= ~(USB0_ENDPTCTRL_RXE);
-		}
-	}
-	if(endpoint->device->controller == 1) {
-		if( usb_endpoint_is_in(endpoint->address) ) {
-			USB1_ENDPTCTRL(endpoint_number) &= ~(USB1_ENDPTCTRL_TXE);
-		} else {
-			USB1_ENDPTCTRL(endpoint_number) &= ~(USB1_ENDPTCTRL_RXE);
-		}
+	const uint32_t base = endpoint->hw->base;
+	if( usb_endpoint_is_in(endpoint->address) ) {
+		USB_ENDPTCTRL(base, endpoint_number) &= ~(USB0_ENDPTCTRL_TXE);
+	} else {
+		USB_ENDPTCTRL(base, endpoint_number) &= ~(USB0_ENDPTCTRL_RXE);
 	}
 
     usb_queue_flush_endpoint(endpoint);
@@ -267,7 +209,7 @@ static void usb_endpoint_prime(
 	const USBEndpoint* const endpoint,
 	USBTransferDescriptor* const first_td	
 ) {
-	USBQueueHead* const qh = usb_queue_head(endpoint->address, endpoint->device);
+	USBQueueHead* const qh = endpoint->qh;
 	
 	qh->next_dtd_pointer = first_td;
 	qh->total_bytes
@@ -276,41 +218,13 @@ static void usb_endpoint_prime(
 			)
 		;
 	
-	const uint_fast8_t endpoint_number = usb_endpoint_number(endpoint->address);
-	if(endpoint->device->controller == 0) {
-		if( usb_endpoint_is_in(endpoint->address) ) {
-			USB0_ENDPTPRIME = USB0_ENDPTPRIME_PETB(1 << endpoint_number);
-		} else {
-			USB0_ENDPTPRIME = USB0_ENDPTPRIME_PERB(1 << endpoint_number);
-		}
-	}
-	if(endpoint->device->controller == 1) {
-		if( usb_endpoint_is_in(endpoint->address) ) {
-			USB1_ENDPTPRIME = USB1_ENDPTPRIME_PETB(1 << endpoint_number);
-		} else {
-			USB1_ENDPTPRIME = USB1_ENDPTPRIME_PERB(1 << endpoint_number);
-		}
-	}
+	USB_ENDPTPRIME(endpoint->hw->base) = endpoint->mask;
 }
 
 static bool usb_endpoint_is_priming(
 	const USBEndpoint* const endpoint
 ) {
-	const uint_fast8_t endpoint_number = usb_endpoint_number(endpoint->address);
-	if(endpoint->device->controller == 0) {
-		if( usb_endpoint_is_in(endpoint->address) ) {
-			return USB0_ENDPTPRIME & USB0_ENDPTPRIME_PETB(1 << endpoint_number);
-		} else {
-			return USB0_ENDPTPRIME & USB0_ENDPTPRIME_PERB(1 << endpoint_number);
-		}
-	}
-	else {
-		if( usb_endpoint_is_in(endpoint->address) ) {
-			return USB1_ENDPTPRIME & USB1_ENDPTPRIME_PETB(1 << endpoint_number);
-		} else {
-			return USB1_ENDPTPRIME & USB1_ENDPTPRIME_PERB(1 << endpoint_number);
-		}
-	}
+	return USB_ENDPTPRIME(endpoint->hw->base) & endpoint->mask;
 }
 
 void usb_endpoint_schedule_wait(
@@ -322,8 +236,6 @@ void usb_endpoint_schedule_wait(
 	// TODO: This should be preceded by a flush?
 	while( usb_endpoint_is_ready(endpoint) );
 
-	td->next_dtd_pointer = USB_TD_NEXT_DTD_POINTER_TERMINATE;
-
 	usb_endpoint_prime(endpoint, td);
 }
 
@@ -332,6 +244,7 @@ void usb_endpoint_schedule_append(
 	USBTransferDescriptor* const tail_td,
 	USBTransferDescriptor* const new_td
 ) {
+	const uint32_t base = endpoint->hw->base;
 	bool done = 0;
 
 	tail_td->next_dtd_pointer = new_td;
@@ -340,88 +253,62 @@ void usb_endpoint_schedule_append(
 		return;
 	}
 
-	if(endpoint->device->controller == 0) {
-		do {
-			USB0_USBCMD_D |= USB0_USBCMD_D_ATDTW;
-			done = usb_endpoint_is_ready(endpoint);
-		} while (!(USB0_USBCMD_D & USB0_USBCMD_D_ATDTW));
-	
-		USB0_USBCMD_D &= ~USB0_USBCMD_D_ATDTW;
-	}
-	if(endpoint->device->controller == 1) {
-		do {
-			USB1_USBCMD_D |= USB1_USBCMD_D_ATDTW;
-			done = usb_endpoint_is_ready(endpoint);
-		} while (!(USB1_USBCMD_D & USB1_USBCMD_D_ATDTW));
-	
-		USB1_USBCMD_D &= ~USB1_USBCMD_D_ATDTW;
-	}
+	do {
+		USB_USBCMD_D(base) |= USB0_USBCMD_D_ATDTW;
+		done = usb_endpoint_is_ready(endpoint);
+	} while (!(USB_USBCMD_D(base) & USB0_USBCMD_D_ATDTW));
+
+	USB_USBCMD_D(base) &= ~USB0_USBCMD_D_ATDTW;
+
 	if(!done) {
 		usb_endpoint_prime(endpoint, new_td);
 	}
 }
 
+volatile USBTransferDescriptor* usb_endpoint_current_td(
+	const USBEndpoint* const endpoint
+) {
+	const uint32_t base = endpoint->hw->base;
+	USBQueueHead* const qh = endpoint->qh;
+	volatile USBTransferDescriptor* td = NULL;
+	bool ready = false;
+
+	// Sample the overlay and the endpoint status as a pair: the tripwire
+	// is cleared if the controller moved on to another dTD in between.
+	do {
+		USB_USBCMD_D(base) |= USB0_USBCMD_D_ATDTW;
+		td = qh->current_dtd_pointer;
+		ready = usb_endpoint_is_ready(endpoint);
+	} while (!(USB_USBCMD_D(base) & USB0_USBCMD_D_ATDTW));
+
+	USB_USBCMD_D(base) &= ~USB0_USBCMD_D_ATDTW;
+
+	return ready ? td : NULL;
+}
+
 void usb_endpoint_flush(
 	const USBEndpoint* const endpoint
 ) {
-	const uint_fast8_t endpoint_number = usb_endpoint_number(endpoint->address);
 	usb_queue_flush_endpoint(endpoint);
-	if(endpoint->device->controller == 0) {
-		if( usb_endpoint_is_in(endpoint->address) ) {
-			usb_flush_primed_endpoints(USB0_ENDPTFLUSH_FETB(1 << endpoint_number),
-									   endpoint->device);
-		} else {
-			usb_flush_primed_endpoints(USB0_ENDPTFLUSH_FERB(1 << endpoint_number),
-									   endpoint->device);
-		}
-	}
-	if(endpoint->device->controller == 1) {
-		if( usb_endpoint_is_in(endpoint->address) ) {
-			usb_flush_primed_endpoints(USB1_ENDPTFLUSH_FETB(1 << endpoint_number),
-									   endpoint->device);
-		} else {
-			usb_flush_primed_endpoints(USB1_ENDPTFLUSH_FERB(1 << endpoint_number),
-									   endpoint->device);
-		}
-	}
+	usb_endpoint_flush_primed(endpoint);
+}
+
+void usb_endpoint_flush_primed(
+	const USBEndpoint* const endpoint
+) {
+	usb_flush_primed_endpoints(endpoint->mask, endpoint->hw);
 }
 
 bool usb_endpoint_is_ready(
 	const USBEndpoint* const endpoint
 ) {
-	const uint_fast8_t endpoint_number = usb_endpoint_number(endpoint->address);
-	if(endpoint->device->controller == 0) {
-		if( usb_endpoint_is_in(endpoint->address) ) {
-			return USB0_ENDPTSTAT & USB0_ENDPTSTAT_ETBR(1 << endpoint_number);
-		} else {
-			return USB0_ENDPTSTAT & USB0_ENDPTSTAT_ERBR(1 << endpoint_number);
-		}
-	} else {
-		if( usb_endpoint_is_in(endpoint->address) ) {
-			return USB1_ENDPTSTAT & USB1_ENDPTSTAT_ETBR(1 << endpoint_number);
-		} else {
-			return USB1_ENDPTSTAT & USB1_ENDPTSTAT_ERBR(1 << endpoint_number);
-		}
-	}
+	return USB_ENDPTSTAT(endpoint->hw->base) & endpoint->mask;
 }
 
 bool usb_endpoint_is_complete(
 	const USBEndpoint* const endpoint
 ) {
-	const uint_fast8_t endpoint_number = usb_endpoint_number(endpoint->address);
-	if(endpoint->device->controller == 0) {
-		if( usb_endpoint_is_in(endpoint->address) ) {
-			return USB0_ENDPTCOMPLETE & USB0_ENDPTCOMPLETE_ETCE(1 << endpoint_number);
-		} else {
-			return USB0_ENDPTCOMPLETE & USB0_ENDPTCOMPLETE_ERCE(1 << endpoint_number);
-		}
-	} else {
-		if( usb_endpoint_is_in(endpoint->address) ) {
-			return USB1_ENDPTCOMPLETE & USB1_ENDPTCOMPLETE_ETCE(1 << endpoint_number);
-		} else {
-			return USB1_ENDPTCOMPLETE & USB1_ENDPTCOMPLETE_ERCE(1 << endpoint_number);
-		}
-	}
+	return USB_ENDPTCOMPLETE(endpoint->hw->base) & endpoint->mask;
 }
 
 void usb_endpoint_stall(
@@ -430,167 +317,116 @@ void usb_endpoint_stall(
 	// Endpoint is to be stalled as a pair -- both OUT and IN.
 	// See UM10503 section 23.10.5.2 "Stalling"
 	const uint_fast8_t endpoint_number = usb_endpoint_number(endpoint->address);
-	if(endpoint->device->controller == 0) {
-		USB0_ENDPTCTRL(endpoint_number) |= (USB0_ENDPTCTRL_RXS | USB0_ENDPTCTRL_TXS);
-	}
-	if(endpoint->device->controller == 1) {
-		USB1_ENDPTCTRL(endpoint_number) |= (USB1_ENDPTCTRL_RXS | USB1_ENDPTCTRL_TXS);
-	}
+	USB_ENDPTCTRL(endpoint->hw->base, endpoint_number)
+		|= (USB0_ENDPTCTRL_RXS | USB0_ENDPTCTRL_TXS);
 	
 	// TODO: Also need to reset data toggle in both directions?
 }
 
 void usb_controller_run(const USBDevice* const device) {
-	if( device->controller == 0) {
-		USB0_USBCMD_D |= USB0_USBCMD_D_RS;
-	}
-	if( device->controller == 1) {
-		USB1_USBCMD_D |= USB1_USBCMD_D_RS;
-	}
+	USB_USBCMD_D(device->hw->base) |= USB0_USBCMD_D_RS;
 }
 
 static void usb_controller_stop(const USBDevice* const device) {
-	if( device->controller == 0) {
-		USB0_USBCMD_D &= ~USB0_USBCMD_D_RS;
-	}
-	if( device->controller == 1) {
-		USB1_USBCMD_D &= ~USB1_USBCMD_D_RS;
-	}
+	USB_USBCMD_D(device->hw->base) &= ~USB0_USBCMD_D_RS;
 }
 
 static uint_fast8_t usb_controller_is_resetting(const USBDevice* const device) {
-	if( device->controller == 0) {
-		return (USB0_USBCMD_D & USB0_USBCMD_D_RST) != 0;
-	} else {
-		return (USB1_USBCMD_D & USB1_USBCMD_D_RST) != 0;
-	}
+	return (USB_USBCMD_D(device->hw->base) & USB0_USBCMD_D_RST) != 0;
 }
 
 static void usb_controller_set_device_mode(const USBDevice* const device) {
+	// Set peripheral mode
+	USB_USBMODE_D(device->hw->base) = USB0_USBMODE_D_CM1_0(2);
+
 	if( device->controller == 0) {
-		// Set USB0 peripheral mode
-		USB0_USBMODE_D = USB0_USBMODE_D_CM1_0(2);
-		
 		// Set device-related OTG flags
 		// OTG termination: controls pull-down on USB_DM
 		USB0_OTGSC = USB0_OTGSC_OT;
 	}
 	if( device->controller == 1) {
-		// Set USB1 peripheral mode
-		USB1_USBMODE_D = USB1_USBMODE_D_CM1_0(2);
+		if( device->phy == USB_PHY_ULPI ) {
+			USB1_PORTSC1_D = (USB1_PORTSC1_D
+				& ~(USB1_PORTSC1_D_PTS_MASK | USB1_PORTSC1_D_PFSC))
+				| USB1_PORTSC1_D_PTS(2);
+		} else {
+			// The on-chip PHY of USB1 only does full speed
+			LPC_SCU->SFSUSB = SFSUSB_ESEA | SFSUSB_EPWR | SFSUSB_VBUS;
+			USB1_PORTSC1_D = (USB1_PORTSC1_D & ~USB1_PORTSC1_D_PTS_MASK)
+				| USB1_PORTSC1_D_PTS(3)
+				| USB1_PORTSC1_D_PFSC;
+		}
 	}
 }
 
 USBSpeed usb_speed(
 	const USBDevice* const device
 ) {
-	if( device->controller == 0 ) {
-		switch( USB0_PORTSC1_D & USB0_PORTSC1_D_PSPD_MASK ) {
-		case USB0_PORTSC1_D_PSPD(0):
-			return USB_SPEED_FULL;
-		
-		case USB0_PORTSC1_D_PSPD(2):
-			return USB_SPEED_HIGH;
-		
-		default:
-			// TODO: What to do/return here? Is this even possible?
-			return USB_SPEED_FULL;
-		}
-	} else {
-		// TODO: This should not be possible with a more class-like
-		// implementation.
+	switch( USB_PORTSC1_D(device->hw->base) & USB0_PORTSC1_D_PSPD_MASK ) {
+	case USB0_PORTSC1_D_PSPD(2):
+		return USB_SPEED_HIGH;
+
+	default:
+		// PSPD(0), or the reserved values
 		return USB_SPEED_FULL;
 	}
 }
 
 static void usb_clear_status(const uint32_t status,
 							 const USBDevice* const device) {
- 	if( device->controller == 0 ) {
-		USB0_USBSTS_D = status;
-	}
-	if( device->controller == 1 ) {
-		USB1_USBSTS_D = status;
-	}
+	USB_USBSTS_D(device->hw->base) = status;
 }
 
 uint32_t usb_get_status(const USBDevice* const device) {
-    uint32_t status = 0;
+	const uint32_t base = device->hw->base;
 	// Mask status flags with enabled flag interrupts.
- 	if( device->controller == 0 ) {
-		status = USB0_USBSTS_D & USB0_USBINTR_D;
-	}
-	if( device->controller == 1 ) {
-		status = USB1_USBSTS_D & USB1_USBINTR_D;
-	}
+	const uint32_t status = USB_USBSTS_D(base) & USB_USBINTR_D(base);
 
     // Clear flags that were just read, leaving alone any flags that
     // were just set (after the read). It's important to read and
     // reset flags atomically! :-)
-	usb_clear_status(status, device);
+	if( status ) {
+		usb_clear_status(status, device);
+	}
 
 	return status;
 }
 
 void usb_clear_endpoint_setup_status(const uint32_t endpoint_setup_status,
 											const USBDevice* const device) {
- 	if( device->controller == 0 ) {
-		USB0_ENDPTSETUPSTAT = endpoint_setup_status;
-	}
-	if( device->controller == 1 ) {
-		USB1_ENDPTSETUPSTAT = endpoint_setup_status;
-	}
+	USB_ENDPTSETUPSTAT(device->hw->base) = endpoint_setup_status;
 }
 
 uint32_t usb_get_endpoint_setup_status(const USBDevice* const device) {
- 	if( device->controller == 0 ) {
-		return USB0_ENDPTSETUPSTAT;
-	} else {
-		return USB1_ENDPTSETUPSTAT;
-	}
+	return USB_ENDPTSETUPSTAT(device->hw->base)
+		& USB0_ENDPTSETUPSTAT_ENDPTSETUPSTAT_MASK;
 }
 
 void usb_clear_endpoint_complete(const uint32_t endpoint_complete,
 										const USBDevice* const device) {
-	if( device->controller == 0 ) {
-		USB0_ENDPTCOMPLETE = endpoint_complete;
-	}
-	if( device->controller == 1 ) {
-		USB1_ENDPTCOMPLETE = endpoint_complete;
-	}
+	USB_ENDPTCOMPLETE(device->hw->base) = endpoint_complete;
 }
 
 uint32_t usb_get_endpoint_complete(const USBDevice* const device) {
-	if( device->controller == 0 ) {
-		return USB0_ENDPTCOMPLETE;
-	} else {
-		return USB1_ENDPTCOMPLETE;
-	}
+	// Reserved bits are masked, they would be taken for endpoints
+	return USB_ENDPTCOMPLETE(device->hw->base)
+		& (USB0_ENDPTCOMPLETE_ERCE_MASK | USB0_ENDPTCOMPLETE_ETCE_MASK);
 }
 
 
+uint32_t usb_get_frame_index(const USBDevice* const device) {
+	return USB_FRINDEX_D(device->hw->base) & 0x3FFF;
+}
+
 uint32_t usb_get_endpoint_ready(const USBDevice* const device) {
-	if( device->controller == 0 ) {
-		return USB0_ENDPTSTAT;
-	} else {
-		return USB1_ENDPTSTAT;
-	}
+	return USB_ENDPTSTAT(device->hw->base);
 }
 
 static void usb_disable_all_endpoints(const USBDevice* const device) {
 	// Endpoint 0 is always enabled. TODO: So why set ENDPTCTRL0?
-	if( device->controller == 0 ) {
-		USB0_ENDPTCTRL0 &= ~(USB0_ENDPTCTRL0_RXE | USB0_ENDPTCTRL0_TXE);
-		USB0_ENDPTCTRL1 &= ~(USB0_ENDPTCTRL1_RXE | USB0_ENDPTCTRL1_TXE);
-		USB0_ENDPTCTRL2 &= ~(USB0_ENDPTCTRL2_RXE | USB0_ENDPTCTRL2_TXE);
-		USB0_ENDPTCTRL3 &= ~(USB0_ENDPTCTRL3_RXE | USB0_ENDPTCTRL3_TXE);
-		USB0_ENDPTCTRL4 &= ~(USB0_ENDPTCTRL4_RXE | USB0_ENDPTCTRL4_TXE);
-		USB0_ENDPTCTRL5 &= ~(USB0_ENDPTCTRL5_RXE | USB0_ENDPTCTRL5_TXE);
-	}
-	if( device->controller == 1 ) {
-		USB1_ENDPTCTRL0 &= ~(USB1_ENDPTCTRL0_RXE | USB1_ENDPTCTRL0_TXE);
-		USB1_ENDPTCTRL1 &= ~(USB1_ENDPTCTRL1_RXE | USB1_ENDPTCTRL1_TXE);
-		USB1_ENDPTCTRL2 &= ~(USB1_ENDPTCTRL2_RXE | USB1_ENDPTCTRL2_TXE);
-		USB1_ENDPTCTRL3 &= ~(USB1_ENDPTCTRL3_RXE | USB1_ENDPTCTRL3_TXE);
+	const uint32_t base = device->hw->base;
+	for( uint_fast8_t i = 0; i < device->hw->num_endpoints; i++ ) {
+		USB_ENDPTCTRL(base, i) &= ~(USB0_ENDPTCTRL_RXE | USB0_ENDPTCTRL_TXE);
 	}
 }
 
@@ -598,30 +434,24 @@ void usb_set_address_immediate(
 	const USBDevice* const device,
 	const uint_fast8_t address
 ) {
-	if( device->controller == 0 ) {
-		USB0_DEVICEADDR = USB0_DEVICEADDR_USBADR(address);
-	}
-	if( device->controller == 1 ) {
-		USB1_DEVICEADDR = USB1_DEVICEADDR_USBADR(address);
-	}
+	USB_DEVICEADDR(device->hw->base) = USB0_DEVICEADDR_USBADR(address);
+}
+
+uint_fast8_t usb_get_address(
+	const USBDevice* const device
+) {
+	return (USB_DEVICEADDR(device->hw->base) & USB0_DEVICEADDR_USBADR_MASK)
+		>> USB0_DEVICEADDR_USBADR_SHIFT;
 }
 
 void usb_set_address_deferred(
 	const USBDevice* const device,
 	const uint_fast8_t address
 ) {
-	if( device->controller == 0 ) {
-		USB0_DEVICEADDR
-			= USB0_DEVICEADDR_USBADR(address)
-		    | USB0_DEVICEADDR_USBADRA
-			;
-	}
-	if( device->controller == 1 ) {
-		USB1_DEVICEADDR
-			= USB1_DEVICEADDR_USBADR(address)
-		    | USB1_DEVICEADDR_USBADRA
-			;
-	}
+	USB_DEVICEADDR(device->hw->base)
+		= USB0_DEVICEADDR_USBADR(address)
+	    | USB0_DEVICEADDR_USBADRA
+		;
 }
 
 static void usb_reset_all_endpoints(
@@ -644,12 +474,7 @@ void usb_controller_reset(
 	// machines to initial values. Not recommended when device is in attached
 	// state -- effect on attached host is undefined. Detach first by flushing
 	// all primed endpoints and stopping controller.
-	if( device->controller == 0 ) {
-		USB0_USBCMD_D = USB0_USBCMD_D_RST;
-	}
-	if( device->controller == 1 ) {
-		USB1_USBCMD_D = USB1_USBCMD_D_RST;
-	}
+	USB_USBCMD_D(device->hw->base) = USB0_USBCMD_D_RST;
 
 	while( usb_controller_is_resetting(device) );
 }
@@ -677,31 +502,24 @@ void usb_bus_reset(
 static void usb_interrupt_disable(
 	USBDevice* const device
 ) {
-	if( device->controller == 0 ) {
-		NVIC_DisableIRQ(USB0_IRQn);
-	}
-	if( device->controller == 1 ) {
-		NVIC_DisableIRQ(USB1_IRQn);
-	}
+	NVIC_DisableIRQ(device->hw->irq);
 }
 
 static void usb_interrupt_enable(
 	USBDevice* const device
 ) {
-	if( device->controller == 0 ) {
-		NVIC_EnableIRQ(USB0_IRQn);
-	}
-	if( device->controller == 1 ) {
-		NVIC_EnableIRQ(USB1_IRQn);
-	}
+	NVIC_EnableIRQ(device->hw->irq);
 }
 
 void usb_device_init(
 	USBDevice* const device
 ) {
+	const USBController* const hw = &usb_controllers[device->controller];
+	device->hw = hw;
+	devices[device->controller] = device;
+	services[device->controller] = (USBService){ .mode = USB_SERVICE_INTERRUPT };
+
 	if( device->controller == 0 ) {
-		devices[0] = device;
-	
 		//Chip_Clock_DisablePLL(CGU_USB_PLL);
 		Chip_USB0_Init();
 
@@ -733,58 +551,39 @@ void usb_device_init(
 			// Chip_Clock_EnableOpts(CLK_MX_USB0, true, true, 1);
 			// /* enable USB0 phy */
 			// //Chip_CREG_EnableUSB0Phy();
+	}
+	if( device->controller == 1 ) {
+		// Runs the controller (and the full-speed PHY) at 60MHz from
+		// the USB PLL through CLK_IDIVA and CLK_IDIVD. A ULPI PHY
+		// supplies its own clock.
+		Chip_USB1_Init();
+	}
 
-		usb_controller_reset(device);
-		usb_controller_set_device_mode(device);
-	
-		// Set interrupt threshold interval to 0
-		USB0_USBCMD_D &= ~USB0_USBCMD_D_ITC_MASK;
+	usb_controller_reset(device);
+	usb_controller_set_device_mode(device);
 
-		// Configure endpoint list address 
-		USB0_ENDPOINTLISTADDR = (uint32_t)usb_qh0;
-	
-		// Enable interrupts
-		USB0_USBINTR_D =
-			  USB0_USBINTR_D_UE
-			| USB0_USBINTR_D_UEE
-			| USB0_USBINTR_D_PCE
-			| USB0_USBINTR_D_URE
-			| USB0_USBINTR_D_SLE
-			//| USB0_USBINTR_D_SRE
-			//| USB0_USBINTR_D_NAKE
-			;
-		USB0_OTGSC |= USB0_OTGSC_BSEIE | USB0_OTGSC_BSVIE;
+	// Set interrupt threshold interval to 0
+	USB_USBCMD_D(hw->base) &= ~USB0_USBCMD_D_ITC_MASK;
 
-		
-		
+	// Configure endpoint list address 
+	USB_ENDPOINTLISTADDR(hw->base) = (uint32_t)(uintptr_t)hw->qh;
+	// Endpoints bind to their queue head again in usb_endpoint_init()
+	for( uint_fast8_t i = 0; i < 2 * hw->num_endpoints; i++ ) {
+		hw->qh[i].endpoint = NULL;
 	}
-	if( device->controller == 1 ) {
-		devices[1] = device;
-	
-		//TODO init USB1 clocking
-		//usb_phy_enable(device);
-		// Uses CLK_IDIVA and CLK_IDIV_D. Probably unnecessary
-		Chip_USB1_Init();
-		
-		usb_controller_reset(device);
-		usb_controller_set_device_mode(device);
-	
-		// Set interrupt threshold interval to 0
-		USB1_USBCMD_D &= ~USB1_USBCMD_D_ITC_MASK;
 
-		// Configure endpoint list address 
-		USB1_ENDPOINTLISTADDR = (uint32_t)usb_qh1;
-	
-		// Enable interrupts
-		USB1_USBINTR_D =
-			  USB1_USBINTR_D_UE
-			| USB1_USBINTR_D_UEE
-			| USB1_USBINTR_D_PCE
-			| USB1_USBINTR_D_URE
-			//| USB1_USBINTR_D_SRE
-			| USB1_USBINTR_D_SLE
-			//| USB1_USBINTR_D_NAKE
-			;
+	// Enable interrupts
+	USB_USBINTR_D(hw->base) =
+		  USB0_USBINTR_D_UE
+		| USB0_USBINTR_D_UEE
+		| USB0_USBINTR_D_PCE
+		| USB0_USBINTR_D_URE
+		| USB0_USBINTR_D_SLE
+		//| USB0_USBINTR_D_SRE
+		//| USB0_USBINTR_D_NAKE
+		;
+	if( device->controller == 0 ) {
+		USB0_OTGSC |= USB0_OTGSC_BSEIE | USB0_OTGSC_BSVIE;
 	}
 
 	usb_endpoint_reset(device);
@@ -817,6 +616,42 @@ void usb_set_vbus_discharge(USBDevice* const device, bool enabled)
 	}
 }
 
+void usb_set_vbus_valid(USBDevice* const device, bool valid)
+{
+	if (device->controller == 1) {
+		if (valid) {
+			LPC_SCU->SFSUSB |= SFSUSB_VBUS;
+		} else {
+			LPC_SCU->SFSUSB &= ~SFSUSB_VBUS;
+		}
+	}
+}
+
+void usb_set_interrupt_threshold(USBDevice* const device, uint8_t microframes)
+{
+	// ITC only supports powers of two up to 64 microframes
+	uint32_t itc = 0;
+	if (microframes) {
+		itc = 1;
+		while (itc < microframes && itc < 64) {
+			itc <<= 1;
+		}
+	}
+
+	const uint32_t base = device->hw->base;
+	USB_USBCMD_D(base) = (USB_USBCMD_D(base) & ~USB0_USBCMD_D_ITC_MASK)
+		| USB0_USBCMD_D_ITC(itc);
+}
+
+void usb_set_sof_interrupt(USBDevice* const device, const bool enabled)
+{
+	if (enabled) {
+		USB_USBINTR_D(device->hw->base) |= USB0_USBINTR_D_SRE;
+	} else {
+		USB_USBINTR_D(device->hw->base) &= ~USB0_USBINTR_D_SRE;
+	}
+}
+
 void usb_disable_phy_clock()
 {
 	USB0_PORTSC1_D |= USB0_PORTSC1_D_PHCD;
@@ -830,7 +665,10 @@ void usb_enable_phy_clock()
 void usb_run(
 	USBDevice* const device
 ) {
-	usb_interrupt_enable(device);
+	usb_critical_init();
+	if( !services[device->controller].polling ) {
+		usb_interrupt_enable(device);
+	}
 	usb_controller_run(device);
 }
 
@@ -842,20 +680,12 @@ void usb_stop(USBDevice* const device)
 
 bool usb_device_is_suspended(USBDevice* const device)
 {
-	if (device->controller == 0) {
-		return USB0_PORTSC1_D & USB0_PORTSC1_D_SUSP;
-	}
-	// TODO USB1
-	return false;
+	return USB_PORTSC1_D(device->hw->base) & USB0_PORTSC1_D_SUSP;
 }
 
 bool usb_device_is_attached(USBDevice* const device)
 {
-	if (device->controller == 0) {
-		return USB0_PORTSC1_D & USB0_PORTSC1_D_CCS;
-	}
-	// TODO USB1
-	return false;
+	return USB_PORTSC1_D(device->hw->base) & USB0_PORTSC1_D_CCS;
 }
 
 static void copy_setup(USBSetup* const dst, const volatile uint8_t* const src) {
@@ -876,14 +706,23 @@ void usb_endpoint_init_without_descriptor(
   USBTransferType transfer_type
 ) {
 	usb_endpoint_flush(endpoint);
+
+	// wMaxPacketSize: packet size in bits 10:0, additional transactions
+	// per microframe in bits 12:11. MULT must be at least 1 for
+	// isochronous endpoints and 0 for all others: high-bandwidth interrupt
+	// endpoints run on the variable length protocol, the controller answers
+	// as many tokens per microframe as the host sends from the same dTD.
+	const uint_fast16_t packet_size = max_packet_size & 0x7FF;
+	const uint_fast8_t mult = (transfer_type == USB_TRANSFER_TYPE_ISOCHRONOUS)
+		? 1 + ((max_packet_size >> 11) & 0x3) : 0;
 	
 	// TODO: There are more capabilities to adjust based on the endpoint
 	// descriptor.
-	USBQueueHead* const qh = usb_queue_head(endpoint->address, endpoint->device);
+	USBQueueHead* const qh = endpoint->qh;
 	qh->capabilities
-		= USB_QH_CAPABILITIES_MULT(0)
+		= USB_QH_CAPABILITIES_MULT(mult)
 		| USB_QH_CAPABILITIES_ZLT
-		| USB_QH_CAPABILITIES_MPL(max_packet_size)
+		| USB_QH_CAPABILITIES_MPL(packet_size)
 		| ((transfer_type == USB_TRANSFER_TYPE_CONTROL) ? USB_QH_CAPABILITIES_IOS : 0)
 		;
 	qh->current_dtd_pointer = 0;
@@ -898,8 +737,8 @@ void usb_endpoint_init_without_descriptor(
 	qh->buffer_pointer_page[3] = 0;
 	qh->buffer_pointer_page[4] = 0;
 	
-	// This is how we look up an endpoint structure from an endpoint address:
-	qh->_reserved_0 = (uint32_t)endpoint;
+	qh->endpoint = (USBEndpoint*)endpoint;
+	usb_queue_configure_endpoint(endpoint, packet_size, mult);
 
 	usb_endpoint_set_type(endpoint, transfer_type);
 	
@@ -925,89 +764,74 @@ void usb_endpoint_init(
 
 }
 
+/* Both event handlers walk the set bits from the lowest up with a
+ * count-trailing-zeros, so their cost depends on the number of endpoints
+ * with an event, not on the number of endpoints of the controller. The
+ * order is the one of the register: the OUT endpoints from 0 up, then
+ * the IN endpoints. The events are acknowledged with a single write
+ * before any handler runs.
+ */
 static void usb_check_for_setup_events(const USBDevice* const device) {
 	const uint32_t endptsetupstat = usb_get_endpoint_setup_status(device);
-	uint32_t endptsetupstat_bit = 0;
-	if( endptsetupstat ) {
-		for( uint_fast8_t i=0; i<NUM_USB0_ENDPOINTS; i++ ) {
-			if(device->controller == 0) {
-				endptsetupstat_bit = USB0_ENDPTSETUPSTAT_ENDPTSETUPSTAT(1 << i);
-			}
-			if(device->controller == 1) {
-				endptsetupstat_bit = USB1_ENDPTSETUPSTAT_ENDPTSETUPSTAT(1 << i);
-			}
-			if( endptsetupstat & endptsetupstat_bit ) {
-				USBEndpoint* const endpoint = 
-					usb_endpoint_from_address(
-						usb_endpoint_address(USB_TRANSFER_DIRECTION_OUT, i),
-						device);
-				if( endpoint && endpoint->setup_complete ) {
-					copy_setup(&endpoint->setup,
-							   usb_queue_head(endpoint->address, endpoint->device)->setup);
-					// TODO: Clean up this duplicated effort by providing
-					// a cleaner way to get the SETUP data.
-					copy_setup(&endpoint->in->setup,
-							   usb_queue_head(endpoint->address, endpoint->device)->setup);
-					usb_clear_endpoint_setup_status(endptsetupstat_bit, device);
-					endpoint->setup_complete(endpoint);
-				} else {
-					usb_clear_endpoint_setup_status(endptsetupstat_bit, device);
-				}
-			}
+	if( endptsetupstat == 0 ) {
+		return;
+	}
+
+	// The SETUP data must be copied before the status is cleared
+	uint32_t pending = endptsetupstat;
+	while( pending ) {
+		const uint_fast8_t bit = __builtin_ctz(pending);
+		pending &= pending - 1;
+
+		USBEndpoint* const endpoint = usb_endpoint_by_bit(device, bit);
+		if( endpoint && endpoint->setup_complete ) {
+			const USBQueueHead* const qh = endpoint->qh;
+			copy_setup(&endpoint->setup, qh->setup);
+			// TODO: Clean up this duplicated effort by providing
+			// a cleaner way to get the SETUP data.
+			copy_setup(&endpoint->in->setup, qh->setup);
+		}
+	}
+	usb_clear_endpoint_setup_status(endptsetupstat, device);
+
+	pending = endptsetupstat;
+	while( pending ) {
+		const uint_fast8_t bit = __builtin_ctz(pending);
+		pending &= pending - 1;
+
+		USBEndpoint* const endpoint = usb_endpoint_by_bit(device, bit);
+		if( endpoint && endpoint->setup_complete ) {
+			endpoint->setup_complete(endpoint);
 		}
 	}
 }
 
 static void usb_check_for_transfer_events(const USBDevice* const device) {
-	const uint32_t endptcomplete = usb_get_endpoint_complete(device);
-	uint32_t endptcomplete_out_bit = 0;
-	uint32_t endptcomplete_in_bit = 0;
-	if( endptcomplete ) {
-		for( uint_fast8_t i=0; i<NUM_USB0_ENDPOINTS; i++ ) {
-			if(device->controller == 0) {
-				endptcomplete_out_bit = USB0_ENDPTCOMPLETE_ERCE(1 << i);
-			}
-			if(device->controller == 1) {
-				endptcomplete_out_bit = USB1_ENDPTCOMPLETE_ERCE(1 << i);
-			}
-			if( endptcomplete & endptcomplete_out_bit ) {
-				usb_clear_endpoint_complete(endptcomplete_out_bit, device);
-				USBEndpoint* const endpoint = 
-				usb_endpoint_from_address(
-					usb_endpoint_address(USB_TRANSFER_DIRECTION_OUT, i),
-					device);
-				
-				if( endpoint && endpoint->transfer_complete ) {
-					endpoint->transfer_complete(endpoint);
-				} 
-			}
-
-			if(device->controller == 0) {
-				endptcomplete_in_bit = USB0_ENDPTCOMPLETE_ETCE(1 << i);
-			}
-			if(device->controller == 1) {
-				endptcomplete_in_bit = USB1_ENDPTCOMPLETE_ETCE(1 << i);
-			}
-			if( endptcomplete & endptcomplete_in_bit ) {
-				usb_clear_endpoint_complete(endptcomplete_in_bit, device);
-				USBEndpoint* const endpoint = 
-				usb_endpoint_from_address(
-					usb_endpoint_address(USB_TRANSFER_DIRECTION_IN, i),
-					device);
-					if( endpoint && endpoint->transfer_complete ) {
-						endpoint->transfer_complete(endpoint);
-				}
-			}
+	uint32_t endptcomplete = usb_get_endpoint_complete(device);
+	if( endptcomplete == 0 ) {
+		return;
+	}
+	usb_clear_endpoint_complete(endptcomplete, device);
+
+	while( endptcomplete ) {
+		const uint_fast8_t bit = __builtin_ctz(endptcomplete);
+		endptcomplete &= endptcomplete - 1;
+
+		USBEndpoint* const endpoint = usb_endpoint_by_bit(device, bit);
+		if( endpoint && endpoint->transfer_complete ) {
+			endpoint->transfer_complete(endpoint);
 		}
 	}
 }
 
-void USB0_IRQHandler() {
-	const uint32_t status = usb_get_status(devices[0]);
+// Handles the USBSTS events both controllers have in common. Returns
+// false if there were none.
+static bool usb_handle_interrupt(USBDevice* const device) {
+	const uint32_t status = usb_get_status(device);
 	
 	if( status == 0 ) {
 		// Nothing to do.
-		return;
+		return false;
 	}
 	
 	if( status & USB0_USBSTS_D_UI ) {
@@ -1016,39 +840,40 @@ void USB0_IRQHandler() {
 		// - Short packet detected.
 		// - SETUP packet received.
 
-		usb_check_for_setup_events(devices[0]);
-		usb_check_for_transfer_events(devices[0]);
+		usb_check_for_setup_events(device);
+		usb_check_for_transfer_events(device);
 		
 		// TODO: Reset ignored ENDPTSETUPSTAT and ENDPTCOMPLETE flags?
 	}
 
 	if( status & USB0_USBSTS_D_SRI ) {
 		// Start Of Frame received.
-		if (devices[0]->start_of_frame) {
-			devices[0]->start_of_frame();
+		usb_queue_check_timeouts(device);
+		if (device->start_of_frame) {
+			device->start_of_frame();
 		}
 	}
 
 	if( status & USB0_USBSTS_D_PCI ) {
 		// Port change detect:
 		// Port controller entered full- or high-speed operational state.
-		if (devices[0]->port_change) {
-			devices[0]->port_change();
+		if (device->port_change) {
+			device->port_change();
 		}
 	}
 
 	if( status & USB0_USBSTS_D_SLI ) {
 		// Device controller suspend.
-		if (devices[0]->suspend) {
-			devices[0]->suspend();
+		if (device->suspend) {
+			device->suspend();
 		}
 	}
 
 	if( status & USB0_USBSTS_D_URI ) {
 		// USB reset received.
-		usb_bus_reset(devices[0]);
-		if (devices[0]->bus_reset) {
-			devices[0]->bus_reset();
+		usb_bus_reset(device);
+		if (device->bus_reset) {
+			device->bus_reset();
 		}
 	}
 
@@ -1065,12 +890,25 @@ void USB0_IRQHandler() {
 		// NAK enable bit are set.
 	}
 
+	return true;
+}
+
+static bool usb_service_events(USBDevice* const device) {
+	if( !usb_handle_interrupt(device) ) {
+		return false;
+	}
+
+	// USB1 has no OTG block: no VBUS events
+	if( device->controller != 0 ) {
+		return true;
+	}
+
 	if (USB0_OTGSC & USB0_OTGSC_BSEIE) {
 		//clear bit
 		USB0_OTGSC |= USB0_OTGSC_BSEIE;
-		//if ((USB0_OTGSC & USB0_OTGSC_BSE) && devices[0]->detach) {			
-		if (devices[0]->detach) {
-			devices[0]->detach();
+		//if ((USB0_OTGSC & USB0_OTGSC_BSE) && device->detach) {			
+		if (device->detach) {
+			device->detach();
 		}
 	}
 
@@ -1078,63 +916,97 @@ void USB0_IRQHandler() {
 		//clear bit
 		USB0_OTGSC |= USB0_OTGSC_BSVIE;
 
-		//if ((USB0_OTGSC & USB0_OTGSC_BSV) && devices[0]->attach) {
-		if (devices[0]->attach) {				
-			devices[0]->attach();
+		//if ((USB0_OTGSC & USB0_OTGSC_BSV) && device->attach) {
+		if (device->attach) {				
+			device->attach();
 		}
 	}
+	return true;
 }
 
-void USB1_IRQHandler() {
-  return;
-	const uint32_t status = usb_get_status(devices[1]);
-	
-	if( status == 0 ) {
-		// Nothing to do.
+// Everything the interrupt handler of a controller does. Returns false if
+// there were no events.
+static bool usb_service(USBDevice* const device) {
+	USBService* const service = &services[device->controller];
+	// A callback may poll again
+	const bool was_servicing = service->servicing;
+	service->servicing = true;
+	const bool handled = usb_service_events(device);
+	service->servicing = was_servicing;
+	return handled;
+}
+
+static void usb_service_interrupt(USBDevice* const device) {
+	if( !usb_service(device) ) {
 		return;
 	}
-	
-	if( status & USB1_USBSTS_D_UI ) {
-		// USB:
-		// - Completed transaction transfer descriptor has IOC set.
-		// - Short packet detected.
-		// - SETUP packet received.
 
-		usb_check_for_setup_events(devices[1]);
-		usb_check_for_transfer_events(devices[1]);
-		
-		// TODO: Reset ignored ENDPTSETUPSTAT and ENDPTCOMPLETE flags?
+	USBService* const service = &services[device->controller];
+	if( service->mode != USB_SERVICE_ADAPTIVE ) {
+		return;
 	}
 
-	if( status & USB1_USBSTS_D_SRI ) {
-		// Start Of Frame received.
+	// Count the interrupts per frame. Too many: leave them to usb_poll()
+	const uint16_t frame = usb_get_frame_index(device) >> 3;
+	if( frame != service->frame ) {
+		service->frame = frame;
+		service->irqs = 0;
 	}
-
-	if( status & USB1_USBSTS_D_PCI ) {
-		// Port change detect:
-		// Port controller entered full- or high-speed operational state.
+	if( ++service->irqs >= USB_ADAPTIVE_IRQS_PER_FRAME ) {
+		service->polling = true;
+		service->idle_polls = 0;
+		usb_interrupt_disable(device);
 	}
+}
 
-	if( status & USB1_USBSTS_D_SLI ) {
-		// Device controller suspend.
-	}
+void USB0_IRQHandler() {
+	usb_service_interrupt(devices[0]);
+}
 
-	if( status & USB1_USBSTS_D_URI ) {
-		// USB reset received.
-		usb_bus_reset(devices[1]);
+void USB1_IRQHandler() {
+	usb_service_interrupt(devices[1]);
+}
+
+bool usb_poll(USBDevice* const device) {
+	const usb_critical_t critical = usb_critical_enter();
+	const bool handled = usb_service(device);
+	usb_critical_exit(critical);
+
+	USBService* const service = &services[device->controller];
+	if( service->mode == USB_SERVICE_ADAPTIVE && service->polling ) {
+		if( handled ) {
+			service->idle_polls = 0;
+		} else if( ++service->idle_polls >= USB_ADAPTIVE_IDLE_POLLS ) {
+			// Quiet again: back to the interrupt, which fires right
+			// away for anything that arrived since the last poll
+			service->polling = false;
+			service->irqs = 0;
+			usb_interrupt_enable(device);
+		}
 	}
+	return handled;
+}
 
-	if( status & USB1_USBSTS_D_UEI ) {
-		// USB error:
-		// Completion of a USB transaction resulted in an error condition.
-		// Set along with USBINT if the TD on which the error interrupt
-		// occurred also had its interrupt on complete (IOC) bit set.
-		// The device controller detects resume signalling only.
-	}
+bool usb_is_polling(const USBDevice* const device) {
+	return services[device->controller].polling;
+}
 
-	if( status & USB1_USBSTS_D_NAKI ) {
-		// Both the TX/RX endpoint NAK bit and corresponding TX/RX endpoint
-		// NAK enable bit are set.
+bool usb_is_servicing(const USBDevice* const device) {
+	return services[device->controller].servicing;
+}
+
+void usb_set_service_mode(USBDevice* const device, const USBServiceMode mode) {
+	USBService* const service = &services[device->controller];
+	const bool was_polling = service->polling;
+
+	service->mode = mode;
+	service->polling = (mode == USB_SERVICE_POLL);
+	service->irqs = 0;
+	service->idle_polls = 0;
+
+	if( service->polling && !was_polling ) {
+		usb_interrupt_disable(device);
+	} else if( !service->polling && was_polling ) {
+		usb_interrupt_enable(device);
 	}
-	
-}
\ No newline at end of file
+}
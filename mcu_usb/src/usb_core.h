@@ -1,6 +1,8 @@
 #ifndef __USB_CORE_H__
 #define __USB_CORE_H__
 
+#include <chip.h>
+
 #include "lpc43xx_usb.h"
 #include "mcu_usb.h"
 
@@ -8,6 +10,34 @@
 #define NUM_USB0_ENDPOINTS 6
 #define NUM_USB1_ENDPOINTS 4
 
+// USB_SERVICE_ADAPTIVE: interrupts per frame that switch to polling, and
+// polls in a row without events that switch back to the interrupt
+#ifndef USB_ADAPTIVE_IRQS_PER_FRAME
+#define USB_ADAPTIVE_IRQS_PER_FRAME 8
+#endif
+#ifndef USB_ADAPTIVE_IDLE_POLLS
+#define USB_ADAPTIVE_IDLE_POLLS 16
+#endif
+
+// What differs between USB0 and USB1. Looked up once by controller number
+// and cached in USBDevice and USBEndpoint, so register accesses are an
+// offset from hw->base instead of a branch per controller.
+struct USBController {
+	uint32_t base;                  // register block: USB0_BASE, USB1_BASE
+	USBQueueHead *qh;               // endpoint list (ENDPOINTLISTADDR)
+	uint8_t num_endpoints;          // logical endpoints, including 0
+	IRQn_Type irq;
+	CHIP_RGU_RST_T reset;
+};
+
+extern const USBController usb_controllers[NUM_USB_CONTROLLERS];
+
+// Look up the controller, queue head and register bit of an endpoint from
+// its address and device, so the per-transfer paths don't have to.
+void usb_endpoint_bind(
+	USBEndpoint* const endpoint
+);
+
 typedef enum {
 	USB_TRANSFER_DIRECTION_OUT = 0,
 	USB_TRANSFER_DIRECTION_IN = 1,
@@ -35,6 +65,12 @@ USBSpeed usb_speed(
 	const USBDevice* const device
 );
 
+// Whether the events of the controller are being handled right now, by its
+// interrupt or by usb_poll(): the caller may be one of their callbacks.
+bool usb_is_servicing(
+	const USBDevice* const device
+);
+
 uint32_t usb_get_status(
 	const USBDevice* const device
 );
@@ -52,6 +88,12 @@ uint32_t usb_get_endpoint_ready(
 	const USBDevice* const device
 );
 
+// Current (micro)frame number: FRINDEX advances by 8 every millisecond at
+// both full and high speed, wrapping at 0x4000.
+uint32_t usb_get_frame_index(
+	const USBDevice* const device
+);
+
 uint32_t usb_get_endpoint_complete(
 	const USBDevice* const device
 );
@@ -66,6 +108,10 @@ void usb_set_address_immediate(
 	const uint_fast8_t address
 );
 
+uint_fast8_t usb_get_address(
+	const USBDevice* const device
+);
+
 void usb_set_address_deferred(
 	const USBDevice* const device,
 	const uint_fast8_t address
@@ -91,8 +137,16 @@ bool usb_endpoint_is_ready(
 	const USBEndpoint* const endpoint
 );
 
-// Schedule an already filled-in transfer descriptor for execution on
-// the given endpoint, waiting until the endpoint has finished.
+// Flush the TDs the controller has primed for the given endpoint, without
+// touching the transfer queue.
+void usb_endpoint_flush_primed(
+	const USBEndpoint* const endpoint
+);
+
+// Schedule an already filled-in transfer descriptor (or a chain of them)
+// for execution on the given endpoint, waiting until the endpoint has
+// finished. The user is responsible for setting the TERMINATE bit of
+// next_dtd_pointer of the last TD.
 void usb_endpoint_schedule_wait(
 	const USBEndpoint* const endpoint,
         USBTransferDescriptor* const td
@@ -109,4 +163,10 @@ void usb_endpoint_schedule_append(
         USBTransferDescriptor* const new_td
 );
 
+// The dTD the controller is working on for the given endpoint, or NULL if
+// the endpoint is not primed. Read under the ATDTW tripwire, like appends.
+volatile USBTransferDescriptor* usb_endpoint_current_td(
+        const USBEndpoint* const endpoint
+);
+
 #endif
\ No newline at end of file
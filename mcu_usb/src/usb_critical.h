@@ -0,0 +1,87 @@
+#ifndef __USB_CRITICAL_H__
+#define __USB_CRITICAL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <chip.h>
+#include <lpc_tools/irq.h>
+
+/* Critical sections against the USB interrupt.
+ *
+ * On Cortex-M3/M4 BASEPRI is raised to the priority of the USB interrupts,
+ * so interrupts of a higher priority (timers, ADC...) keep running. The
+ * queue API must therefore not be called from those. Cortex-M0 (and a USB
+ * interrupt at priority 0, which BASEPRI cannot mask) falls back to
+ * PRIMASK. The BASEPRI value is computed once, by usb_run(): set the
+ * priorities of the USB interrupts before that. Until then PRIMASK is
+ * used. Both save the previous state, so critical sections nest:
+ *
+ *      const usb_critical_t state = usb_critical_enter();
+ *      ...
+ *      usb_critical_exit(state);
+ *
+ * Do not WFI inside one: a pending interrupt that is masked by BASEPRI
+ * does not wake the core, one masked by PRIMASK does.
+ */
+
+typedef uint32_t usb_critical_t;
+
+#if defined(__ARM_ARCH_7M__) || defined (__ARM_ARCH_7EM__)
+
+/* BASEPRI value that masks both USB interrupts, 0 if that is impossible
+ * or usb_run() was not called yet
+ */
+extern uint32_t usb_critical_basepri;
+
+static inline void usb_critical_init(void)
+{
+        uint32_t priority = NVIC_GetPriority(USB0_IRQn);
+        const uint32_t usb1 = NVIC_GetPriority(USB1_IRQn);
+        if (usb1 < priority) {
+                priority = usb1;
+        }
+        usb_critical_basepri = priority << (8 - __NVIC_PRIO_BITS);
+}
+
+static inline usb_critical_t usb_critical_enter(void)
+{
+        const uint32_t basepri = usb_critical_basepri;
+        if (basepri == 0) {
+                return irq_disable();
+        }
+        const uint32_t previous = __get_BASEPRI();
+        // Only ever raise the masking level
+        if (previous == 0 || previous > basepri) {
+                __set_BASEPRI(basepri);
+        }
+        return previous;
+}
+
+static inline void usb_critical_exit(const usb_critical_t state)
+{
+        if (usb_critical_basepri == 0) {
+                irq_restore(state);
+        } else {
+                __set_BASEPRI(state);
+        }
+}
+
+#else
+
+static inline void usb_critical_init(void)
+{
+}
+
+static inline usb_critical_t usb_critical_enter(void)
+{
+        return irq_disable();
+}
+
+static inline void usb_critical_exit(const usb_critical_t state)
+{
+        irq_restore(state);
+}
+
+#endif
+
+#endif//__USB_CRITICAL_H__
@@ -1,4 +1,5 @@
 #include "usb_descriptors.h"
+#include "mcu_usb.h"
 #include <string.h>
 
 #define USB_WORD(x)	(x & 0xFF), ((x >> 8) & 0xFF)
@@ -154,6 +155,20 @@ bool descriptor_make_endpoint(
         return NULL;
     }
 
+    // Periodic endpoints: packets of up to 1024 bytes, and up to 2
+    // additional transactions per microframe. The other types have none.
+    const uint16_t packet_size = wMaxPacketSize & 0x7FF;
+    const uint8_t additional = (wMaxPacketSize >> 11) & 0x3;
+    const uint8_t type = bmAttributes & 0x3;
+    const bool periodic = (type == USB_TRANSFER_TYPE_ISOCHRONOUS)
+        || (type == USB_TRANSFER_TYPE_INTERRUPT);
+    if((additional == 3)                        // reserved
+            || (additional && !periodic)
+            || (periodic && (packet_size > 1024))) {
+        desc_storage.error_flag = true;
+        return NULL;
+    }
+
     uint8_t len = sizeof(USBDescriptorEndpoint);
 
     /*
@@ -1,7 +1,7 @@
 #include "usb_endpoint.h"
+#include "usb_core.h"
 #include "usb_queue.h"
 
-#define QUEUE_ALIGNMENT 64
 #define DEFAULT_ALIGNMENT 4
 
 
@@ -29,9 +29,11 @@ USBEndpoint *usb_endpoint_create(
 
     endpoint->address = bEndpointAddress;
     endpoint->device = device;
+    usb_endpoint_bind(endpoint);
    
     endpoint->setup_complete = setup_complete;
     endpoint->transfer_complete = transfer_complete;
+    endpoint->queue = NULL;
 
     // if IN endpoint
     if (usb_endpoint_is_in(endpoint->address)) {
@@ -96,7 +98,7 @@ uint8_t usb_endpoint_get_setup_request(const USBEndpoint *const endpoint)
 
 USBSetup* usb_endpoint_get_setup(const USBEndpoint *const endpoint)
 {
-    return &endpoint->setup;
+    return (USBSetup *)&endpoint->setup;
 }
 
 USBEndpoint* usb_endpoint_get_in_ep(const USBEndpoint *const endpoint)
@@ -117,7 +119,12 @@ USBTransferType usb_endpoint_descriptor_transfer_type(
 
 bool usb_endpoint_alloc_queue(USBEndpoint *endpoint, size_t pool_size, Alloc_cb alloc_cb)    
 {
-    USBTransfer *transfers = alloc_cb(sizeof(USBTransfer) * pool_size, QUEUE_ALIGNMENT);
+    USBTransferDescriptor *tds = alloc_cb(sizeof(USBTransferDescriptor) * pool_size,
+                                          USB_TD_ALIGNMENT);
+    if (!tds) {
+        return false;
+    }
+    USBTransfer *transfers = alloc_cb(sizeof(USBTransfer) * pool_size, DEFAULT_ALIGNMENT);
     if (!transfers) {
         return false;
     }
@@ -126,7 +133,8 @@ bool usb_endpoint_alloc_queue(USBEndpoint *endpoint, size_t pool_size, Alloc_cb
         return false;
     }
     queue->endpoint = endpoint;
-    queue->free_transfers = transfers;
+    queue->tds = tds;
+    queue->transfers = transfers;
     queue->pool_size = pool_size;
     usb_queue_init(queue);
     return true;
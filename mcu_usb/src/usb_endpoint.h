@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include "mcu_usb.h"
+#include "lpc43xx_usb.h"
 
 struct USBEndpoint
 {
@@ -11,6 +12,11 @@ struct USBEndpoint
     uint8_t buffer[8]; // Buffer for use during IN stage.
     uint_fast8_t address;
     USBDevice *device;
+    // Set once by usb_endpoint_create(), see usb_endpoint_bind()
+    const USBController *hw;    // controller of device
+    USBQueueHead *qh;           // queue head of this endpoint in hw->qh
+    uint32_t mask;              // bit in ENDPTPRIME/FLUSH/STAT/COMPLETE
+    struct _usb_queue_t *queue; // transfer queue, NULL if there is none
     USBEndpoint *in;
     USBEndpoint *out;
     void (*setup_complete)(USBEndpoint *const endpoint);
@@ -0,0 +1,72 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "mcu_usb.h"
+#include "usb_event_ring.h"
+
+/* head and tail run freely and are only masked to index the events. Each
+ * is written by one side only; the barriers make sure an event is complete
+ * before the producer publishes it, and read before the consumer hands its
+ * slot back.
+ */
+
+int usb_event_ring_init(
+        USBEventRing* const ring,
+        USBCompletionEvent* const events,
+        const uint32_t size
+) {
+        if (size == 0 || (size & (size - 1))) {
+                return -1;
+        }
+        ring->events = events;
+        ring->mask = size - 1;
+        ring->head = 0;
+        ring->tail = 0;
+        ring->dropped = 0;
+        return 0;
+}
+
+bool usb_event_ring_post(
+        USBEventRing* const ring,
+        const USBCompletionEvent* const event
+) {
+        const uint32_t head = ring->head;
+        if (head - ring->tail > ring->mask) {
+                ring->dropped++;
+                return false;
+        }
+        ring->events[head & ring->mask] = *event;
+        __sync_synchronize();
+        ring->head = head + 1;
+        return true;
+}
+
+size_t usb_event_ring_read(
+        USBEventRing* const ring,
+        USBCompletionEvent* const events,
+        const size_t max_count
+) {
+        uint32_t tail = ring->tail;
+        const uint32_t head = ring->head;
+        __sync_synchronize();
+
+        size_t count = 0;
+        while (tail != head && count < max_count) {
+                events[count++] = ring->events[tail & ring->mask];
+                tail++;
+        }
+        __sync_synchronize();
+        ring->tail = tail;
+        return count;
+}
+
+uint32_t usb_event_ring_count(const USBEventRing* const ring)
+{
+        return ring->head - ring->tail;
+}
+
+uint32_t usb_event_ring_dropped(const USBEventRing* const ring)
+{
+        return ring->dropped;
+}
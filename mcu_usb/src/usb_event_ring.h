@@ -0,0 +1,15 @@
+#ifndef __USB_EVENT_RING_H__
+#define __USB_EVENT_RING_H__
+
+#include "mcu_usb.h"
+
+/* Append an event. Only one context may post to a ring at a time: the USB
+ * interrupt, or a context that has it masked.
+ * Returns false (and counts a drop) if the ring is full.
+ */
+bool usb_event_ring_post(
+        USBEventRing* const ring,
+        const USBCompletionEvent* const event
+);
+
+#endif//__USB_EVENT_RING_H__
@@ -0,0 +1,122 @@
+#include "usb_iso.h"
+#include "usb_endpoint.h"
+#include "usb_queue.h"
+#include "usb_core.h"
+#include "usb_critical.h"
+
+// FRINDEX counts microframes in its lower 14 bits
+#define USB_FRINDEX_MASK 0x3FFF
+
+
+static void iso_transfer_complete(void *user_data, int transferred);
+
+static void iso_queue_slot(USBIso *iso, uint32_t slot)
+{
+    uint8_t *buffer = &iso->buffers[slot * iso->slot_size];
+    uint32_t length = iso->slot_size;
+    if(iso->in) {
+        length = iso->callback(iso->user_data, buffer, iso->slot_size);
+        if(length > iso->slot_size) {
+            length = iso->slot_size;
+        }
+    }
+
+    // Can not fail: usb_iso_start() checked the pool
+    usb_transfer_schedule(iso->endpoint, buffer, length,
+            iso_transfer_complete, iso);
+}
+
+static void iso_transfer_complete(void *user_data, int transferred)
+{
+    USBIso *iso = user_data;
+
+    // Flushed by usb_iso_stop()
+    if(transferred == USB_TRANSFER_FLUSHED || !iso->running) {
+        return;
+    }
+    // Any other failure: like a transaction error, the slot goes round
+    // without its data
+    if(transferred < 0) {
+        iso->errors++;
+        transferred = 0;
+    }
+
+    // Intervals that passed since the previous completion, beyond the
+    // one this slot was for, went by without data.
+    const uint32_t frame = usb_get_frame_index(iso->endpoint->device);
+    if(iso->slots) {
+        const uint32_t elapsed = (frame - iso->last_frame) & USB_FRINDEX_MASK;
+        if(elapsed >= 2 * iso->interval) {
+            iso->missed+= elapsed / iso->interval - 1;
+        }
+    }
+    iso->last_frame = frame;
+    iso->slots++;
+
+    const uint32_t slot = iso->next_slot;
+    iso->next_slot = (slot + 1 == iso->num_slots) ? 0 : slot + 1;
+
+    if(!iso->in) {
+        iso->callback(iso->user_data,
+                &iso->buffers[slot * iso->slot_size], transferred);
+    }
+    iso_queue_slot(iso, slot);
+}
+
+void usb_iso_init(USBIso *iso, const USBEndpoint *endpoint,
+        uint8_t *buffers, uint32_t slot_size, uint32_t num_slots,
+        uint32_t interval, usb_iso_cb callback, void *user_data)
+{
+    iso->endpoint = endpoint;
+    iso->buffers = buffers;
+    iso->slot_size = slot_size;
+    iso->num_slots = num_slots;
+    iso->interval = interval ? interval : 1;
+    iso->callback = callback;
+    iso->user_data = user_data;
+    iso->next_slot = 0;
+    iso->last_frame = 0;
+    iso->errors_start = 0;
+    iso->errors = 0;
+    iso->slots = 0;
+    iso->missed = 0;
+    iso->running = false;
+    iso->in = usb_endpoint_is_in(endpoint->address);
+}
+
+int usb_iso_start(USBIso *iso)
+{
+    // A completing slot is queued again before its own dTD is freed
+    if(usb_queue_free_slots(iso->endpoint) <= iso->num_slots) {
+        return -1;
+    }
+
+    const usb_critical_t sts = usb_critical_enter();
+    iso->next_slot = 0;
+    iso->slots = 0;
+    iso->missed = 0;
+    iso->errors_start = usb_queue_iso_errors(iso->endpoint);
+    iso->errors = 0;
+    iso->running = true;
+    for(uint32_t slot = 0; slot < iso->num_slots; slot++) {
+        iso_queue_slot(iso, slot);
+    }
+    usb_critical_exit(sts);
+    return 0;
+}
+
+void usb_iso_stop(USBIso *iso)
+{
+    const usb_critical_t sts = usb_critical_enter();
+    iso->running = false;
+    usb_endpoint_flush(iso->endpoint);
+    usb_critical_exit(sts);
+}
+
+void usb_iso_get_stats(const USBIso *iso, USBIsoStats *stats)
+{
+    stats->slots = iso->slots;
+    stats->missed = iso->missed;
+    stats->errors = usb_queue_iso_errors(iso->endpoint) - iso->errors_start
+        + iso->errors;
+}
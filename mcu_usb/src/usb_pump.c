@@ -0,0 +1,157 @@
+#include "usb_pump.h"
+#include "usb_endpoint.h"
+#include "usb_queue.h"
+#include "usb_critical.h"
+
+// Elements handed to the queue with one usb_transfer_schedule_batch()
+#define USB_PUMP_BATCH 8
+
+
+static uint32_t pump_dtds_per_elem(const USBPump *pump)
+{
+    return (pump->ring->ring->elem_sz + USB_TRANSFER_MAX_DTD_LENGTH - 1)
+        / USB_TRANSFER_MAX_DTD_LENGTH;
+}
+
+static void *pump_claim(USBPump *pump)
+{
+    if(pump->in) {
+        return usb_ringbuffer_claim_read_ptr(pump->ring);
+    }
+    return usb_ringbuffer_claim_write_ptr(pump->ring);
+}
+
+static void pump_cancel(USBPump *pump, void *elem)
+{
+    if(pump->in) {
+        usb_ringbuffer_cancel_read(pump->ring, elem);
+    } else {
+        usb_ringbuffer_cancel_write(pump->ring, elem);
+    }
+}
+
+static void pump_transfer_complete(void *user_data, int transferred)
+{
+    USBPump *pump = user_data;
+    pump->queued--;
+
+    // Flushed: usb_pump_stop() gives the element back
+    if(transferred == USB_TRANSFER_FLUSHED) {
+        return;
+    }
+    // Cancelled, timed out or failed: the ringbuffer can only retire its
+    // oldest element, so it completes without data
+    if(transferred < 0) {
+        transferred = 0;
+    }
+
+    // Transfers complete in order, so this is always the oldest element
+    if(pump->in) {
+        usb_ringbuffer_complete_read(pump->ring, NULL);
+    } else {
+        if(pump->lengths) {
+            // The oldest claimed element is the next one to commit
+            const Ringbuffer *ring = pump->ring->ring;
+            pump->lengths[ring->write.offset / ring->elem_sz] = transferred;
+        }
+        usb_ringbuffer_complete_write(pump->ring, NULL);
+    }
+    usb_pump_update(pump);
+}
+
+void usb_pump_init(USBPump *pump, const USBEndpoint *endpoint,
+        USBRingbuffer *ringbuffer, uint32_t depth)
+{
+    pump->endpoint = endpoint;
+    pump->ring = ringbuffer;
+    pump->lengths = NULL;
+    pump->depth = depth;
+    pump->queued = 0;
+    pump->running = false;
+    pump->in = usb_endpoint_is_in(endpoint->address);
+}
+
+void usb_pump_set_lengths(USBPump *pump, uint32_t *lengths)
+{
+    pump->lengths = lengths;
+}
+
+uint32_t usb_pump_length(const USBPump *pump, const void *elem)
+{
+    const Ringbuffer *ring = pump->ring->ring;
+    return pump->lengths[((const uint8_t *)elem - ring->first_elem)
+        / ring->elem_sz];
+}
+
+int usb_pump_start(USBPump *pump)
+{
+    // A completion queues the next element before its own dTDs are freed
+    if(usb_queue_free_slots(pump->endpoint)
+            <= pump->depth * pump_dtds_per_elem(pump)) {
+        return -1;
+    }
+
+    pump->running = true;
+    usb_pump_update(pump);
+    return 0;
+}
+
+void usb_pump_update(USBPump *pump)
+{
+    const uint32_t elem_sz = pump->ring->ring->elem_sz;
+    const uint32_t dtds_per_elem = pump_dtds_per_elem(pump);
+
+    const usb_critical_t sts = usb_critical_enter();
+    while(pump->running && (pump->queued < pump->depth)) {
+
+        // Completion callbacks run before their dTDs are back in the pool:
+        // only claim what fits, the next completion takes it from there.
+        const uint32_t room = usb_queue_free_slots(pump->endpoint)
+            / dtds_per_elem;
+
+        USBTransferRequest batch[USB_PUMP_BATCH];
+        size_t count = 0;
+        while((count < USB_PUMP_BATCH) && (count < room)
+                && (pump->queued + count < pump->depth)) {
+            void *elem = pump_claim(pump);
+            if(!elem) {
+                break;
+            }
+            batch[count++] = (USBTransferRequest){
+                elem, elem_sz, pump_transfer_complete, pump};
+        }
+        if(!count) {
+            break;
+        }
+
+        if(usb_transfer_schedule_batch(pump->endpoint, batch, count) != 0) {
+            // Should not happen as the pump owns the endpoint
+            while(count--) {
+                pump_cancel(pump, batch[count].data);
+            }
+            break;
+        }
+        pump->queued+= count;
+    }
+    usb_critical_exit(sts);
+}
+
+void usb_pump_stop(USBPump *pump)
+{
+    const usb_critical_t sts = usb_critical_enter();
+    pump->running = false;
+
+    const uint32_t pending = pump->queued;
+    usb_endpoint_flush(pump->endpoint);
+
+    // Cancels go newest first
+    for(uint32_t i = 0; i < pending; i++) {
+        pump_cancel(pump, NULL);
+    }
+    usb_critical_exit(sts);
+}
+
+uint32_t usb_pump_queued(const USBPump *pump)
+{
+    return pump->queued;
+}
@@ -5,134 +5,351 @@
 #include "mcu_usb.h"
 #include "usb_endpoint.h"
 #include "sync.h"
+#include <chip.h>
 #include <lpc_tools/irq.h>
 
 #include "usb_core.h"
 #include "usb_queue.h"
+#include "usb_event_ring.h"
+#include "usb_critical.h"
 
-usb_queue_t* endpoint_queues[NUM_USB_CONTROLLERS][12] = {};
+// Queues with deferred completions, by endpoint index
+static volatile uint32_t pending_events[NUM_USB_CONTROLLERS];
+
+// Queues with a transfer timeout, by endpoint index
+static volatile uint32_t timeout_queues[NUM_USB_CONTROLLERS];
+
+// Longest timeout: deadlines are compared over half the FRINDEX range
+#define USB_QUEUE_MAX_TIMEOUT 0x1FFF
 
 #define USB_ENDPOINT_INDEX(endpoint_address) (((endpoint_address & 0xF) * 2) + ((endpoint_address >> 7) & 1))
 
-static usb_queue_t* endpoint_queue(
-        const USBEndpoint* const endpoint
+// Queue of the endpoint bound to a queue head, for the per-index masks
+static usb_queue_t* indexed_queue(
+        const USBDevice* const device,
+        const uint32_t index
 ) {
-        uint32_t index = USB_ENDPOINT_INDEX(endpoint->address);
-        if (endpoint_queues[endpoint->device->controller][index] == NULL) while (1);
-        return endpoint_queues[endpoint->device->controller][index];
+        const USBEndpoint* const endpoint = device->hw->qh[index].endpoint;
+        return (endpoint != NULL) ? endpoint->queue : NULL;
 }
 
 void usb_queue_init(
         usb_queue_t* const queue
 ) {
         uint32_t index = USB_ENDPOINT_INDEX(queue->endpoint->address);
-        if (endpoint_queues[queue->endpoint->device->controller][index] != NULL) while (1);
-        endpoint_queues[queue->endpoint->device->controller][index] = queue;
+        queue->endpoint->queue = queue;
+        timeout_queues[queue->endpoint->device->controller] &= ~(1 << index);
+
+        queue->active = NULL;
+        queue->tail = NULL;
+        queue->transferred = 0;
+        queue->space_available = NULL;
+        queue->space_wanted = false;
+        queue->freed = 0;
+        queue->events = NULL;
+        queue->deferred = false;
+        queue->done = NULL;
+        queue->done_tail = NULL;
+        queue->iso = false;
+        queue->iso_mult = 0;
+        queue->max_dtd_length = USB_TRANSFER_MAX_DTD_LENGTH;
+        queue->iso_packet_size = 0;
+        queue->iso_errors = 0;
+        queue->errors = (USBQueueErrors){0};
+        queue->irq_policy = USB_IRQ_EVERY_TRANSFER;
+        queue->irq_interval = 1;
+        queue->irq_countdown = 1;
+        queue->timeout = 0;
+#ifdef MCU_USB_QUEUE_STATS
+        queue->depth = 0;
+        queue->stats = (USBQueueStats){0};
+#endif
 
-        usb_transfer_t* t = queue->free_transfers;
+        usb_transfer_t* t = queue->transfers;
         for (unsigned int i=0; i < queue->pool_size - 1; i++, t++) {
                 t->next = t+1;
-                t->queue = queue;
+                t->generation = 0;
         }
         t->next = NULL;
-        t->queue = queue;
+        t->generation = 0;
+        queue->free_transfers = queue->transfers;
+        queue->free_count = queue->pool_size;
+        queue->min_free = queue->pool_size;
 }
 
+void usb_queue_configure_endpoint(
+        const USBEndpoint* const endpoint,
+        const uint16_t packet_size,
+        const uint8_t mult
+) {
+        usb_queue_t* const queue = endpoint->queue;
+        if (queue == NULL) {
+                return;
+        }
+        queue->iso = (mult != 0);
+        queue->iso_mult = usb_endpoint_is_in(endpoint->address) ? mult : 0;
+        queue->max_dtd_length = queue->iso ? (mult * packet_size)
+                : USB_TRANSFER_MAX_DTD_LENGTH;
+        queue->iso_packet_size = packet_size;
+        queue->iso_errors = 0;
+}
+
+uint32_t usb_queue_iso_errors(const USBEndpoint* const endpoint)
+{
+        const usb_queue_t* const queue = endpoint->queue;
+        return (queue != NULL) ? queue->iso_errors : 0;
+}
 
+/* The dTD of a pool slot */
+static inline USBTransferDescriptor* transfer_td(
+        const usb_queue_t* const queue,
+        const usb_transfer_t* const transfer
+) {
+        return &queue->tds[transfer - queue->transfers];
+}
+
+
+
+#ifdef CORE_M4
+/* Take a slot from the free count, unless it is zero. The free count never
+ * exceeds the length of the free list: slots are only counted after they
+ * were put back in the list. A successful take therefore guarantees that
+ * the following pop finds a transfer.
+ */
+static bool pool_reserve(usb_queue_t* const queue)
+{
+        uint32_t free_count;
+        bool aborted;
+        do {
+                free_count = __ldrex(&queue->free_count);
+                if (free_count == 0) {
+                        __clrex();
+                        return false;
+                }
+                aborted = __strex(free_count - 1, &queue->free_count);
+        } while (aborted);
+
+        // Lower the low-water mark
+        do {
+                const uint32_t min_free = __ldrex(&queue->min_free);
+                if (min_free <= free_count - 1) {
+                        __clrex();
+                        break;
+                }
+                aborted = __strex(free_count - 1, &queue->min_free);
+        } while (aborted);
+        return true;
+}
+
+/* Return a slot to the free count, after its transfer is in the free list */
+static void pool_release(usb_queue_t* const queue)
+{
+        bool aborted;
+        do {
+                const uint32_t free_count = __ldrex(&queue->free_count);
+                aborted = __strex(free_count + 1, &queue->free_count);
+        } while (aborted);
+}
+#endif
 
 /* Allocate a transfer */
 static usb_transfer_t* allocate_transfer(
         usb_queue_t* const queue
 ) {
         usb_transfer_t* transfer;
-        if (queue->free_transfers == NULL)
-        return NULL;
 #ifdef CORE_M4
+        if (!pool_reserve(queue)) {
+                return NULL;
+        }
         bool aborted;
         do {
                 transfer = (void *) __ldrex((uint32_t *) &queue->free_transfers);
                 aborted = __strex((uint32_t) transfer->next, (uint32_t *) &queue->free_transfers);
         } while (aborted);
 #else
-        bool sts = irq_disable();
+        usb_critical_t sts = usb_critical_enter();
+        if (queue->free_count == 0) {
+                usb_critical_exit(sts);
+                return NULL;
+        }
+        if (--queue->free_count < queue->min_free) {
+                queue->min_free = queue->free_count;
+        }
         transfer = queue->free_transfers;
         queue->free_transfers = transfer->next;
-        irq_restore(sts);
+        usb_critical_exit(sts);
 #endif
         transfer->next = NULL;
         return transfer;
 }
 
 /* Place a transfer in the free list */
-static void free_transfer(usb_transfer_t* const transfer)
-{
-        usb_queue_t* const queue = transfer->queue;
+static void free_transfer(
+        usb_queue_t* const queue,
+        usb_transfer_t* const transfer
+) {
+        // Invalidates the handle of the transfer that used the slot
+        transfer->generation++;
 #ifdef CORE_M4        
         bool aborted;
         do {
                 transfer->next = (void *) __ldrex((uint32_t *) &queue->free_transfers);
                 aborted = __strex((uint32_t) transfer, (uint32_t *) &queue->free_transfers);
         } while (aborted);
+        pool_release(queue);
 #else
-        bool sts = irq_disable();
+        usb_critical_t sts = usb_critical_enter();
         transfer->next = queue->free_transfers;
         queue->free_transfers = transfer;
-        irq_restore(sts);
+        queue->free_count++;
+        usb_critical_exit(sts);
 #endif
 }
 
-/* Add a transfer to the end of an endpoint's queue. Returns the old
- * tail or NULL is the queue was empty
+/* Called when a submission did not fit in the pool. freed is the
+ * completion count read before the attempt: if transfers were returned
+ * since, the caller should try again. Otherwise the space_available
+ * callback is armed, under the critical section so that a completion
+ * can not slip in between and miss it.
  */
-static usb_transfer_t* endpoint_queue_transfer(
-        usb_transfer_t* const transfer
+static bool queue_want_space(
+        usb_queue_t* const queue,
+        const unsigned int freed
 ) {
-        usb_queue_t* const queue = transfer->queue;
-        transfer->next = NULL;
+        const usb_critical_t sts = usb_critical_enter();
+        const bool retry = (queue->freed != freed);
+        if (!retry) {
+                queue->space_wanted = true;
+        }
+        usb_critical_exit(sts);
+        return retry;
+}
+
+/* Called after transfers were returned to the pool */
+static void queue_space_freed(usb_queue_t* const queue)
+{
+        queue->freed++;
+        if (queue->space_wanted && queue->space_available) {
+                queue->space_wanted = false;
+                queue->space_available(queue->endpoint);
+        }
+}
+
+static bool in_interrupt(void)
+{
+        return __get_IPSR() != 0;
+}
+
+/* In an interrupt, or in a callback that usb_poll() runs: the USB events
+ * are not handled until we return, so nothing we wait for can happen.
+ */
+static bool in_event_context(const USBDevice* const device)
+{
+        return in_interrupt() || usb_is_servicing(device);
+}
+
+/* Add a chain of transfers to the end of an endpoint's queue. Returns the
+ * old tail or NULL is the queue was empty. Must be called with interrupts
+ * disabled.
+ */
+static usb_transfer_t* endpoint_queue_transfers(
+        usb_queue_t* const queue,
+        usb_transfer_t* const first,
+        usb_transfer_t* const last
+) {
+        last->next = NULL;
+        usb_transfer_t* const tail = queue->tail;
+        queue->tail = last;
         if (queue->active != NULL) {
-            usb_transfer_t* t = queue->active;
-            while (t->next != NULL) t = t->next;
-            t->next = transfer;
-            return t;
+            tail->next = first;
+            return tail;
         } else {
-            queue->active = transfer;
+            queue->active = first;
             return NULL;
         }
 }
                 
+static void queue_post_event(
+        usb_queue_t* const queue,
+        const usb_transfer_t* const transfer,
+        const unsigned int transferred,
+        const int32_t status
+) {
+        const USBCompletionEvent event = {
+                .endpoint = queue->endpoint,
+                .user_data = transfer->user_data,
+                .transferred = transferred,
+                .status = status,
+                .frame = usb_get_frame_index(queue->endpoint->device),
+        };
+        usb_event_ring_post(queue->events, &event);
+}
+
 static void usb_queue_flush_queue(usb_queue_t* const queue)
 {
-        irq_disable();
+        const usb_critical_t sts = usb_critical_enter();
 
         while (queue->active) {
                 usb_transfer_t* transfer = queue->active;
                 queue->active = transfer->next;
 
-                if (transfer->completion_cb) {
-                        transfer->completion_cb(transfer->user_data, -1);
+                if (queue->events != NULL) {
+                        if (!transfer->more) {
+                                queue_post_event(queue, transfer, 0,
+                                                 USB_TRANSFER_FLUSHED);
+                        }
+                } else if (transfer->completion_cb) {
+                        transfer->completion_cb(transfer->user_data,
+                                                USB_TRANSFER_FLUSHED);
                 }
 
-                free_transfer(transfer);
+                free_transfer(queue, transfer);
         }
-        irq_enable();
+        queue->tail = NULL;
+        queue->transferred = 0;
+#ifdef MCU_USB_QUEUE_STATS
+        queue->depth = 0;
+#endif
+        queue_space_freed(queue);
+        usb_critical_exit(sts);
 }
 
 void usb_queue_flush_endpoint(const USBEndpoint* const endpoint)
 {
-        usb_queue_flush_queue(endpoint_queue(endpoint));
+        usb_queue_t* const queue = endpoint->queue;
+        if (queue != NULL) {
+                usb_queue_flush_queue(queue);
+        }
 }
 
-int usb_transfer_schedule(
-	const USBEndpoint* const endpoint,
+/* An isochronous IN dTD sends its data in one microframe, as MultO
+ * packets. Returns 0 (use MULT of the queue head) for other endpoints.
+ */
+static inline uint32_t transfer_multo(
+        const usb_queue_t* const queue,
+        const uint32_t length
+) {
+        if (!queue->iso_mult) {
+                return 0;
+        }
+        uint32_t packets = (length + queue->iso_packet_size - 1) / queue->iso_packet_size;
+        if (packets == 0) {
+                packets = 1;
+        } else if (packets > queue->iso_mult) {
+                packets = queue->iso_mult;
+        }
+        return packets;
+}
+
+static void transfer_init(
+        usb_queue_t* const queue,
+        usb_transfer_t* const transfer,
 	void* const data,
 	const uint32_t maximum_length,
         const transfer_completion_cb completion_cb,
         void* const user_data
 ) {
-        usb_queue_t* const queue = endpoint_queue(endpoint);
-        usb_transfer_t* const transfer = allocate_transfer(queue);
-        if (transfer == NULL) return -1;
-        USBTransferDescriptor* const td = &transfer->td;
+        USBTransferDescriptor* const td = transfer_td(queue, transfer);
 
 	// Configure the transfer descriptor
         td->next_dtd_pointer = USB_TD_NEXT_DTD_POINTER_TERMINATE;
@@ -145,34 +362,380 @@ int usb_transfer_schedule(
 	td->capabilities.word =
 		  USB_TD_DTD_TOKEN_TOTAL_BYTES(maximum_length)
 		| USB_TD_DTD_TOKEN_IOC
-		| USB_TD_DTD_TOKEN_MULTO(0)
+		| USB_TD_DTD_TOKEN_MULTO(transfer_multo(queue, maximum_length))
 		| USB_TD_DTD_TOKEN_STATUS_ACTIVE
         	;
         
-	td->buffer_pointer_page[0] =  (uint32_t)data;
-	td->buffer_pointer_page[1] = ((uint32_t)data + 0x1000) & 0xfffff000;
-	td->buffer_pointer_page[2] = ((uint32_t)data + 0x2000) & 0xfffff000;
-	td->buffer_pointer_page[3] = ((uint32_t)data + 0x3000) & 0xfffff000;
-	td->buffer_pointer_page[4] = ((uint32_t)data + 0x4000) & 0xfffff000;
+	td->buffer_pointer_page[0] =  (uint32_t)(uintptr_t)data;
+	td->buffer_pointer_page[1] = ((uint32_t)(uintptr_t)data + 0x1000) & 0xfffff000;
+	td->buffer_pointer_page[2] = ((uint32_t)(uintptr_t)data + 0x2000) & 0xfffff000;
+	td->buffer_pointer_page[3] = ((uint32_t)(uintptr_t)data + 0x3000) & 0xfffff000;
+	td->buffer_pointer_page[4] = ((uint32_t)(uintptr_t)data + 0x4000) & 0xfffff000;
 
         // Fill in transfer fields
         transfer->maximum_length = maximum_length;
+        transfer->more = false;
+        transfer->expires = false;
         transfer->completion_cb = completion_cb;
         transfer->user_data = user_data;
+}
+
+/* Return a chain of transfers (linked through next) to the pool */
+static void free_transfer_chain(
+        usb_queue_t* const queue,
+        usb_transfer_t* transfer
+) {
+        while (transfer != NULL) {
+                usb_transfer_t* const next = transfer->next;
+                free_transfer(queue, transfer);
+                transfer = next;
+        }
+}
+
+/* Should the transfer being queued interrupt on completion? */
+static bool queue_irq_on_complete(
+        usb_queue_t* const queue,
+        const bool last_of_batch
+) {
+        switch (queue->irq_policy) {
+        case USB_IRQ_EVERY_N:
+                if (last_of_batch || --queue->irq_countdown == 0) {
+                        queue->irq_countdown = queue->irq_interval;
+                        return true;
+                }
+                return false;
+        case USB_IRQ_LAST_OF_BATCH:
+                return last_of_batch;
+        default:
+                return true;
+        }
+}
+
+/* Allocate and initialize the transfers for one request, splitting it
+ * into USB_TRANSFER_MAX_DTD_LENGTH sized dTDs, or dTDs of one microframe
+ * (MULT packets) on isochronous endpoints. The dTDs are linked and the
+ * last one is terminated. Returns the first transfer and stores the last
+ * one in *last, or returns NULL if the pool does not have enough room.
+ */
+static usb_transfer_t* transfer_chain_alloc(
+        usb_queue_t* const queue,
+        const USBTransferRequest* const request,
+        const bool last_of_batch,
+        usb_transfer_t** const last
+) {
+        // The driver has to see short packets on OUT endpoints to know where
+        // the transfer ended, so only IN endpoints can skip interrupts.
+        const bool interrupt_each = !usb_endpoint_is_in(queue->endpoint->address);
+
+        uint8_t* data = request->data;
+        uint32_t remaining = request->maximum_length;
+        usb_transfer_t* first = NULL;
+        usb_transfer_t* prev = NULL;
+        do {
+                usb_transfer_t* const transfer = allocate_transfer(queue);
+                if (transfer == NULL) {
+                        free_transfer_chain(queue, first);
+#ifdef MCU_USB_QUEUE_STATS
+                        queue->stats.pool_exhausted++;
+#endif
+                        return NULL;
+                }
+
+                const uint32_t length = (remaining > queue->max_dtd_length)
+                        ? queue->max_dtd_length : remaining;
+                data+= length;
+                remaining-= length;
+                if (remaining) {
+                        transfer_init(queue, transfer, data - length, length, NULL, NULL);
+                        transfer->more = true;
+                        if (!interrupt_each) {
+                                transfer_td(queue, transfer)->capabilities.word &= ~USB_TD_DTD_TOKEN_IOC;
+                        }
+                } else {
+                        transfer_init(queue, transfer, data - length, length,
+                                      request->completion_cb, request->user_data);
+                        if (!queue_irq_on_complete(queue, last_of_batch)) {
+                                transfer_td(queue, transfer)->capabilities.word &= ~USB_TD_DTD_TOKEN_IOC;
+                        }
+                        if (queue->timeout) {
+                                transfer->expires = true;
+                                transfer->deadline = (usb_get_frame_index(
+                                        queue->endpoint->device) + queue->timeout) & 0x3FFF;
+                        }
+#ifdef MCU_USB_QUEUE_STATS
+                        transfer->scheduled_frame =
+                                usb_get_frame_index(queue->endpoint->device);
+#endif
+                }
 
-        irq_disable();
-        usb_transfer_t* tail = endpoint_queue_transfer(transfer);
+                if (prev != NULL) {
+                        prev->next = transfer;
+                        transfer_td(queue, prev)->next_dtd_pointer = transfer_td(queue, transfer);
+                } else {
+                        first = transfer;
+                }
+                prev = transfer;
+        } while (remaining);
+
+        *last = prev;
+        return first;
+}
+
+/* Hand a chain of initialized transfers (linked through both next and
+ * their dTDs, the last one terminated) to the controller. The
+ * chain holds count transfers (not counting extra dTDs of large ones).
+ */
+static void queue_submit(
+        usb_queue_t* const queue,
+        usb_transfer_t* const first,
+        usb_transfer_t* const last,
+        const size_t count
+) {
+        const usb_critical_t sts = usb_critical_enter();
+#ifdef MCU_USB_QUEUE_STATS
+        queue->depth+= count;
+        if (queue->depth > queue->stats.max_depth) {
+                queue->stats.max_depth = queue->depth;
+        }
+#endif
+        usb_transfer_t* tail = endpoint_queue_transfers(queue, first, last);
         if (tail == NULL) {
                 // The queue is currently empty, we need to re-prime
-                usb_endpoint_schedule_wait(queue->endpoint, &transfer->td);
+                usb_endpoint_schedule_wait(queue->endpoint, transfer_td(queue, first));
         } else {
                 // The queue is currently running, try to append
-                usb_endpoint_schedule_append(queue->endpoint, &tail->td, &transfer->td);
+                usb_endpoint_schedule_append(queue->endpoint,
+                                             transfer_td(queue, tail),
+                                             transfer_td(queue, first));
         }
-        irq_enable();
+        usb_critical_exit(sts);
+}
+
+/* The handle of a transfer: pool index (plus one, so that it is never
+ * USB_TRANSFER_HANDLE_NONE) and generation of its last dTD.
+ */
+static USBTransferHandle transfer_handle(
+        const usb_queue_t* const queue,
+        const usb_transfer_t* const last
+) {
+        return ((uint32_t)last->generation << 16)
+                | (uint32_t)(last - queue->transfers + 1);
+}
+
+USBTransferHandle usb_transfer_schedule_handle(
+	const USBEndpoint* const endpoint,
+	void* const data,
+	const uint32_t maximum_length,
+        const transfer_completion_cb completion_cb,
+        void* const user_data
+) {
+        usb_queue_t* const queue = endpoint->queue;
+        if (queue == NULL) {
+                return USB_TRANSFER_HANDLE_NONE;
+        }
+        const USBTransferRequest request = {
+                .data = data,
+                .maximum_length = maximum_length,
+                .completion_cb = completion_cb,
+                .user_data = user_data,
+        };
+        usb_transfer_t* last;
+        usb_transfer_t* first;
+        unsigned int freed;
+        do {
+                freed = queue->freed;
+                first = transfer_chain_alloc(queue, &request, true, &last);
+                if (first == NULL && !queue_want_space(queue, freed)) {
+                        return USB_TRANSFER_HANDLE_NONE;
+                }
+        } while (first == NULL);
+
+        // Before submitting: the transfer may complete (and its slot be
+        // freed) right away
+        const USBTransferHandle handle = transfer_handle(queue, last);
+        queue_submit(queue, first, last, 1);
+        return handle;
+}
+
+int usb_transfer_schedule(
+	const USBEndpoint* const endpoint,
+	void* const data,
+	const uint32_t maximum_length,
+        const transfer_completion_cb completion_cb,
+        void* const user_data
+) {
+        const USBTransferHandle handle = usb_transfer_schedule_handle(
+                endpoint, data, maximum_length, completion_cb, user_data);
+        return (handle == USB_TRANSFER_HANDLE_NONE) ? -1 : 0;
+}
+
+/* Allocate and link the transfers of a batch, all or nothing. Returns the
+ * first transfer and stores the last one in *last, or returns NULL if the
+ * pool does not have room for all of them.
+ */
+static usb_transfer_t* batch_chain_alloc(
+        usb_queue_t* const queue,
+        const USBTransferRequest* const transfers,
+        const size_t count,
+        USBTransferHandle* const handles,
+        usb_transfer_t** const last
+) {
+        usb_transfer_t* first = NULL;
+        *last = NULL;
+
+        for (size_t i = 0; i < count; i++) {
+                usb_transfer_t* chain_last;
+                usb_transfer_t* const chain = transfer_chain_alloc(queue,
+                                &transfers[i], (i == count - 1), &chain_last);
+                if (chain == NULL) {
+                        // Return what we got to the pool
+                        free_transfer_chain(queue, first);
+                        return NULL;
+                }
+
+                if (*last != NULL) {
+                        (*last)->next = chain;
+                        transfer_td(queue, *last)->next_dtd_pointer = transfer_td(queue, chain);
+                } else {
+                        first = chain;
+                }
+                *last = chain_last;
+                if (handles != NULL) {
+                        handles[i] = transfer_handle(queue, chain_last);
+                }
+        }
+        return first;
+}
+
+int usb_transfer_schedule_batch_handles(
+	const USBEndpoint* const endpoint,
+        const USBTransferRequest* const transfers,
+        const size_t count,
+        USBTransferHandle* const handles
+) {
+        if (count == 0) return 0;
+
+        usb_queue_t* const queue = endpoint->queue;
+        if (queue == NULL) {
+                return -1;
+        }
+        usb_transfer_t* first;
+        usb_transfer_t* last;
+        unsigned int freed;
+        do {
+                freed = queue->freed;
+                first = batch_chain_alloc(queue, transfers, count, handles,
+                                          &last);
+                if (first == NULL && !queue_want_space(queue, freed)) {
+                        return -1;
+                }
+        } while (first == NULL);
+
+        queue_submit(queue, first, last, count);
         return 0;
 }
+
+int usb_transfer_schedule_batch(
+	const USBEndpoint* const endpoint,
+        const USBTransferRequest* const transfers,
+        const size_t count
+) {
+        return usb_transfer_schedule_batch_handles(endpoint, transfers,
+                                                   count, NULL);
+}
 	
+/* Invoke the callbacks of deferred completions and free their transfers */
+static void queue_process_done(usb_queue_t* const queue)
+{
+        while (queue->done != NULL) {
+                const usb_critical_t sts = usb_critical_enter();
+                usb_transfer_t* const transfer = queue->done;
+                if (transfer == NULL) {
+                        // Another context got there first
+                        usb_critical_exit(sts);
+                        break;
+                }
+                queue->done = transfer->next;
+                if (queue->done == NULL) {
+                        queue->done_tail = NULL;
+                }
+                usb_critical_exit(sts);
+
+                if (transfer->completion_cb) {
+                        transfer->completion_cb(transfer->user_data,
+                                (int) transfer_td(queue, transfer)->_reserved);
+                }
+                free_transfer(queue, transfer);
+                queue_space_freed(queue);
+        }
+}
+
+static int transfer_schedule_wait(
+	const USBEndpoint* const endpoint,
+	void* const data,
+	const uint32_t maximum_length,
+        const transfer_completion_cb completion_cb,
+        void* const user_data,
+        const bool forever,
+        const uint32_t timeout_ms
+) {
+        usb_queue_t* const queue = endpoint->queue;
+        if (queue == NULL) {
+                return -1;
+        }
+        // FRINDEX wraps every 2048ms
+        if (!forever && timeout_ms > USB_TRANSFER_WAIT_MAX_MS) {
+                return -1;
+        }
+        const uint32_t start = usb_get_frame_index(endpoint->device);
+
+        while (true) {
+                // Deferred completions only free their transfers when they
+                // are processed, which might be our job
+                if (!in_interrupt()) {
+                        queue_process_done(queue);
+                }
+
+                const unsigned int freed = queue->freed;
+                if (usb_transfer_schedule(endpoint, data, maximum_length,
+                                          completion_cb, user_data) == 0) {
+                        return 0;
+                }
+                if (in_event_context(endpoint->device)) {
+                        // The pool can only drain from the USB interrupt
+                        // or usb_poll()
+                        return -1;
+                }
+                // Nothing completes (and FRINDEX stands still) until the
+                // host is back
+                if (!usb_device_is_attached(endpoint->device)
+                    || usb_device_is_suspended(endpoint->device)) {
+                        return -1;
+                }
+                const uint32_t elapsed_ms =
+                        ((usb_get_frame_index(endpoint->device) - start) & 0x3FFF) >> 3;
+                if (!forever && elapsed_ms >= timeout_ms) {
+                        return -1;
+                }
+
+                // No interrupt to wake us up: handle the events ourselves
+                if (usb_is_polling(endpoint->device)) {
+                        usb_poll(endpoint->device);
+                        continue;
+                }
+
+                // Sleep until the next interrupt, unless a transfer completed
+                // since we tried. WFI wakes up on a pending interrupt even
+                // while PRIMASK masks it (BASEPRI would not wake it), so no
+                // wakeup is lost in between.
+                const bool sts = irq_disable();
+                if (queue->freed == freed && queue->done == NULL) {
+                        __WFI();
+                }
+                irq_restore(sts);
+        }
+}
+
 int usb_transfer_schedule_block(
 	const USBEndpoint* const endpoint,
 	void* const data,
@@ -180,12 +743,20 @@ int usb_transfer_schedule_block(
         const transfer_completion_cb completion_cb,
         void* const user_data
 ) {
-        int ret;
-        do {
-                ret = usb_transfer_schedule(endpoint, data, maximum_length,
-                                            completion_cb, user_data);
-        } while (ret == -1);
-        return 0;
+        return transfer_schedule_wait(endpoint, data, maximum_length,
+                                      completion_cb, user_data, true, 0);
+}
+
+int usb_transfer_schedule_wait(
+	const USBEndpoint* const endpoint,
+	void* const data,
+	const uint32_t maximum_length,
+        const transfer_completion_cb completion_cb,
+        void* const user_data,
+        const uint32_t timeout_ms
+) {
+        return transfer_schedule_wait(endpoint, data, maximum_length,
+                                      completion_cb, user_data, false, timeout_ms);
 }
 
 int usb_transfer_schedule_ack(
@@ -194,49 +765,555 @@ int usb_transfer_schedule_ack(
         return usb_transfer_schedule_block(endpoint, 0, 0, NULL, NULL);
 }
 
+/* A transfer that spans multiple dTDs received a short packet before its
+ * last dTD: the host ended it early (or one of its dTDs failed). Stop the
+ * endpoint, drop the remaining dTDs of the transfer and restart the
+ * endpoint at the next one.
+ * Returns the last transfer of the dropped chain, which carries the
+ * completion callback.
+ */
+static usb_transfer_t* queue_skip_remaining(
+        usb_queue_t* const queue,
+        usb_transfer_t* transfer
+) {
+        usb_endpoint_flush_primed(queue->endpoint);
+
+        while (transfer->more) {
+                usb_transfer_t* const next = transfer->next;
+                free_transfer(queue, transfer);
+                transfer = next;
+        }
+        queue->active = transfer->next;
+        if (queue->active == NULL) {
+                queue->tail = NULL;
+        } else {
+                usb_endpoint_schedule_wait(queue->endpoint,
+                                           transfer_td(queue, queue->active));
+        }
+        return transfer;
+}
+
+/* The completion status of a retired dTD, 0 if it succeeded. Errors are
+ * counted per endpoint.
+ */
+static int transfer_error(
+        usb_queue_t* const queue,
+        const uint8_t status
+) {
+        if (status & USB_TD_DTD_TOKEN_STATUS_HALTED) {
+                queue->errors.halted++;
+                return USB_TRANSFER_HALTED;
+        }
+        if (status & USB_TD_DTD_TOKEN_STATUS_BUFFER_ERROR) {
+                queue->errors.buffer_errors++;
+                return USB_TRANSFER_BUFFER_ERROR;
+        }
+        if (status & USB_TD_DTD_TOKEN_STATUS_TRANSACTION_ERROR) {
+                queue->errors.transaction_errors++;
+                return USB_TRANSFER_TRANSACTION_ERROR;
+        }
+        return 0;
+}
+
+#ifdef MCU_USB_QUEUE_STATS
+static void queue_stats_complete(
+        usb_queue_t* const queue,
+        const usb_transfer_t* const transfer,
+        const unsigned int transferred,
+        const bool short_packet
+) {
+        const uint32_t now = usb_get_frame_index(queue->endpoint->device);
+        queue->depth--;
+        queue->stats.bytes+= transferred;
+        queue->stats.transfers++;
+        if (short_packet) {
+                queue->stats.short_packets++;
+        }
+        queue->stats.latency_microframes+=
+                (now - transfer->scheduled_frame) & 0x3FFF;
+}
+#endif
+
+/* Leave a retired transfer for usb_process_events(). The controller is
+ * done with its dTD, so the reserved word holds the result (byte count or
+ * USBTransferStatus) until then. Called from the USB interrupt.
+ */
+static void queue_defer_completion(
+        usb_queue_t* const queue,
+        usb_transfer_t* const transfer,
+        const int result
+) {
+        transfer_td(queue, transfer)->_reserved = result;
+        transfer->next = NULL;
+        if (queue->done_tail != NULL) {
+                queue->done_tail->next = transfer;
+        } else {
+                queue->done = transfer;
+        }
+        queue->done_tail = transfer;
+
+        USBDevice* const device = queue->endpoint->device;
+        pending_events[device->controller] |=
+                1 << USB_ENDPOINT_INDEX(queue->endpoint->address);
+        if (device->events_pending) {
+                device->events_pending();
+        }
+}
+
 /* Called when an endpoint might have completed a transfer */
 void usb_queue_transfer_complete(USBEndpoint* const endpoint)
 {
-        usb_queue_t* const queue = endpoint_queue(endpoint);
-        if (queue == NULL) while(1); // Uh oh
+        usb_queue_t* const queue = endpoint->queue;
+        if (queue == NULL) {
+                return;
+        }
         usb_transfer_t* transfer = queue->active;
 
         while (transfer != NULL) {
-                uint8_t status = transfer->td.capabilities.word;
-
-                // Check for failures
-                if (   status & USB_TD_DTD_TOKEN_STATUS_HALTED
-                    || status & USB_TD_DTD_TOKEN_STATUS_BUFFER_ERROR
-                    || status & USB_TD_DTD_TOKEN_STATUS_TRANSACTION_ERROR) {
-                        // TODO: Uh oh, do something useful here
-                        while (1);
-                }
+                uint8_t status = transfer_td(queue, transfer)->capabilities.word;
 
                 // Still not finished
                 if (status & USB_TD_DTD_TOKEN_STATUS_ACTIVE) 
                         break;
 
+                // Check for failures
+                int error = transfer_error(queue, status);
+                if (error && queue->iso) {
+                        // Isochronous data is not retried: the slot
+                        // completes with whatever made it in its microframe
+                        queue->iso_errors++;
+                        error = 0;
+                }
+
                 // Advance the head. We need to do this before invoking the completion
                 // callback as it might attempt to schedule a new transfer
                 queue->active = transfer->next;
                 usb_transfer_t* next = transfer->next;
+                if (next == NULL) {
+                        queue->tail = NULL;
+                }
+
+                unsigned int total_bytes = transfer_td(queue, transfer)->capabilities.total_bytes;
+                queue->transferred+= transfer->maximum_length - total_bytes;
+#ifdef MCU_USB_QUEUE_STATS
+                const bool short_packet = (total_bytes != 0);
+#endif
+
+                if (transfer->more) {
+                        // Every microframe of an isochronous transfer
+                        // stands on its own, a short one does not end it
+                        if (!error && (total_bytes == 0 || queue->iso)) {
+                                // Wait for the rest of the transfer
+                                free_transfer(queue, transfer);
+                                transfer = next;
+                                continue;
+                        }
+                        usb_transfer_t* const short_transfer = transfer;
+                        transfer = queue_skip_remaining(queue, next);
+                        free_transfer(queue, short_transfer);
+                        next = queue->active;
+                } else if (error) {
+                        // The endpoint may have stopped: restart it at the
+                        // next transfer
+                        queue_skip_remaining(queue, transfer);
+                        next = queue->active;
+                }
 
                 // Invoke completion callback
-                unsigned int total_bytes = transfer->td.capabilities.total_bytes;
-                unsigned int transferred = transfer->maximum_length - total_bytes;
-                if (transfer->completion_cb) {
-                        transfer->completion_cb(transfer->user_data, transferred);
+                unsigned int transferred = queue->transferred;
+                queue->transferred = 0;
+#ifdef MCU_USB_QUEUE_STATS
+                queue_stats_complete(queue, transfer, transferred, short_packet);
+#endif
+                if (queue->events != NULL) {
+                        queue_post_event(queue, transfer, transferred, error);
+                } else if (queue->deferred) {
+                        queue_defer_completion(queue, transfer,
+                                               error ? error : (int) transferred);
+                        transfer = next;
+                        continue;
+                } else if (transfer->completion_cb) {
+                        transfer->completion_cb(transfer->user_data,
+                                                error ? error : (int) transferred);
                 }
 
                 // Advance head and free transfer
-                free_transfer(transfer);
+                free_transfer(queue, transfer);
+                queue_space_freed(queue);
                 transfer = next;
         }
 }
 
+/* Is the controller working on one of the dTDs from first to last? */
+static bool queue_chain_in_progress(
+        usb_queue_t* const queue,
+        usb_transfer_t* const first,
+        const usb_transfer_t* const last
+) {
+        volatile USBTransferDescriptor* const current =
+                usb_endpoint_current_td(queue->endpoint);
+        if (current == NULL) {
+                return false;
+        }
+        for (usb_transfer_t* t = first; ; t = t->next) {
+                if (transfer_td(queue, t) == current) {
+                        return true;
+                }
+                if (t == last) {
+                        return false;
+                }
+        }
+}
+
+/* Remove the dTDs from first to last (one transfer) from the queue and
+ * complete the transfer with status. before is the last dTD of the
+ * preceding transfer, NULL if the transfer is at the head. Must be called
+ * with interrupts disabled, after retiring finished transfers.
+ *
+ * Deferred completions queue up behind the ones retired before. A direct
+ * callback is left to the caller: returns last if it still has to go
+ * through queue_cancel_finish() once interrupts are enabled again.
+ */
+static usb_transfer_t* queue_cancel(
+        usb_queue_t* const queue,
+        usb_transfer_t* const before,
+        usb_transfer_t* const first,
+        usb_transfer_t* const last,
+        const int status
+) {
+        usb_transfer_t* const after = last->next;
+
+        bool in_progress;
+        if (before == NULL) {
+                // The controller is working on it (or about to)
+                queue->active = after;
+                if (after == NULL) {
+                        queue->tail = NULL;
+                }
+                queue->transferred = 0;
+                in_progress = true;
+        } else {
+                // The controller re-reads the next pointer of a dTD when it
+                // finishes it, so unlinking is enough unless it already
+                // moved on to the transfer
+                transfer_td(queue, before)->next_dtd_pointer = (after != NULL)
+                        ? transfer_td(queue, after)
+                        : USB_TD_NEXT_DTD_POINTER_TERMINATE;
+                before->next = after;
+                if (after == NULL) {
+                        queue->tail = before;
+                }
+                in_progress = queue_chain_in_progress(queue, first, last);
+        }
+
+        if (in_progress) {
+                // Stop the endpoint and restart it behind the transfer
+                usb_endpoint_flush_primed(queue->endpoint);
+                if (after != NULL) {
+                        usb_endpoint_schedule_wait(queue->endpoint,
+                                                   transfer_td(queue, after));
+                }
+        }
+
+#ifdef MCU_USB_QUEUE_STATS
+        queue->depth--;
+#endif
+        for (usb_transfer_t* t = first; t != last; ) {
+                usb_transfer_t* const next = t->next;
+                free_transfer(queue, t);
+                t = next;
+        }
+        last->next = NULL;
+        if (queue->events != NULL) {
+                queue_post_event(queue, last, 0, status);
+        } else if (queue->deferred) {
+                queue_defer_completion(queue, last, status);
+                return NULL;
+        } else if (last->completion_cb) {
+                return last;
+        }
+        free_transfer(queue, last);
+        queue_space_freed(queue);
+        return NULL;
+}
+
+/* Invoke the callback of a transfer queue_cancel() returned, and free it */
+static void queue_cancel_finish(
+        usb_queue_t* const queue,
+        usb_transfer_t* const transfer,
+        const int status
+) {
+        transfer->completion_cb(transfer->user_data, status);
+        free_transfer(queue, transfer);
+        queue_space_freed(queue);
+}
+
+int usb_transfer_cancel(
+        const USBEndpoint* const endpoint,
+        const USBTransferHandle handle
+) {
+        usb_queue_t* const queue = endpoint->queue;
+        if (queue == NULL) {
+                return -1;
+        }
+        const uint32_t index = (handle & 0xFFFF) - 1;
+        if (index >= queue->pool_size) {
+                return -1;
+        }
+        const usb_transfer_t* const target = &queue->transfers[index];
+        const uint16_t generation = handle >> 16;
+        const usb_critical_t sts = usb_critical_enter();
+
+        // Retire whatever the controller already finished, those transfers
+        // complete normally
+        usb_queue_transfer_complete(queue->endpoint);
+
+        // Find the dTDs of the transfer: the last one carries the callback,
+        // the ones before it (up to the previous transfer) are marked more
+        usb_transfer_t* before = NULL;
+        usb_transfer_t* first = queue->active;
+        usb_transfer_t* last = NULL;
+        for (usb_transfer_t* t = queue->active; t != NULL; t = t->next) {
+                if (t->more) {
+                        continue;
+                }
+                if (t == target) {
+                        // A newer transfer in the same slot is not ours
+                        if (t->generation == generation) {
+                                last = t;
+                        }
+                        break;
+                }
+                before = t;
+                first = t->next;
+        }
+        if (last == NULL) {
+                usb_critical_exit(sts);
+                return -1;
+        }
+
+        usb_transfer_t* const cancelled = queue_cancel(queue, before, first,
+                                                       last, USB_TRANSFER_CANCELLED);
+        usb_critical_exit(sts);
+
+        if (cancelled != NULL) {
+                queue_cancel_finish(queue, cancelled, USB_TRANSFER_CANCELLED);
+        }
+        return 0;
+}
+
+void usb_queue_set_timeout(
+        USBEndpoint* const endpoint,
+        const uint32_t microframes
+) {
+        usb_queue_t* const queue = endpoint->queue;
+        if (queue == NULL) {
+                return;
+        }
+        const uint32_t bit = 1 << USB_ENDPOINT_INDEX(endpoint->address);
+        const usb_critical_t sts = usb_critical_enter();
+        queue->timeout = (microframes > USB_QUEUE_MAX_TIMEOUT)
+                ? USB_QUEUE_MAX_TIMEOUT : microframes;
+        if (queue->timeout) {
+                timeout_queues[endpoint->device->controller] |= bit;
+        } else {
+                timeout_queues[endpoint->device->controller] &= ~bit;
+        }
+        usb_critical_exit(sts);
+}
+
+/* The last dTD of the transfer at the head, if that one has expired */
+static usb_transfer_t* queue_expired_head(
+        const usb_queue_t* const queue,
+        const uint32_t now
+) {
+        usb_transfer_t* last = queue->active;
+        if (last == NULL) {
+                return NULL;
+        }
+        while (last->more) {
+                last = last->next;
+        }
+        if (!last->expires || ((now - last->deadline) & 0x3FFF) > USB_QUEUE_MAX_TIMEOUT) {
+                return NULL;
+        }
+        return last;
+}
+
+static void queue_check_timeout(
+        usb_queue_t* const queue,
+        const uint32_t now
+) {
+        // Expired transfers whose callbacks are still due, in order
+        usb_transfer_t* expired = NULL;
+        usb_transfer_t* expired_tail = NULL;
+
+        const usb_critical_t sts = usb_critical_enter();
+        if (queue_expired_head(queue, now) != NULL) {
+                // It might just have finished
+                usb_queue_transfer_complete(queue->endpoint);
+
+                usb_transfer_t* last;
+                while ((last = queue_expired_head(queue, now)) != NULL) {
+                        usb_transfer_t* const cancelled = queue_cancel(queue,
+                                NULL, queue->active, last, USB_TRANSFER_TIMEOUT);
+                        if (cancelled == NULL) {
+                                continue;
+                        }
+                        if (expired_tail != NULL) {
+                                expired_tail->next = cancelled;
+                        } else {
+                                expired = cancelled;
+                        }
+                        expired_tail = cancelled;
+                }
+        }
+        usb_critical_exit(sts);
+
+        while (expired != NULL) {
+                usb_transfer_t* const next = expired->next;
+                queue_cancel_finish(queue, expired, USB_TRANSFER_TIMEOUT);
+                expired = next;
+        }
+}
+
+void usb_queue_check_timeouts(USBDevice* const device)
+{
+        uint32_t queues = timeout_queues[device->controller];
+        if (queues == 0) {
+                return;
+        }
+        const uint32_t now = usb_get_frame_index(device);
+        while (queues) {
+                const uint32_t index = __builtin_ctz(queues);
+                queues&= queues - 1;
+                usb_queue_t* const queue = indexed_queue(device, index);
+                if (queue != NULL) {
+                        queue_check_timeout(queue, now);
+                }
+        }
+}
+
+void usb_queue_set_event_ring(
+        USBEndpoint* const endpoint,
+        USBEventRing* const ring
+) {
+        usb_queue_t* const queue = endpoint->queue;
+        if (queue == NULL) {
+                return;
+        }
+        queue->events = ring;
+}
+
+void usb_queue_set_deferred_completion(
+        USBEndpoint* const endpoint,
+        const bool deferred
+) {
+        usb_queue_t* const queue = endpoint->queue;
+        if (queue == NULL) {
+                return;
+        }
+        queue->deferred = deferred;
+}
+
+bool usb_events_pending(const USBDevice* const device)
+{
+        return pending_events[device->controller] != 0;
+}
+
+void usb_process_events(USBDevice* const device)
+{
+        const usb_critical_t sts = usb_critical_enter();
+        uint32_t pending = pending_events[device->controller];
+        pending_events[device->controller] = 0;
+        usb_critical_exit(sts);
+
+        while (pending) {
+                const uint32_t index = __builtin_ctz(pending);
+                pending&= pending - 1;
+                usb_queue_t* const queue = indexed_queue(device, index);
+                if (queue != NULL) {
+                        queue_process_done(queue);
+                }
+        }
+}
+
+void usb_queue_set_space_available_cb(
+        USBEndpoint* const endpoint,
+        const Endpoint_cb space_available
+) {
+        usb_queue_t* const queue = endpoint->queue;
+        if (queue == NULL) {
+                return;
+        }
+        queue->space_available = space_available;
+}
+
+void usb_queue_set_irq_policy(
+        USBEndpoint* const endpoint,
+        const USBIrqPolicy policy,
+        const uint32_t n
+) {
+        usb_queue_t* const queue = endpoint->queue;
+        if (queue == NULL) {
+                return;
+        }
+        queue->irq_policy = policy;
+        queue->irq_interval = n ? n : 1;
+        queue->irq_countdown = queue->irq_interval;
+}
+
+bool usb_queue_get_stats(
+        USBEndpoint* const endpoint,
+        USBQueueStats* const stats
+) {
+#ifdef MCU_USB_QUEUE_STATS
+        usb_queue_t* const queue = endpoint->queue;
+        if (queue == NULL) {
+                *stats = (USBQueueStats){0};
+                return false;
+        }
+        const usb_critical_t sts = usb_critical_enter();
+        *stats = queue->stats;
+        usb_critical_exit(sts);
+        return true;
+#else
+        *stats = (USBQueueStats){0};
+        return false;
+#endif
+}
+
+void usb_queue_get_errors(
+        const USBEndpoint* const endpoint,
+        USBQueueErrors* const errors
+) {
+        const usb_queue_t* const queue = endpoint->queue;
+        if (queue == NULL) {
+                *errors = (USBQueueErrors){0};
+                return;
+        }
+        const usb_critical_t sts = usb_critical_enter();
+        *errors = queue->errors;
+        usb_critical_exit(sts);
+}
+
+void usb_queue_reset_stats(USBEndpoint* const endpoint)
+{
+#ifdef MCU_USB_QUEUE_STATS
+        usb_queue_t* const queue = endpoint->queue;
+        if (queue == NULL) {
+                return;
+        }
+        const usb_critical_t sts = usb_critical_enter();
+        queue->stats = (USBQueueStats){0};
+        queue->stats.max_depth = queue->depth;
+        usb_critical_exit(sts);
+#endif
+}
+
 bool usb_queue_active(USBEndpoint *const endpoint)
 {
-        usb_queue_t* const queue = endpoint_queue(endpoint);
+        usb_queue_t* const queue = endpoint->queue;
         if (!queue) {
                 return 0;
         }
@@ -244,24 +1321,53 @@ bool usb_queue_active(USBEndpoint *const endpoint)
         return transfer != NULL;
 }
 
+uint32_t usb_queue_free_slots(const USBEndpoint* const endpoint)
+{
+        const usb_queue_t* const queue = endpoint->queue;
+        return (queue != NULL) ? queue->free_count : 0;
+}
+
+uint32_t usb_queue_used_slots(const USBEndpoint* const endpoint)
+{
+        const usb_queue_t* const queue = endpoint->queue;
+        if (queue == NULL) {
+                return 0;
+        }
+        return queue->pool_size - queue->free_count;
+}
+
+uint32_t usb_queue_max_used_slots(const USBEndpoint* const endpoint)
+{
+        const usb_queue_t* const queue = endpoint->queue;
+        if (queue == NULL) {
+                return 0;
+        }
+        return queue->pool_size - queue->min_free;
+}
+
+void usb_queue_reset_max_used_slots(const USBEndpoint* const endpoint)
+{
+        usb_queue_t* const queue = endpoint->queue;
+        if (queue == NULL) {
+                return;
+        }
+        const usb_critical_t sts = usb_critical_enter();
+        queue->min_free = queue->free_count;
+        usb_critical_exit(sts);
+}
+
 uint32_t queue_free_space(USBEndpoint *const endpoint)
 {
-        usb_queue_t* const queue = endpoint_queue(endpoint);
+        usb_queue_t* const queue = endpoint->queue;
         if (!queue) {
                 return 0;
         }
-        usb_transfer_t* transfer = queue->free_transfers;
-        uint32_t count = 0;
-        while(transfer) {
-                count++;
-                transfer = transfer->next;
-        }
-        return count;
+        return queue->free_count;
 }
 
 int usb_queue_transferred_bytes(USBEndpoint* const endpoint)
 {
-        usb_queue_t* const queue = endpoint_queue(endpoint);
+        usb_queue_t* const queue = endpoint->queue;
         if (queue == NULL) {
                 return -1;
         }
@@ -271,7 +1377,7 @@ int usb_queue_transferred_bytes(USBEndpoint* const endpoint)
                 //while(!d);
                 return -2;
         }
-        unsigned int total_bytes = transfer->td.capabilities.total_bytes;
-        int transferred = transfer->maximum_length - total_bytes;
+        unsigned int total_bytes = transfer_td(queue, transfer)->capabilities.total_bytes;
+        int transferred = queue->transferred + transfer->maximum_length - total_bytes;
         return transferred;
 }
@@ -4,17 +4,33 @@
 #include "lpc43xx_usb.h"
 #include "mcu_usb.h"
 
+// Longest dTD the queue creates: larger transfers are split into a chain of
+// dTDs. Any buffer offset leaves room for 16K in the five buffer pages.
+#define USB_TRANSFER_MAX_DTD_LENGTH 0x4000
+
+// Hardware alignment of a dTD (also its size on the target)
+#define USB_TD_ALIGNMENT 32
+
 typedef struct _usb_transfer_t usb_transfer_t;
 typedef struct _usb_queue_t usb_queue_t;
 
+// Bookkeeping of one pool slot. The dTD of the slot lives in a separate
+// array (usb_queue_t.tds) at the same index, so that dTDs can be packed at
+// their 32 byte hardware alignment. 32 byte aligned dTDs never cross a 4K
+// page.
 // This is an opaque datatype. Thou shall not touch these members.
 struct _usb_transfer_t {
-        USBTransferDescriptor td ATTR_ALIGNED(64);
         struct _usb_transfer_t* next;
-        unsigned int maximum_length;
-        struct _usb_queue_t* queue;
         transfer_completion_cb completion_cb;
         void* user_data;
+        uint16_t maximum_length; // at most USB_TRANSFER_MAX_DTD_LENGTH
+        bool more;              // more dTDs of the same transfer follow
+        bool expires;           // deadline is valid (last dTD only)
+        uint16_t deadline;      // FRINDEX at which the transfer times out
+        uint16_t generation;    // bumped on every free, for transfer handles
+#ifdef MCU_USB_QUEUE_STATS
+        uint16_t scheduled_frame; // FRINDEX at submission
+#endif
 };
 typedef struct _usb_transfer_t USBTransfer;
 
@@ -22,18 +38,48 @@ typedef struct _usb_transfer_t USBTransfer;
 struct _usb_queue_t {
         struct USBEndpoint* endpoint;
         unsigned int pool_size;
+        USBTransferDescriptor* tds;     // pool_size dTDs, 32 byte aligned
+        usb_transfer_t* transfers;      // pool_size slots
         usb_transfer_t* volatile free_transfers;
+        volatile uint32_t free_count;   // slots in free_transfers
+        volatile uint32_t min_free;     // low-water mark of free_count
         usb_transfer_t* volatile active;
+        usb_transfer_t* volatile tail;
+        unsigned int transferred; // completed bytes of the transfer at the head
+        Endpoint_cb space_available;
+        volatile bool space_wanted;     // a submission was rejected
+        volatile unsigned int freed;    // completion count, to detect progress
+        USBEventRing* events;           // post completions here instead of callbacks
+        bool deferred;                  // leave completions to usb_process_events()
+        usb_transfer_t* volatile done;  // retired transfers awaiting their callback
+        usb_transfer_t* done_tail;
+        bool iso;                       // isochronous endpoint
+        uint8_t iso_mult;               // isochronous IN: packets per microframe
+        uint16_t max_dtd_length;        // isochronous: one microframe per dTD
+        uint16_t iso_packet_size;
+        volatile uint32_t iso_errors;   // slots retired with an error
+        USBQueueErrors errors;
+        USBIrqPolicy irq_policy;
+        unsigned int irq_interval;
+        unsigned int irq_countdown;
+        uint16_t timeout;               // microframes, 0 for none
+#ifdef MCU_USB_QUEUE_STATS
+        unsigned int depth;             // transfers currently queued
+        USBQueueStats stats;
+#endif
 };
 typedef struct _usb_queue_t USBQueue;
 
 #define USB_DECLARE_QUEUE(endpoint_name)                                \
         struct _usb_queue_t endpoint_name##_queue;
 #define USB_DEFINE_QUEUE(endpoint_name, _pool_size)                     \
+        USBTransferDescriptor endpoint_name##_tds[_pool_size]           \
+                ATTR_ALIGNED(USB_TD_ALIGNMENT);                         \
         struct _usb_transfer_t endpoint_name##_transfers[_pool_size];   \
         struct _usb_queue_t endpoint_name##_queue = {                   \
                 .endpoint = &endpoint_name,                             \
-                .free_transfers = endpoint_name##_transfers,            \
+                .tds = endpoint_name##_tds,                             \
+                .transfers = endpoint_name##_transfers,                 \
                 .pool_size = _pool_size                                 \
         };
 
@@ -44,6 +90,19 @@ void usb_queue_init(
         usb_queue_t* const queue
 );
 
+/* Called by usb_endpoint_init(): mult is the number of packets per
+ * microframe of an isochronous endpoint, 0 for other endpoint types.
+ * Does nothing for endpoints without a queue.
+ */
+void usb_queue_configure_endpoint(
+        const USBEndpoint* const endpoint,
+        const uint16_t packet_size,
+        const uint8_t mult
+);
+
+/* Isochronous dTDs that were retired with an error, see usb_iso.h */
+uint32_t usb_queue_iso_errors(const USBEndpoint* const endpoint);
+
 
 
 #endif//__USB_QUEUE_H__
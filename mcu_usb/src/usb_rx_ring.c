@@ -0,0 +1,147 @@
+#include "usb_rx_ring.h"
+#include "usb_endpoint.h"
+#include "usb_queue.h"
+#include "usb_critical.h"
+
+#define ORDER_MASK (USB_RX_RING_MAX_BUFFERS - 1)
+
+
+static void rx_post(USBRxRing *ring);
+
+static void rx_transfer_complete(void *user_data, int transferred)
+{
+    USBRxRing *ring = user_data;
+
+    // Flushed: usb_rx_ring_stop() takes the buffer back
+    if(transferred == USB_TRANSFER_FLUSHED) {
+        return;
+    }
+
+    // Transfers complete in order, so this is always the oldest primed one
+    const uint32_t index = ring->order[ring->completed & ORDER_MASK];
+
+    if(transferred < 0) {
+        // Cancelled, timed out or failed: nothing was received. Drop the
+        // buffer from the primed ones and prime it again.
+        const usb_critical_t sts = usb_critical_enter();
+        for(uint32_t i = ring->completed; i + 1 != ring->posted; i++) {
+            ring->order[i & ORDER_MASK] = ring->order[(i + 1) & ORDER_MASK];
+        }
+        ring->posted--;
+        ring->free|= 1UL << index;
+        usb_critical_exit(sts);
+
+        rx_post(ring);
+        return;
+    }
+
+    ring->length[index] = transferred;
+    ring->completed++;
+
+    rx_post(ring);
+    if(ring->ready_cb) {
+        ring->ready_cb(ring->user_data);
+    }
+}
+
+/* Prime free buffers until 'depth' are primed */
+static void rx_post(USBRxRing *ring)
+{
+    const usb_critical_t sts = usb_critical_enter();
+    while(ring->running && ring->free
+            && (ring->posted - ring->completed < ring->depth)) {
+
+        const uint32_t index = __builtin_ctz(ring->free);
+        if(usb_transfer_schedule(ring->endpoint,
+                    &ring->buffers[index * ring->buffer_size],
+                    ring->buffer_size, rx_transfer_complete, ring) != 0) {
+            // The pool was checked by usb_rx_ring_start()
+            break;
+        }
+        ring->free&= ~(1UL << index);
+        ring->order[ring->posted & ORDER_MASK] = index;
+        ring->posted++;
+    }
+    usb_critical_exit(sts);
+}
+
+int usb_rx_ring_init(USBRxRing *ring, const USBEndpoint *endpoint,
+        uint8_t *buffers, uint32_t buffer_size, uint32_t num_buffers,
+        uint32_t depth, usb_rx_ring_cb ready_cb, void *user_data)
+{
+    if(num_buffers == 0 || num_buffers > USB_RX_RING_MAX_BUFFERS) {
+        return -1;
+    }
+
+    ring->endpoint = endpoint;
+    ring->buffers = buffers;
+    ring->buffer_size = buffer_size;
+    ring->num_buffers = num_buffers;
+    ring->depth = (depth < num_buffers) ? depth : num_buffers;
+    ring->ready_cb = ready_cb;
+    ring->user_data = user_data;
+    ring->free = (num_buffers == 32) ? 0xFFFFFFFF : ((1UL << num_buffers) - 1);
+    ring->posted = 0;
+    ring->completed = 0;
+    ring->received = 0;
+    ring->running = false;
+    return 0;
+}
+
+int usb_rx_ring_start(USBRxRing *ring)
+{
+    // A completion primes the next buffer before its own dTD is freed
+    const uint32_t dtds_per_buffer = (ring->buffer_size
+            + USB_TRANSFER_MAX_DTD_LENGTH - 1) / USB_TRANSFER_MAX_DTD_LENGTH;
+    if(usb_queue_free_slots(ring->endpoint)
+            <= ring->depth * dtds_per_buffer) {
+        return -1;
+    }
+
+    ring->running = true;
+    rx_post(ring);
+    return 0;
+}
+
+void usb_rx_ring_stop(USBRxRing *ring)
+{
+    const usb_critical_t sts = usb_critical_enter();
+    ring->running = false;
+    usb_endpoint_flush(ring->endpoint);
+
+    while(ring->posted != ring->completed) {
+        ring->posted--;
+        ring->free|= 1UL << ring->order[ring->posted & ORDER_MASK];
+    }
+    usb_critical_exit(sts);
+}
+
+uint8_t *usb_rx_ring_receive(USBRxRing *ring, uint32_t *length)
+{
+    const usb_critical_t sts = usb_critical_enter();
+    uint8_t *buffer = NULL;
+    if(ring->received != ring->completed) {
+        const uint32_t index = ring->order[ring->received & ORDER_MASK];
+        ring->received++;
+        *length = ring->length[index];
+        buffer = &ring->buffers[index * ring->buffer_size];
+    }
+    usb_critical_exit(sts);
+    return buffer;
+}
+
+void usb_rx_ring_release(USBRxRing *ring, uint8_t *buffer)
+{
+    const uint32_t index = (buffer - ring->buffers) / ring->buffer_size;
+
+    const usb_critical_t sts = usb_critical_enter();
+    ring->free|= 1UL << index;
+    usb_critical_exit(sts);
+
+    rx_post(ring);
+}
+
+uint32_t usb_rx_ring_primed(const USBRxRing *ring)
+{
+    return ring->posted - ring->completed;
+}
@@ -79,13 +79,19 @@ static USBRequestStatus usb_send_descriptor(
 		descriptor_length = (descriptor_data[3] << 8) | descriptor_data[2];
 	}
 	// We cast the const away but this shouldn't be a problem as this is a write transfer
-	usb_transfer_schedule_block(
+	if( usb_transfer_schedule_block(
 		endpoint->in,
 		(uint8_t* const) descriptor_data,
 	 	(setup_length > descriptor_length) ? descriptor_length : setup_length,
 		NULL, NULL
-	);
-	usb_transfer_schedule_ack(endpoint->out);
+	) != 0 ) {
+		return USB_REQUEST_STATUS_STALL;
+	}
+	if( usb_transfer_schedule_ack(endpoint->out) != 0 ) {
+		// Don't leave the data stage queued behind the stall
+		usb_endpoint_flush(endpoint->in);
+		return USB_REQUEST_STATUS_STALL;
+	}
 	return USB_REQUEST_STATUS_OK;
 }
 
@@ -180,8 +186,13 @@ static USBRequestStatus usb_standard_request_get_descriptor(
 static USBRequestStatus usb_standard_request_set_address_setup(
 	USBEndpoint* const endpoint
 ) {
+	// USBADRA must be armed before the status stage can complete
+	const uint_fast8_t address = usb_get_address(endpoint->device);
 	usb_set_address_deferred(endpoint->device, endpoint->setup.value_l);
-	usb_transfer_schedule_ack(endpoint->in);
+	if( usb_transfer_schedule_ack(endpoint->in) != 0 ) {
+		usb_set_address_immediate(endpoint->device, address);
+		return USB_REQUEST_STATUS_STALL;
+	}
 	return USB_REQUEST_STATUS_OK;
 }
 
@@ -217,7 +228,9 @@ static USBRequestStatus usb_standard_request_set_configuration_setup(
 			// TODO: Should this be done immediately?
 			usb_set_address_immediate(endpoint->device, 0);
 		}
-		usb_transfer_schedule_ack(endpoint->in);
+		if( usb_transfer_schedule_ack(endpoint->in) != 0 ) {
+			return USB_REQUEST_STATUS_STALL;
+		}
 		return USB_REQUEST_STATUS_OK;
 	} else {
 		return USB_REQUEST_STATUS_STALL;
@@ -251,8 +264,13 @@ static USBRequestStatus usb_standard_request_get_configuration_setup(
 		if( endpoint->device->configuration ) {
 			endpoint->buffer[0] = endpoint->device->configuration->number;
 		}
-		usb_transfer_schedule_block(endpoint->in, &endpoint->buffer, 1, NULL, NULL);
-		usb_transfer_schedule_ack(endpoint->out);
+		if( usb_transfer_schedule_block(endpoint->in, &endpoint->buffer, 1, NULL, NULL) != 0 ) {
+			return USB_REQUEST_STATUS_STALL;
+		}
+		if( usb_transfer_schedule_ack(endpoint->out) != 0 ) {
+			usb_endpoint_flush(endpoint->in);
+			return USB_REQUEST_STATUS_STALL;
+		}
 		return USB_REQUEST_STATUS_OK;
 	} else {
 		return USB_REQUEST_STATUS_STALL;
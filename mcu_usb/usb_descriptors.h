@@ -24,6 +24,11 @@
 #define CONTROL_ENDPOINT_SIZE (64)
 #define NO_DESCRIPTOR         (0)
 
+// wMaxPacketSize of a high-bandwidth (high-speed isochronous or interrupt)
+// endpoint that moves up to 'transactions' (1-3) packets per microframe
+#define HIGH_BANDWIDTH_PACKET_SIZE(size, transactions) \
+	((uint16_t)((size) | (((transactions) - 1) << 11)))
+
 #define MANUFACTURER_INDEX 1
 #define PRODUCT_INDEX 2
 #define SERIAL_INDEX 3
@@ -43,6 +48,10 @@ if_desc = descriptor_make_interface(cfg_desc,
 
 ep_desc = descriptor_make_endpoint(cfg_desc, if_desc,
 				bEndpointAddress, bmAttributes, wMaxPacketSize, bInterval);
+// high-speed isochronous/interrupt endpoint, 3 packets per microframe:
+ep_desc = descriptor_make_endpoint(cfg_desc, if_desc,
+				bEndpointAddress, bmAttributes,
+				HIGH_BANDWIDTH_PACKET_SIZE(1024, 3), bInterval);
 
 str_id = descriptor_string(string);
 success = descriptor_ok();
@@ -160,6 +169,13 @@ bool descriptor_ok();
  * 						Null is accepted, but will not result in a valid
  * 						endpoint descriptor.
  *
+ * @param wMaxPacketSize	Maximum packet size. Isochronous and interrupt
+ * 						endpoints may move packets of up to 1024 bytes, at
+ * 						high speed up to 3 per microframe, see
+ * 						HIGH_BANDWIDTH_PACKET_SIZE(). Larger packets, other
+ * 						endpoints with additional transactions and the
+ * 						reserved value 3 of bits 12:11 are rejected.
+ *
  *
  * @return						pointer to the generated descriptor,
  * 								NULL on failure.
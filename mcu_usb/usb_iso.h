@@ -0,0 +1,113 @@
+#ifndef USB_ISO_H
+#define USB_ISO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "mcu_usb.h"
+
+/** usb_iso: continuous isochronous stream over a ring of slot buffers.
+ *
+ * Every slot holds the data of one service interval. All slots are queued
+ * on the endpoint at once, and each one is queued again as soon as it
+ * completed, so the controller always has the next intervals ready:
+ *
+ * - IN endpoint: the callback fills a slot right before it is queued and
+ *   returns the number of bytes to send in that interval.
+ * - OUT endpoint: the callback gets each slot after it was received, with
+ *   the number of bytes the host sent in that interval.
+ *
+ * The callback runs from the completion interrupt and should be quick:
+ * while it runs, the ring is one slot short.
+ *
+ * A slot moves in one microframe, as up to MULT packets (bits 12:11 of
+ * wMaxPacketSize). Isochronous data is never retried. Intervals in which
+ * nothing completed are counted as missed, based on FRINDEX at each
+ * completion. This needs one interrupt per slot: leave the interrupt
+ * threshold at 0 and the IRQ policy at USB_IRQ_EVERY_TRANSFER.
+ *
+ * NOTE: the slot buffers are read/written by the USB controller, so they
+ * have the same requirements as any other transfer buffer. The endpoint
+ * pool must have at least num_slots + 1 slots. The stream owns the
+ * endpoint: do not schedule other transfers on it while it runs.
+ */
+
+
+typedef struct usb_iso USBIso;
+
+/**
+ * Fill (IN) or consume (OUT) one slot.
+ *
+ * @param buffer    Slot buffer.
+ * @param length    OUT: number of bytes received. IN: size of the slot.
+ *
+ * @return          IN: number of bytes to send. Ignored for OUT.
+ */
+typedef uint32_t (*usb_iso_cb)(void *user_data, uint8_t *buffer,
+        uint32_t length);
+
+typedef struct {
+    uint32_t slots;         // slots completed
+    uint32_t missed;        // service intervals without a completed slot
+    uint32_t errors;        // slots completed with a transaction error
+                            // or another failure
+} USBIsoStats;
+
+
+/**
+ * Initialize an isochronous stream.
+ *
+ * @param iso           USBIso object to initialize.
+ * @param endpoint      Isochronous endpoint, initialized with its
+ *                      descriptor (or usb_endpoint_init_without_descriptor).
+ * @param buffers       num_slots * slot_size bytes of slot buffers.
+ * @param slot_size     Bytes per service interval, at most MULT times the
+ *                      packet size.
+ * @param num_slots     Number of slots in the ring.
+ * @param interval      Service interval in microframes (1 << (bInterval-1)
+ *                      at high speed, 8 << (bInterval-1) at full speed).
+ * @param callback      Called for every slot, see usb_iso_cb.
+ */
+void usb_iso_init(USBIso *iso, const USBEndpoint *endpoint,
+        uint8_t *buffers, uint32_t slot_size, uint32_t num_slots,
+        uint32_t interval, usb_iso_cb callback, void *user_data);
+
+/**
+ * Start streaming: queue all slots. For IN endpoints, the callback fills
+ * every slot first.
+ *
+ * @return  0 on success, -1 if the pool of the endpoint does not have
+ *          more than num_slots free transfers.
+ */
+int usb_iso_start(USBIso *iso);
+
+/**
+ * Stop streaming. Flushes the endpoint: queued slots are dropped.
+ */
+void usb_iso_stop(USBIso *iso);
+
+/**
+ * Read the statistics of the stream since usb_iso_start().
+ */
+void usb_iso_get_stats(const USBIso *iso, USBIsoStats *stats);
+
+
+struct usb_iso {
+    const USBEndpoint *endpoint;
+    uint8_t *buffers;
+    uint32_t slot_size;
+    uint32_t num_slots;
+    uint32_t interval;
+    usb_iso_cb callback;
+    void *user_data;
+    uint32_t next_slot;         // slot that completes next
+    uint32_t last_frame;        // FRINDEX at the last completion
+    uint32_t errors_start;
+    volatile uint32_t errors;   // slots that failed otherwise
+    volatile uint32_t slots;
+    volatile uint32_t missed;
+    volatile bool running;
+    bool in;
+};
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef USB_PUMP_H
+#define USB_PUMP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "mcu_usb.h"
+#include "usb_ringbuffer.h"
+
+/** usb_pump: stream a ringbuffer over an endpoint without copying.
+ *
+ * A pump connects a USBRingbuffer to a bulk (or interrupt) endpoint and
+ * transfers whole elements straight from/to the ringbuffer memory:
+ *
+ * - OUT endpoint: up to 'depth' writeable elements are claimed and primed
+ *   as transfers. Every received element is committed to the ringbuffer,
+ *   also when a short packet ended it early: see usb_pump_set_lengths()
+ *   to find out how much of it is valid.
+ * - IN endpoint: readable elements are claimed and sent, up to 'depth' at
+ *   a time. Every sent element is released from the ringbuffer.
+ *
+ * A transfer that fails (or is cancelled or times out) still retires its
+ * element, as if nothing was transferred: an IN element is released
+ * unsent, an OUT element is committed with length 0. The errors are
+ * counted by usb_queue_get_errors().
+ *
+ * Finished elements are replaced by new ones from the completion
+ * interrupt, so a busy stream keeps running on its own. When the stream
+ * runs dry (IN: ringbuffer empty, OUT: ringbuffer full), call
+ * usb_pump_update() after writing (IN) or reading (OUT) the ringbuffer.
+ *
+ * NOTE: the ringbuffer memory is read/written by the USB controller, so it
+ * has the same requirements as any other transfer buffer. The pump owns
+ * the endpoint: do not schedule other transfers on it while it runs.
+ */
+
+
+typedef struct usb_pump USBPump;
+
+
+/**
+ * Initialize a pump.
+ *
+ * @param pump          USBPump object to initialize.
+ * @param endpoint      Endpoint to stream on. Its direction selects the
+ *                      direction of the stream.
+ * @param ringbuffer    Initialized USBRingbuffer. For OUT endpoints only
+ *                      write via the pump, for IN endpoints only read via
+ *                      the pump (see usb_ringbuffer.h).
+ * @param depth         Maximum number of elements queued at once. The
+ *                      endpoint pool must have room for more than
+ *                      depth elements (see usb_pump_start()).
+ */
+void usb_pump_init(USBPump *pump, const USBEndpoint *endpoint,
+        USBRingbuffer *ringbuffer, uint32_t depth);
+
+/**
+ * OUT only: record the received length of every committed element.
+ *
+ * Without it, a short packet still commits a whole element, so only use
+ * a pump without lengths for streams the host always sends in whole
+ * elements.
+ *
+ * @param lengths       One entry per element of the ringbuffer, written
+ *                      before the element is committed. NULL to stop
+ *                      recording.
+ */
+void usb_pump_set_lengths(USBPump *pump, uint32_t *lengths);
+
+/**
+ * Received length of a committed OUT element, e.g. the one returned by
+ * ringbuffer_get_readable(). Requires usb_pump_set_lengths().
+ */
+uint32_t usb_pump_length(const USBPump *pump, const void *elem);
+
+/**
+ * Start streaming: queue as many elements as are available.
+ *
+ * A completion queues the next element before its own dTDs are back in
+ * the pool, so the free slots of the endpoint must exceed depth times the
+ * dTDs per element (one per USB_TRANSFER_MAX_DTD_LENGTH bytes).
+ *
+ * @return  0 on success, -1 if the endpoint pool is too small.
+ */
+int usb_pump_start(USBPump *pump);
+
+/**
+ * Queue newly available elements, up to the depth of the pump.
+ *
+ * Safe to call from any context. Does nothing if the pump is not started.
+ */
+void usb_pump_update(USBPump *pump);
+
+/**
+ * Stop streaming.
+ *
+ * Flushes the endpoint: elements that were queued but not transferred are
+ * given back to the ringbuffer (not committed/released).
+ */
+void usb_pump_stop(USBPump *pump);
+
+/**
+ * Number of elements currently queued on the endpoint.
+ */
+uint32_t usb_pump_queued(const USBPump *pump);
+
+
+struct usb_pump {
+    const USBEndpoint *endpoint;
+    USBRingbuffer *ring;
+    uint32_t *lengths;
+    uint32_t depth;
+    volatile uint32_t queued;
+    volatile bool running;
+    bool in;
+};
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef USB_RX_RING_H
+#define USB_RX_RING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "mcu_usb.h"
+
+/** usb_rx_ring: receive ring for bulk OUT endpoints.
+ *
+ * The application hands a pool of equally sized receive buffers to the
+ * ring once. The ring keeps up to 'depth' free buffers primed on the
+ * endpoint, so the host can keep sending while the application works on
+ * what it received:
+ *
+ * - Every transfer ends at a full buffer or at a short packet. Filled
+ *   buffers are handed out in order with usb_rx_ring_receive(), together
+ *   with the number of bytes received.
+ * - A transfer that fails (or is cancelled or times out) is not handed
+ *   out: its buffer is primed again. The errors are counted by
+ *   usb_queue_get_errors().
+ * - The application owns a received buffer until it gives it back with
+ *   usb_rx_ring_release(), in any order. Released buffers are primed again
+ *   right away if fewer than 'depth' are primed.
+ *
+ * The endpoint only NAKs when all buffers are waiting to be released.
+ *
+ * NOTE: the buffers are written by the USB controller, so they have the
+ * same requirements as any other transfer buffer. The buffer size should
+ * be a multiple of the max packet size. The endpoint pool must have room
+ * for depth buffers plus one dTD. The ring owns the endpoint: do not
+ * schedule other transfers on it while it runs.
+ */
+
+#define USB_RX_RING_MAX_BUFFERS 32
+
+typedef struct usb_rx_ring USBRxRing;
+
+/**
+ * Called from the completion interrupt when a buffer was filled.
+ * Optional: the ring can also just be polled.
+ */
+typedef void (*usb_rx_ring_cb)(void *user_data);
+
+
+/**
+ * Initialize a receive ring.
+ *
+ * @param ring          USBRxRing object to initialize.
+ * @param endpoint      OUT endpoint to receive on.
+ * @param buffers       num_buffers * buffer_size bytes of receive buffers.
+ * @param buffer_size   Size of one buffer in bytes.
+ * @param num_buffers   Number of buffers, at most USB_RX_RING_MAX_BUFFERS.
+ * @param depth         Maximum number of buffers primed at once.
+ * @param ready_cb      Called when a buffer was filled (may be NULL).
+ *
+ * @return              0 on success, -1 if num_buffers is 0 or more than
+ *                      USB_RX_RING_MAX_BUFFERS.
+ */
+int usb_rx_ring_init(USBRxRing *ring, const USBEndpoint *endpoint,
+        uint8_t *buffers, uint32_t buffer_size, uint32_t num_buffers,
+        uint32_t depth, usb_rx_ring_cb ready_cb, void *user_data);
+
+/**
+ * Start receiving: prime up to 'depth' buffers.
+ *
+ * @return  0 on success, -1 if the endpoint pool has no room for depth
+ *          buffers plus one dTD.
+ */
+int usb_rx_ring_start(USBRxRing *ring);
+
+/**
+ * Stop receiving. Flushes the endpoint: primed buffers go back to the
+ * ring, received buffers stay with the application until released.
+ */
+void usb_rx_ring_stop(USBRxRing *ring);
+
+/**
+ * Take the oldest filled buffer.
+ *
+ * @param length    Set to the number of bytes received in the buffer.
+ *
+ * @return          The buffer, or NULL if nothing was received.
+ */
+uint8_t *usb_rx_ring_receive(USBRxRing *ring, uint32_t *length);
+
+/**
+ * Give a buffer from usb_rx_ring_receive() back to the ring.
+ */
+void usb_rx_ring_release(USBRxRing *ring, uint8_t *buffer);
+
+/**
+ * Number of buffers currently primed on the endpoint.
+ */
+uint32_t usb_rx_ring_primed(const USBRxRing *ring);
+
+
+/* Buffers are primed in the order of 'order'. Entries between 'received'
+ * and 'completed' are filled, between 'completed' and 'posted' primed.
+ * All three count up and are masked to index 'order'.
+ */
+struct usb_rx_ring {
+    const USBEndpoint *endpoint;
+    uint8_t *buffers;
+    uint32_t buffer_size;
+    uint32_t num_buffers;
+    uint32_t depth;
+    usb_rx_ring_cb ready_cb;
+    void *user_data;
+    volatile uint32_t free;     // bit per buffer that can be primed
+    volatile uint32_t posted;
+    volatile uint32_t completed;
+    volatile uint32_t received;
+    uint8_t order[USB_RX_RING_MAX_BUFFERS];
+    uint32_t length[USB_RX_RING_MAX_BUFFERS];
+    volatile bool running;
+};
+
+#endif
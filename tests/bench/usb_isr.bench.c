@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "usb_sim.h"
+#include "mcu_usb.h"
+#include "usb_core.h"
+#include "usb_queue.h"
+
+/* Cost of the USB interrupt handler per interrupt, by the number of
+ * endpoints that completed a transfer since the last one.
+ *
+ * The interrupt threshold holds back the completions, so each round ends
+ * in a single interrupt (raised by the start-of-frame) that dispatches
+ * all of them. Reports wall time (host CPU, only useful for relative
+ * comparisons) and USB register accesses per interrupt. Both controllers
+ * run the same code and should cost the same.
+ */
+
+#define NUM_ENDPOINTS   5       // USB1 only has 3 besides endpoint 0
+#define POOL_SIZE       4
+#define PACKET_SIZE     64
+#define NUM_ROUNDS      200000
+
+static USBDescriptorDevice g_device_descriptor = {
+    .bLength = sizeof(USBDescriptorDevice),
+    .bDescriptorType = USB_DESCRIPTOR_TYPE_DEVICE,
+    .bMaxPacketSize0 = 64,
+};
+static USBDevice g_device = {
+    .descriptor = &g_device_descriptor,
+    .controller = 0,
+};
+static USBEndpoint *g_bulk_in[NUM_ENDPOINTS];
+
+static uint8_t g_buffer[PACKET_SIZE];
+static uint8_t g_host[PACKET_SIZE];
+static uint32_t g_completions;
+
+static void completion_cb(void *user_data, int transferred)
+{
+    g_completions++;
+}
+
+static uint32_t num_endpoints(uint8_t controller)
+{
+    return controller ? (NUM_USB1_ENDPOINTS - 1) : NUM_ENDPOINTS;
+}
+
+static void setup_device(uint8_t controller)
+{
+    usb_sim_reset();
+    g_device.controller = controller;
+    for(uint32_t i = 0; i < num_endpoints(controller); i++) {
+        g_bulk_in[i] = usb_endpoint_create(0x81 + i, &g_device, NULL,
+                usb_queue_transfer_complete, POOL_SIZE, usb_sim_alloc);
+    }
+    usb_device_init(&g_device);
+    for(uint32_t i = 0; i < num_endpoints(controller); i++) {
+        usb_endpoint_init_without_descriptor(g_bulk_in[i], PACKET_SIZE,
+                USB_TRANSFER_TYPE_BULK);
+    }
+    usb_run(&g_device);
+    usb_sim_attach(controller, USB_SPEED_HIGH);
+    usb_set_interrupt_threshold(&g_device, 1);
+}
+
+static double elapsed_ns(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e9
+        + (now.tv_nsec - start->tv_nsec);
+}
+
+/* All endpoints are configured, 'active' of them complete a transfer
+ * before each interrupt. */
+static void bench_isr(uint8_t controller, uint32_t active)
+{
+    setup_device(controller);
+    g_completions = 0;
+
+    uint32_t accesses = 0;
+    double ns = 0;
+    const uint32_t irqs = usb_sim_irq_count(controller);
+    for(uint32_t i = 0; i < NUM_ROUNDS; i++) {
+        for(uint32_t e = 0; e < active; e++) {
+            usb_transfer_schedule(g_bulk_in[e], g_buffer, PACKET_SIZE,
+                    completion_cb, NULL);
+            if(usb_sim_in(controller, e + 1, g_host, sizeof(g_host)) != PACKET_SIZE) {
+                printf("isr: transfer %u failed\n", (unsigned int)i);
+                return;
+            }
+        }
+
+        struct timespec start;
+        const uint32_t accesses_start = usb_sim_register_accesses();
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        usb_sim_sof(controller, 1);
+
+        ns+= elapsed_ns(&start);
+        accesses+= usb_sim_register_accesses() - accesses_start;
+    }
+
+    const uint32_t irq_count = usb_sim_irq_count(controller) - irqs;
+    if(g_completions != NUM_ROUNDS * active || irq_count != NUM_ROUNDS) {
+        printf("isr: %u completions in %u interrupts\n",
+                (unsigned int)g_completions, (unsigned int)irq_count);
+        return;
+    }
+    printf("USB%u isr %u of %u endpoints active: %8.1f ns/irq, "
+            "%5.2f reg/irq\n",
+            (unsigned int)controller,
+            (unsigned int)active, (unsigned int)num_endpoints(controller),
+            ns / irq_count,
+            (double)accesses / irq_count);
+}
+
+int main(void)
+{
+    bench_isr(0, 1);
+    bench_isr(0, 2);
+    bench_isr(0, NUM_ENDPOINTS);
+    bench_isr(1, 1);
+    bench_isr(1, num_endpoints(1));
+    return 0;
+}
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "usb_sim.h"
+#include "mcu_usb.h"
+#include "usb_core.h"
+#include "usb_queue.h"
+
+/* Bulk IN streaming from a bare-metal main loop, with the events handled
+ * by the USB interrupt, by usb_poll() or adaptively by either.
+ *
+ * The host reads 'per_frame' packets per frame (1ms): the bus time only
+ * moves between packets, so this sets the event rate the adaptive mode
+ * sees. Reports wall time per transfer (host CPU, only useful for relative
+ * comparisons) and the number of USB register accesses and interrupts per
+ * transfer, which translate directly to the target.
+ */
+
+#define POOL_SIZE       16
+#define PACKET_SIZE     512
+#define DEPTH           2
+#define NUM_TRANSFERS   200000
+#define NUM_POLLS       1000000
+
+static USBDescriptorDevice g_device_descriptor = {
+    .bLength = sizeof(USBDescriptorDevice),
+    .bDescriptorType = USB_DESCRIPTOR_TYPE_DEVICE,
+    .bMaxPacketSize0 = 64,
+};
+static USBDevice g_device = {
+    .descriptor = &g_device_descriptor,
+    .controller = 0,
+};
+static USBEndpoint *g_bulk_in;
+
+static uint8_t g_buffer[PACKET_SIZE];
+static uint8_t g_host[PACKET_SIZE];
+static uint32_t g_completions;
+
+static void completion_cb(void *user_data, int transferred)
+{
+    g_completions++;
+}
+
+static void setup_device(USBServiceMode mode)
+{
+    usb_sim_reset();
+    g_bulk_in = usb_endpoint_create(0x81, &g_device, NULL,
+            usb_queue_transfer_complete, POOL_SIZE, usb_sim_alloc);
+    usb_device_init(&g_device);
+    usb_set_service_mode(&g_device, mode);
+    usb_endpoint_init_without_descriptor(g_bulk_in, PACKET_SIZE,
+            USB_TRANSFER_TYPE_BULK);
+    usb_run(&g_device);
+    usb_sim_attach(0, USB_SPEED_HIGH);
+    if(usb_is_polling(&g_device)) {
+        // the attach events
+        usb_poll(&g_device);
+    }
+}
+
+static double elapsed_ns(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e9
+        + (now.tv_nsec - start->tv_nsec);
+}
+
+static void bench_stream(USBServiceMode mode, uint32_t per_frame)
+{
+    static const char *mode_names[] = {"interrupt", "poll", "adaptive"};
+
+    setup_device(mode);
+    g_completions = 0;
+
+    for(uint32_t i = 0; i < DEPTH; i++) {
+        usb_transfer_schedule(g_bulk_in, g_buffer, PACKET_SIZE,
+                completion_cb, NULL);
+    }
+
+    uint32_t polling = 0;
+    const uint32_t accesses = usb_sim_register_accesses();
+    const uint32_t irqs = usb_sim_irq_count(0);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for(uint32_t i = 0; i < NUM_TRANSFERS; i++) {
+        if(usb_sim_in(0, 1, g_host, sizeof(g_host)) != PACKET_SIZE) {
+            printf("stream: transfer %u failed\n", (unsigned int)i);
+            return;
+        }
+        if((i % per_frame) == per_frame - 1) {
+            usb_sim_sof(0, 8);
+        }
+
+        // The main loop
+        if(usb_is_polling(&g_device)) {
+            polling++;
+            usb_poll(&g_device);
+        }
+        usb_transfer_schedule(g_bulk_in, g_buffer, PACKET_SIZE,
+                completion_cb, NULL);
+    }
+
+    const double ns = elapsed_ns(&start);
+    printf("stream %-9s %3u/frame: %8.1f ns/transfer, %5.2f reg/transfer, "
+            "%4.2f irq/transfer, %3.0f%% polled\n",
+            mode_names[mode],
+            (unsigned int)per_frame,
+            ns / g_completions,
+            (double)(usb_sim_register_accesses() - accesses) / g_completions,
+            (double)(usb_sim_irq_count(0) - irqs) / g_completions,
+            100.0 * polling / NUM_TRANSFERS);
+}
+
+/* What a bare-metal loop pays for polling while the bus is quiet */
+static void bench_idle_poll(void)
+{
+    setup_device(USB_SERVICE_POLL);
+
+    const uint32_t accesses = usb_sim_register_accesses();
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for(uint32_t i = 0; i < NUM_POLLS; i++) {
+        usb_poll(&g_device);
+    }
+
+    const double ns = elapsed_ns(&start);
+    printf("idle poll               : %8.1f ns/poll,     %5.2f reg/poll\n",
+            ns / NUM_POLLS,
+            (double)(usb_sim_register_accesses() - accesses) / NUM_POLLS);
+}
+
+int main(void)
+{
+    bench_stream(USB_SERVICE_INTERRUPT, 64);
+    bench_stream(USB_SERVICE_POLL, 64);
+    bench_stream(USB_SERVICE_ADAPTIVE, 64);
+
+    // Below USB_ADAPTIVE_IRQS_PER_FRAME adaptive stays on the interrupt
+    bench_stream(USB_SERVICE_INTERRUPT, 4);
+    bench_stream(USB_SERVICE_POLL, 4);
+    bench_stream(USB_SERVICE_ADAPTIVE, 4);
+
+    bench_idle_poll();
+    return 0;
+}
@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "usb_sim.h"
+#include "mcu_usb.h"
+#include "usb_core.h"
+#include "usb_queue.h"
+
+/* Bulk IN throughput of the transfer queue on the emulated controller.
+ *
+ * Reports wall time per transfer (host CPU, only useful for relative
+ * comparisons) and the number of USB register accesses and interrupts
+ * per transfer, which translate directly to the target.
+ */
+
+#define POOL_SIZE       257
+#define PACKET_SIZE     512
+#define NUM_TRANSFERS   200000
+
+static USBDescriptorDevice g_device_descriptor = {
+    .bLength = sizeof(USBDescriptorDevice),
+    .bDescriptorType = USB_DESCRIPTOR_TYPE_DEVICE,
+    .bMaxPacketSize0 = 64,
+};
+static USBDevice g_device = {
+    .descriptor = &g_device_descriptor,
+    .controller = 0,
+};
+static USBEndpoint *g_bulk_in;
+
+static uint8_t g_buffer[PACKET_SIZE];
+static uint8_t g_host[PACKET_SIZE];
+static uint32_t g_completions;
+
+static void completion_cb(void *user_data, int transferred)
+{
+    g_completions++;
+}
+
+static void setup_device(void)
+{
+    usb_sim_reset();
+    g_bulk_in = usb_endpoint_create(0x81, &g_device, NULL,
+            usb_queue_transfer_complete, POOL_SIZE, usb_sim_alloc);
+    usb_device_init(&g_device);
+    usb_endpoint_init_without_descriptor(g_bulk_in, PACKET_SIZE,
+            USB_TRANSFER_TYPE_BULK);
+    usb_run(&g_device);
+    usb_sim_attach(0, USB_SPEED_HIGH);
+}
+
+static double elapsed_ns(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e9
+        + (now.tv_nsec - start->tv_nsec);
+}
+
+/* Keep 'depth' transfers queued: the host reads one packet, the driver
+ * completes it and the application schedules the next one. */
+static void bench_bulk_in(uint32_t depth)
+{
+    setup_device();
+    g_completions = 0;
+
+    for(uint32_t i = 0; i < depth; i++) {
+        usb_transfer_schedule(g_bulk_in, g_buffer, PACKET_SIZE,
+                completion_cb, NULL);
+    }
+
+    const uint32_t accesses = usb_sim_register_accesses();
+    const uint32_t irqs = usb_sim_irq_count(0);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for(uint32_t i = 0; i < NUM_TRANSFERS; i++) {
+        if(usb_sim_in(0, 1, g_host, sizeof(g_host)) != PACKET_SIZE) {
+            printf("bulk_in: transfer %u failed\n", (unsigned int)i);
+            return;
+        }
+        usb_transfer_schedule(g_bulk_in, g_buffer, PACKET_SIZE,
+                completion_cb, NULL);
+    }
+
+    const double ns = elapsed_ns(&start);
+    printf("bulk_in depth %2u: %8.1f ns/transfer, %5.2f reg/transfer, "
+            "%4.2f irq/transfer\n",
+            (unsigned int)depth,
+            ns / g_completions,
+            (double)(usb_sim_register_accesses() - accesses) / g_completions,
+            (double)(usb_sim_irq_count(0) - irqs) / g_completions);
+}
+
+/* Cost of usb_transfer_schedule() itself with 'depth' transfers already
+ * queued. This should not depend on the depth. */
+static void bench_schedule(uint32_t depth)
+{
+    setup_device();
+    g_completions = 0;
+
+    for(uint32_t i = 0; i < depth; i++) {
+        usb_transfer_schedule(g_bulk_in, g_buffer, PACKET_SIZE,
+                completion_cb, NULL);
+    }
+
+    uint32_t accesses = 0;
+    double ns = 0;
+    for(uint32_t i = 0; i < NUM_TRANSFERS; i++) {
+        struct timespec start;
+        const uint32_t accesses_start = usb_sim_register_accesses();
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        usb_transfer_schedule(g_bulk_in, g_buffer, PACKET_SIZE,
+                completion_cb, NULL);
+
+        ns+= elapsed_ns(&start);
+        accesses+= usb_sim_register_accesses() - accesses_start;
+
+        if(usb_sim_in(0, 1, g_host, sizeof(g_host)) != PACKET_SIZE) {
+            printf("schedule: transfer %u failed\n", (unsigned int)i);
+            return;
+        }
+    }
+
+    printf("schedule depth %3u: %8.1f ns/schedule, %5.2f reg/schedule\n",
+            (unsigned int)depth,
+            ns / NUM_TRANSFERS,
+            (double)accesses / NUM_TRANSFERS);
+}
+
+/* Submission cost per transfer when the application hands over
+ * 'batch_size' transfers at a time, one by one or as a single batch. */
+static void bench_submit(uint32_t batch_size, bool batched,
+        USBIrqPolicy irq_policy)
+{
+    static const char *policy_names[] = {"every", "every 4", "last"};
+
+    setup_device();
+    usb_queue_set_irq_policy(g_bulk_in, irq_policy, 4);
+    g_completions = 0;
+
+    USBTransferRequest batch[batch_size];
+    for(uint32_t i = 0; i < batch_size; i++) {
+        batch[i] = (USBTransferRequest){g_buffer, PACKET_SIZE,
+            completion_cb, NULL};
+    }
+
+    // keep one transfer queued so every submission appends
+    usb_transfer_schedule(g_bulk_in, g_buffer, PACKET_SIZE,
+            completion_cb, NULL);
+
+    uint32_t accesses = 0;
+    double ns = 0;
+    const uint32_t irqs = usb_sim_irq_count(0);
+    const uint32_t rounds = NUM_TRANSFERS / batch_size;
+    for(uint32_t i = 0; i < rounds; i++) {
+        struct timespec start;
+        const uint32_t accesses_start = usb_sim_register_accesses();
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        if(batched) {
+            usb_transfer_schedule_batch(g_bulk_in, batch, batch_size);
+        } else {
+            for(uint32_t n = 0; n < batch_size; n++) {
+                usb_transfer_schedule(g_bulk_in, g_buffer, PACKET_SIZE,
+                        completion_cb, NULL);
+            }
+        }
+
+        ns+= elapsed_ns(&start);
+        accesses+= usb_sim_register_accesses() - accesses_start;
+
+        for(uint32_t n = 0; n < batch_size; n++) {
+            if(usb_sim_in(0, 1, g_host, sizeof(g_host)) != PACKET_SIZE) {
+                printf("submit: transfer %u failed\n", (unsigned int)i);
+                return;
+            }
+        }
+    }
+
+    const uint32_t transfers = rounds * batch_size;
+    printf("submit %3u %s, irq %-7s: %8.1f ns/transfer, %5.2f reg/transfer, "
+            "%4.2f irq/transfer\n",
+            (unsigned int)batch_size,
+            batched ? "batched   " : "one by one",
+            policy_names[irq_policy],
+            ns / transfers,
+            (double)accesses / transfers,
+            (double)(usb_sim_irq_count(0) - irqs) / transfers);
+}
+
+int main(void)
+{
+    bench_bulk_in(1);
+    bench_bulk_in(2);
+    bench_bulk_in(16);
+
+    bench_schedule(1);
+    bench_schedule(4);
+    bench_schedule(16);
+    bench_schedule(64);
+    bench_schedule(256);
+
+    bench_submit(16, false, USB_IRQ_EVERY_TRANSFER);
+    bench_submit(16, true, USB_IRQ_EVERY_TRANSFER);
+    bench_submit(16, true, USB_IRQ_EVERY_N);
+    bench_submit(16, true, USB_IRQ_LAST_OF_BATCH);
+    bench_submit(128, false, USB_IRQ_EVERY_TRANSFER);
+    bench_submit(128, true, USB_IRQ_EVERY_TRANSFER);
+    bench_submit(128, true, USB_IRQ_LAST_OF_BATCH);
+    return 0;
+}
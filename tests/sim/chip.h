@@ -0,0 +1,62 @@
+#ifndef USB_SIM_CHIP_H
+#define USB_SIM_CHIP_H
+
+/* Host stand-in for the parts of the LPC43xx chip library used by mcu_usb.
+ * Clocks and resets are no-ops, the NVIC and WFI are forwarded to usb_sim.
+ * The SCU is a plain variable that tests can inspect.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "usb_sim.h"
+
+typedef enum {
+    USB0_IRQn = 8,
+    USB1_IRQn = 9,
+} IRQn_Type;
+
+typedef enum {
+    RGU_USB0_RST = 17,
+    RGU_USB1_RST = 18,
+} CHIP_RGU_RST_T;
+
+// System control unit: only SFSUSB, which configures the USB1 PHY pins
+typedef struct {
+    volatile uint32_t SFSUSB;
+} LPC_SCU_T;
+
+extern LPC_SCU_T usb_sim_scu;
+#define LPC_SCU (&usb_sim_scu)
+
+static inline void NVIC_EnableIRQ(IRQn_Type irq)
+{
+    usb_sim_nvic_enable(irq, true);
+}
+
+static inline void NVIC_DisableIRQ(IRQn_Type irq)
+{
+    usb_sim_nvic_enable(irq, false);
+}
+
+// Cortex-M core registers: IPSR is non-zero while in an interrupt handler
+static inline uint32_t __get_IPSR(void)
+{
+    return usb_sim_in_interrupt() ? 16 : 0;
+}
+
+static inline void __WFI(void)
+{
+    usb_sim_wfi();
+}
+
+static inline void Chip_USB0_Init(void) {}
+static inline void Chip_USB1_Init(void) {}
+
+static inline void Chip_RGU_TriggerReset(CHIP_RGU_RST_T reset) {}
+
+static inline bool Chip_RGU_InReset(CHIP_RGU_RST_T reset)
+{
+    return false;
+}
+
+#endif
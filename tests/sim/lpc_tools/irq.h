@@ -0,0 +1,28 @@
+#ifndef USB_SIM_IRQ_H
+#define USB_SIM_IRQ_H
+
+/* Host stand-in for lpc_tools/irq.h: PRIMASK is emulated by usb_sim, so
+ * pending USB interrupts are delivered as soon as they are unmasked.
+ */
+
+#include <stdbool.h>
+#include "usb_sim.h"
+
+static inline bool irq_disable(void)
+{
+    return usb_sim_irq_disable();
+}
+
+static inline void irq_enable(void)
+{
+    usb_sim_irq_enable();
+}
+
+static inline void irq_restore(bool was_enabled)
+{
+    if(was_enabled) {
+        usb_sim_irq_enable();
+    }
+}
+
+#endif
@@ -0,0 +1,788 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usb_sim.h"
+#include "lpc43xx_usb.h"
+#include "chip.h"
+
+void USB0_IRQHandler(void);
+void USB1_IRQHandler(void);
+
+#define SIM_NUM_CONTROLLERS     2
+#define SIM_NUM_QUEUE_HEADS     32
+#define SIM_REGISTER_SPACE      0x200
+
+// The IRQ line is level triggered: keep re-entering the handler while
+// enabled status bits are pending, but give up on a handler that never
+// clears them.
+#define SIM_MAX_IRQ_REENTRY     4
+
+/* Register offsets within a controller block */
+#define REG_USBCMD              0x140
+#define REG_USBSTS              0x144
+#define REG_USBINTR             0x148
+#define REG_FRINDEX             0x14C
+#define REG_ENDPOINTLISTADDR    0x158
+#define REG_ENDPTNAK            0x178
+#define REG_PORTSC1             0x184
+#define REG_OTGSC               0x1A4
+#define REG_ENDPTSETUPSTAT      0x1AC
+#define REG_ENDPTPRIME          0x1B0
+#define REG_ENDPTFLUSH          0x1B4
+#define REG_ENDPTSTAT           0x1B8
+#define REG_ENDPTCOMPLETE       0x1BC
+#define REG_ENDPTCTRL(n)        (0x1C0 + ((n) * 4))
+
+#define REG(ctrl, offset)       ((ctrl)->regs[(offset) / 4])
+
+// PORTSC1 bits that reflect the state of the bus rather than software
+#define PORTSC1_HW_MASK (USB0_PORTSC1_D_CCS | USB0_PORTSC1_D_SUSP \
+        | USB0_PORTSC1_D_PSPD_MASK)
+
+// OTGSC interrupt status bits (write-1-to-clear)
+#define OTGSC_STATUS_MASK       (0x7F << 16)
+
+// Reserved bits of the write-1-to-clear registers, see sim_read()
+#define TAG_SHIFT               24
+#define TAG_MASK                (0xFF << TAG_SHIFT)
+
+typedef struct {
+    volatile USBTransferDescriptor *td; // dTD being executed, NULL if idle
+    uint32_t length;                    // total_bytes when td was loaded
+    uint32_t offset;                    // bytes transferred so far
+    uint32_t packets;                   // isochronous: packets of this dTD
+} SimEndpoint;
+
+typedef struct {
+    uint32_t regs[SIM_REGISTER_SPACE / 4];
+    SimEndpoint endpoints[SIM_NUM_QUEUE_HEADS];
+    void (*irq_handler)(void);
+    int irq;
+    bool nvic_enabled;
+    bool in_isr;
+    uint32_t irq_count;
+    uint32_t itc_pending;               // USBSTS bits held back by ITC
+    uint32_t itc_timer;                 // microframes until they are raised
+} SimController;
+
+/* A register access hands the driver a private copy of the register.
+ * Whether the driver wrote to it is only known afterwards, so the copy is
+ * checked on the next access or when the sim itself gets control.
+ * GCC evaluates the right-hand side of an assignment first, which makes
+ * this one-access delay sufficient for 'REG = REG & mask'.
+ */
+typedef struct {
+    SimController *ctrl;
+    uint32_t offset;
+    uint32_t published;
+    volatile uint32_t value;
+} SimAccess;
+
+static SimController controllers[SIM_NUM_CONTROLLERS];
+
+LPC_SCU_T usb_sim_scu;
+
+static SimAccess accesses[2];
+static SimAccess *pending_access;
+static unsigned int next_access;
+static uint32_t access_count;
+static uint8_t read_tag;
+
+static bool primask;
+static void (*wfi_hook)(void);
+
+static uint8_t arena[512 * 1024] ATTR_ALIGNED(4096);
+static size_t arena_used;
+
+
+static void sim_fail(const char *msg)
+{
+    fprintf(stderr, "usb_sim: %s\n", msg);
+    abort();
+}
+
+static bool is_terminate(volatile USBTransferDescriptor *td)
+{
+    return (td == NULL) || ((uintptr_t)td & 1);
+}
+
+// ENDPTPRIME/ENDPTSTAT/... bit for a queue head index
+static uint32_t endpoint_bit(unsigned int qh_index)
+{
+    const unsigned int number = qh_index / 2;
+    return (qh_index & 1) ? (1 << (16 + number)) : (1 << number);
+}
+
+static USBQueueHead *sim_queue_head(SimController *c, unsigned int qh_index)
+{
+    const uint32_t list = REG(c, REG_ENDPOINTLISTADDR);
+    if(!list) {
+        sim_fail("ENDPOINTLISTADDR not configured");
+    }
+    return ((USBQueueHead *)(uintptr_t)list) + qh_index;
+}
+
+static uint32_t sim_max_packet(SimController *c, unsigned int qh_index)
+{
+    const uint32_t capabilities = sim_queue_head(c, qh_index)->capabilities;
+    const uint32_t mps = (capabilities & USB_QH_CAPABILITIES_MPL_MASK)
+        >> USB_QH_CAPABILITIES_MPL_SHIFT;
+    if(!mps) {
+        sim_fail("transfer on an endpoint without max packet size");
+    }
+    return mps;
+}
+
+static bool sim_is_isochronous(SimController *c, unsigned int qh_index)
+{
+    const uint32_t ctrl = REG(c, REG_ENDPTCTRL(qh_index / 2));
+    const uint32_t type = (qh_index & 1)
+        ? (ctrl & USB0_ENDPTCTRL_TXT1_0_MASK) >> USB0_ENDPTCTRL_TXT1_0_SHIFT
+        : (ctrl & USB0_ENDPTCTRL_RXT_MASK) >> USB0_ENDPTCTRL_RXT_SHIFT;
+    return type == USB_TRANSFER_TYPE_ISOCHRONOUS;
+}
+
+// Packets an isochronous dTD moves in its microframe: MultO of the dTD
+// for IN endpoints, MULT of the queue head otherwise.
+static uint32_t sim_iso_packets(SimController *c, unsigned int qh_index,
+        volatile USBTransferDescriptor *td)
+{
+    uint32_t packets = (sim_queue_head(c, qh_index)->capabilities
+            & USB_QH_CAPABILITIES_MULT_MASK) >> USB_QH_CAPABILITIES_MULT_SHIFT;
+    const uint32_t multo = (td->capabilities.word & USB_TD_DTD_TOKEN_MULTO_MASK)
+        >> USB_TD_DTD_TOKEN_MULTO_SHIFT;
+    if(multo && (qh_index & 1)) {
+        packets = multo;
+    }
+    if(!packets) {
+        sim_fail("isochronous endpoint with MULT 0");
+    }
+    return packets;
+}
+
+static bool sim_is_high_speed(SimController *c)
+{
+    return (REG(c, REG_PORTSC1) & USB0_PORTSC1_D_PSPD_MASK)
+        == USB0_PORTSC1_D_PSPD(2);
+}
+
+// Raise USBSTS bits. Transfer interrupts are held back for up to ITC
+// microframes (see usb_sim_sof()).
+static void sim_raise(SimController *c, uint32_t status)
+{
+    const uint32_t itc = (REG(c, REG_USBCMD) & USB0_USBCMD_D_ITC_MASK)
+        >> USB0_USBCMD_D_ITC_SHIFT;
+    const uint32_t deferred = status & (USB0_USBSTS_D_UI | USB0_USBSTS_D_UEI);
+    if(itc && deferred) {
+        if(!c->itc_pending) {
+            c->itc_timer = itc;
+        }
+        c->itc_pending|= deferred;
+        status&= ~deferred;
+    }
+    REG(c, REG_USBSTS)|= status;
+}
+
+/* --- dTD processing ------------------------------------------------------ */
+
+// Load the first active dTD of a list into the queue head overlay
+static void sim_load(SimController *c, unsigned int qh_index,
+        volatile USBTransferDescriptor *td)
+{
+    SimEndpoint *ep = &c->endpoints[qh_index];
+    USBQueueHead *qh = sim_queue_head(c, qh_index);
+
+    while(!is_terminate(td)
+            && !(td->capabilities.word & USB_TD_DTD_TOKEN_STATUS_ACTIVE)) {
+        td = td->next_dtd_pointer;
+    }
+    if(is_terminate(td)) {
+        ep->td = NULL;
+        qh->next_dtd_pointer = USB_TD_NEXT_DTD_POINTER_TERMINATE;
+        REG(c, REG_ENDPTSTAT)&= ~endpoint_bit(qh_index);
+        return;
+    }
+
+    ep->td = td;
+    ep->length = td->capabilities.total_bytes;
+    ep->offset = 0;
+    ep->packets = 0;
+
+    qh->current_dtd_pointer = td;
+    qh->next_dtd_pointer = td->next_dtd_pointer;
+    qh->total_bytes = td->capabilities.word;
+    for(int i = 0; i < 5; i++) {
+        qh->buffer_pointer_page[i] = td->buffer_pointer_page[i];
+    }
+    REG(c, REG_ENDPTSTAT)|= endpoint_bit(qh_index);
+}
+
+// Write back the dTD token, raise the completion events and move on to
+// the next dTD in the list.
+static void sim_retire(SimController *c, unsigned int qh_index,
+        uint32_t error_bits, bool short_packet)
+{
+    SimEndpoint *ep = &c->endpoints[qh_index];
+    USBQueueHead *qh = sim_queue_head(c, qh_index);
+    volatile USBTransferDescriptor *td = ep->td;
+
+    uint32_t token = td->capabilities.word;
+    token&= ~(USB_TD_DTD_TOKEN_TOTAL_BYTES_MASK
+            | USB_TD_DTD_TOKEN_STATUS_ACTIVE);
+    token|= USB_TD_DTD_TOKEN_TOTAL_BYTES(ep->length - ep->offset);
+    token|= error_bits;
+    td->capabilities.word = token;
+    qh->total_bytes = token;
+
+    uint32_t status = 0;
+    if(token & USB_TD_DTD_TOKEN_IOC) {
+        REG(c, REG_ENDPTCOMPLETE)|= endpoint_bit(qh_index);
+        status|= USB0_USBSTS_D_UI;
+    }
+    if(short_packet) {
+        status|= USB0_USBSTS_D_UI;
+    }
+    if(error_bits) {
+        status|= USB0_USBSTS_D_UEI;
+    }
+    sim_raise(c, status);
+
+    if(error_bits & USB_TD_DTD_TOKEN_STATUS_HALTED) {
+        // A halted queue head stays halted until software primes it again
+        ep->td = NULL;
+        REG(c, REG_ENDPTSTAT)&= ~endpoint_bit(qh_index);
+        return;
+    }
+
+    // Re-read next_dtd_pointer from memory: software may have appended
+    // to this dTD after it was loaded.
+    sim_load(c, qh_index, td->next_dtd_pointer);
+}
+
+// Address of a byte within the buffer of a dTD, limited to the end of
+// its 4K page. Returns NULL if the dTD has no page for this offset.
+static uint8_t *sim_buffer(volatile USBTransferDescriptor *td,
+        uint32_t offset, uint32_t *contiguous)
+{
+    const uint32_t start = td->buffer_pointer_page[0];
+    const uint32_t position = (start & 0xFFF) + offset;
+    const uint32_t page = position >> 12;
+    if(page > 4) {
+        return NULL;
+    }
+    *contiguous = 0x1000 - (position & 0xFFF);
+
+    const uint32_t address = page
+        ? (td->buffer_pointer_page[page] & 0xFFFFF000) + (position & 0xFFF)
+        : start + offset;
+    return (uint8_t *)(uintptr_t)address;
+}
+
+// Copy between the host and the buffer of the current dTD.
+// Returns false on a dTD buffer error.
+static bool sim_copy(SimEndpoint *ep, uint8_t *host, uint32_t length,
+        bool to_host)
+{
+    while(length) {
+        uint32_t chunk;
+        uint8_t *device = sim_buffer(ep->td, ep->offset, &chunk);
+        if(!device) {
+            return false;
+        }
+        if(chunk > length) {
+            chunk = length;
+        }
+        if(to_host) {
+            memcpy(host, device, chunk);
+        } else {
+            memcpy(device, host, chunk);
+        }
+        host+= chunk;
+        length-= chunk;
+        ep->offset+= chunk;
+    }
+    return true;
+}
+
+static void sim_prime(SimController *c, uint32_t mask)
+{
+    for(unsigned int i = 0; i < SIM_NUM_QUEUE_HEADS; i++) {
+        if((mask & endpoint_bit(i)) && !c->endpoints[i].td) {
+            sim_load(c, i, sim_queue_head(c, i)->next_dtd_pointer);
+        }
+    }
+}
+
+static void sim_flush(SimController *c, uint32_t mask)
+{
+    for(unsigned int i = 0; i < SIM_NUM_QUEUE_HEADS; i++) {
+        if(mask & endpoint_bit(i)) {
+            c->endpoints[i].td = NULL;
+        }
+    }
+    REG(c, REG_ENDPTSTAT)&= ~mask;
+}
+
+/* --- Register block ------------------------------------------------------ */
+
+static void sim_controller_reset(SimController *c)
+{
+    const uint32_t portsc1 = REG(c, REG_PORTSC1) & PORTSC1_HW_MASK;
+    const uint32_t otgsc = REG(c, REG_OTGSC) & USB0_OTGSC_BSV;
+
+    memset(c->regs, 0, sizeof(c->regs));
+    memset(c->endpoints, 0, sizeof(c->endpoints));
+    c->itc_pending = 0;
+    c->itc_timer = 0;
+
+    REG(c, REG_USBCMD) = USB0_USBCMD_D_ITC(8);
+    REG(c, REG_ENDPTCTRL(0)) = USB0_ENDPTCTRL0_RXE | USB0_ENDPTCTRL0_TXE;
+    REG(c, REG_PORTSC1) = portsc1;
+    REG(c, REG_OTGSC) = otgsc;
+}
+
+static bool is_tagged(uint32_t offset)
+{
+    return (offset == REG_USBSTS)
+        || (offset == REG_ENDPTNAK)
+        || (offset == REG_ENDPTSETUPSTAT)
+        || (offset == REG_ENDPTCOMPLETE);
+}
+
+// Writing back a value that was just read from a write-1-to-clear
+// register must clear it, but would be indistinguishable from the read
+// itself. Every read of these registers therefore carries a rolling tag in
+// their reserved upper bits.
+static uint32_t sim_read(SimController *c, uint32_t offset)
+{
+    uint32_t value = REG(c, offset);
+    if(is_tagged(offset)) {
+        if(!++read_tag) {
+            read_tag = 1;
+        }
+        value|= ((uint32_t)read_tag << TAG_SHIFT);
+    }
+    return value;
+}
+
+static void sim_write(SimController *c, uint32_t offset, uint32_t value)
+{
+    switch(offset) {
+        case REG_USBCMD:
+            if(value & USB0_USBCMD_D_RST) {
+                sim_controller_reset(c);
+            } else {
+                REG(c, offset) = value;
+            }
+            break;
+
+        case REG_USBSTS:
+        case REG_ENDPTNAK:
+        case REG_ENDPTSETUPSTAT:
+        case REG_ENDPTCOMPLETE:
+            REG(c, offset)&= ~(value & ~TAG_MASK);
+            break;
+
+        case REG_OTGSC:
+            REG(c, offset) = (value & ~OTGSC_STATUS_MASK)
+                | (REG(c, offset) & OTGSC_STATUS_MASK & ~value);
+            break;
+
+        case REG_PORTSC1:
+            REG(c, offset) = (value & ~PORTSC1_HW_MASK)
+                | (REG(c, offset) & PORTSC1_HW_MASK);
+            break;
+
+        case REG_ENDPTPRIME:
+            sim_prime(c, value);
+            break;
+
+        case REG_ENDPTFLUSH:
+            sim_flush(c, value);
+            break;
+
+        case REG_ENDPTSTAT:
+        case REG_FRINDEX:
+            // read-only
+            break;
+
+        default:
+            REG(c, offset) = value;
+            break;
+    }
+}
+
+static void sim_commit(void)
+{
+    SimAccess *access = pending_access;
+    if(!access) {
+        return;
+    }
+    pending_access = NULL;
+    if(access->value != access->published) {
+        sim_write(access->ctrl, access->offset, access->value);
+    }
+}
+
+volatile uint32_t *usb_sim_mmio32(uint32_t addr)
+{
+    sim_commit();
+
+    const uint32_t block = (addr - USB0_BASE) >> 12;
+    const uint32_t offset = addr & 0xFFF;
+    if((addr < USB0_BASE) || (block >= SIM_NUM_CONTROLLERS)
+            || (offset >= SIM_REGISTER_SPACE) || (addr & 3)) {
+        sim_fail("access outside the USB register blocks");
+    }
+
+    SimAccess *access = &accesses[next_access];
+    next_access^= 1;
+
+    access->ctrl = &controllers[block];
+    access->offset = offset;
+    access->published = sim_read(access->ctrl, offset);
+    access->value = access->published;
+
+    pending_access = access;
+    access_count++;
+    return &access->value;
+}
+
+/* --- Interrupts ---------------------------------------------------------- */
+
+static void sim_update_irq(SimController *c)
+{
+    sim_commit();
+    for(int n = 0; n < SIM_MAX_IRQ_REENTRY; n++) {
+        if(!c->nvic_enabled || primask || c->in_isr) {
+            return;
+        }
+        if(!(REG(c, REG_USBSTS) & REG(c, REG_USBINTR))) {
+            return;
+        }
+        c->in_isr = true;
+        c->irq_count++;
+        c->irq_handler();
+        sim_commit();
+        c->in_isr = false;
+    }
+}
+
+static void sim_update_all_irqs(void)
+{
+    for(int i = 0; i < SIM_NUM_CONTROLLERS; i++) {
+        sim_update_irq(&controllers[i]);
+    }
+}
+
+void usb_sim_nvic_enable(int irq, bool enabled)
+{
+    for(int i = 0; i < SIM_NUM_CONTROLLERS; i++) {
+        if(controllers[i].irq == irq) {
+            controllers[i].nvic_enabled = enabled;
+        }
+    }
+    sim_update_all_irqs();
+}
+
+bool usb_sim_irq_disable(void)
+{
+    const bool was_enabled = !primask;
+    primask = true;
+    return was_enabled;
+}
+
+void usb_sim_irq_enable(void)
+{
+    primask = false;
+    sim_update_all_irqs();
+}
+
+bool usb_sim_in_interrupt(void)
+{
+    for(int i = 0; i < SIM_NUM_CONTROLLERS; i++) {
+        if(controllers[i].in_isr) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void usb_sim_wfi(void)
+{
+    if(!wfi_hook) {
+        sim_fail("WFI would sleep forever: no wfi hook set");
+    }
+    sim_commit();
+    wfi_hook();
+}
+
+void usb_sim_set_wfi_hook(void (*hook)(void))
+{
+    wfi_hook = hook;
+}
+
+/* --- Scripted host ------------------------------------------------------- */
+
+static SimController *sim_begin(uint8_t controller)
+{
+    if(controller >= SIM_NUM_CONTROLLERS) {
+        sim_fail("no such controller");
+    }
+    sim_commit();
+    return &controllers[controller];
+}
+
+// Returns 0 if the endpoint accepts a transaction in this direction
+static int sim_check_endpoint(SimController *c, uint8_t number, bool in)
+{
+    const uint32_t ctrl = REG(c, REG_ENDPTCTRL(number));
+    const uint32_t stall = in ? USB0_ENDPTCTRL_TXS : USB0_ENDPTCTRL_RXS;
+    const uint32_t enable = in ? USB0_ENDPTCTRL_TXE : USB0_ENDPTCTRL_RXE;
+
+    if(!(REG(c, REG_USBCMD) & USB0_USBCMD_D_RS)) {
+        return USB_SIM_NAK;
+    }
+    if(ctrl & stall) {
+        return USB_SIM_STALL;
+    }
+    // endpoint 0 is always enabled
+    if(number && !(ctrl & enable)) {
+        return USB_SIM_NAK;
+    }
+    return 0;
+}
+
+void usb_sim_reset(void)
+{
+    if((uintptr_t)arena + sizeof(arena) > UINT32_MAX) {
+        sim_fail("memory not reachable with 32-bit bus addresses, "
+                "link with -no-pie");
+    }
+
+    memset(controllers, 0, sizeof(controllers));
+    for(int i = 0; i < SIM_NUM_CONTROLLERS; i++) {
+        sim_controller_reset(&controllers[i]);
+    }
+    controllers[0].irq_handler = USB0_IRQHandler;
+    controllers[0].irq = USB0_IRQn;
+    controllers[1].irq_handler = USB1_IRQHandler;
+    controllers[1].irq = USB1_IRQn;
+    memset(&usb_sim_scu, 0, sizeof(usb_sim_scu));
+
+    pending_access = NULL;
+    access_count = 0;
+    primask = false;
+    wfi_hook = NULL;
+    arena_used = 0;
+}
+
+void *usb_sim_alloc(size_t num_bytes, size_t alignment)
+{
+    if(!alignment) {
+        alignment = 1;
+    }
+    const size_t start = (arena_used + alignment - 1) & ~(alignment - 1);
+    if(start + num_bytes > sizeof(arena)) {
+        return NULL;
+    }
+    arena_used = start + num_bytes;
+    memset(&arena[start], 0, num_bytes);
+    return &arena[start];
+}
+
+void usb_sim_attach(uint8_t controller, USBSpeed speed)
+{
+    SimController *c = sim_begin(controller);
+
+    uint32_t pspd = USB0_PORTSC1_D_PSPD(0);
+    if(speed == USB_SPEED_LOW) {
+        pspd = USB0_PORTSC1_D_PSPD(1);
+    } else if(speed == USB_SPEED_HIGH
+            && !(REG(c, REG_PORTSC1) & USB0_PORTSC1_D_PFSC)) {
+        pspd = USB0_PORTSC1_D_PSPD(2);
+    }
+    REG(c, REG_PORTSC1)&= ~PORTSC1_HW_MASK;
+    REG(c, REG_PORTSC1)|= USB0_PORTSC1_D_CCS | pspd;
+    REG(c, REG_OTGSC)|= USB0_OTGSC_BSV | USB0_OTGSC_BSVIS;
+    REG(c, REG_USBSTS)|= USB0_USBSTS_D_PCI;
+    sim_update_irq(c);
+}
+
+void usb_sim_bus_reset(uint8_t controller)
+{
+    SimController *c = sim_begin(controller);
+    REG(c, REG_USBSTS)|= USB0_USBSTS_D_URI;
+    sim_update_irq(c);
+}
+
+void usb_sim_suspend(uint8_t controller)
+{
+    SimController *c = sim_begin(controller);
+    REG(c, REG_PORTSC1)|= USB0_PORTSC1_D_SUSP;
+    REG(c, REG_USBSTS)|= USB0_USBSTS_D_SLI;
+    sim_update_irq(c);
+}
+
+void usb_sim_sof(uint8_t controller, uint32_t count)
+{
+    SimController *c = sim_begin(controller);
+    const uint32_t step = sim_is_high_speed(c) ? 1 : 8;
+    for(uint32_t i = 0; i < count; i++) {
+        // An isochronous dTD only lives for one microframe: if the host
+        // moved fewer packets than it holds, the rest is lost.
+        for(unsigned int q = 0; q < SIM_NUM_QUEUE_HEADS; q++) {
+            if(c->endpoints[q].td && c->endpoints[q].packets) {
+                sim_retire(c, q, USB_TD_DTD_TOKEN_STATUS_TRANSACTION_ERROR,
+                        false);
+            }
+        }
+        REG(c, REG_FRINDEX) = (REG(c, REG_FRINDEX) + step) & 0x3FFF;
+        REG(c, REG_USBSTS)|= USB0_USBSTS_D_SRI;
+        if(c->itc_pending) {
+            c->itc_timer = (c->itc_timer > step) ? (c->itc_timer - step) : 0;
+            if(!c->itc_timer) {
+                REG(c, REG_USBSTS)|= c->itc_pending;
+                c->itc_pending = 0;
+            }
+        }
+        sim_update_irq(c);
+    }
+}
+
+void usb_sim_setup(uint8_t controller, uint8_t endpoint_number,
+        const USBSetup *setup)
+{
+    SimController *c = sim_begin(controller);
+    if(!(REG(c, REG_USBCMD) & USB0_USBCMD_D_RS)) {
+        return;
+    }
+
+    USBQueueHead *qh = sim_queue_head(c, endpoint_number * 2);
+    const uint8_t *bytes = (const uint8_t *)setup;
+    for(int i = 0; i < 8; i++) {
+        qh->setup[i] = bytes[i];
+    }
+
+    // a SETUP token clears the stall of a control endpoint
+    REG(c, REG_ENDPTCTRL(endpoint_number))&=
+        ~(USB0_ENDPTCTRL_RXS | USB0_ENDPTCTRL_TXS);
+    REG(c, REG_ENDPTSETUPSTAT)|= (1 << endpoint_number);
+    sim_raise(c, USB0_USBSTS_D_UI);
+    sim_update_irq(c);
+}
+
+int usb_sim_in(uint8_t controller, uint8_t endpoint_number,
+        void *data, size_t max_length)
+{
+    SimController *c = sim_begin(controller);
+    const unsigned int qh_index = endpoint_number * 2 + 1;
+    SimEndpoint *ep = &c->endpoints[qh_index];
+
+    int result = sim_check_endpoint(c, endpoint_number, true);
+    if(result) {
+        return result;
+    }
+    const bool iso = sim_is_isochronous(c, qh_index);
+    if(!ep->td) {
+        if(iso) {
+            // no handshake: the controller answers with an empty packet
+            return 0;
+        }
+        REG(c, REG_ENDPTNAK)|= endpoint_bit(qh_index);
+        return USB_SIM_NAK;
+    }
+
+    const uint32_t mps = sim_max_packet(c, qh_index);
+    uint32_t length = ep->length - ep->offset;
+    if(length > mps) {
+        length = mps;
+    }
+    if(length > max_length) {
+        sim_fail("IN packet larger than the host buffer");
+    }
+
+    if(!sim_copy(ep, data, length, true)) {
+        sim_retire(c, qh_index, USB_TD_DTD_TOKEN_STATUS_BUFFER_ERROR, false);
+        result = USB_SIM_NAK;
+    } else {
+        result = length;
+        const bool last_packet = iso
+            && (++ep->packets == sim_iso_packets(c, qh_index, ep->td));
+        if((length < mps) || (ep->offset == ep->length) || last_packet) {
+            sim_retire(c, qh_index, 0, false);
+        }
+    }
+    sim_update_irq(c);
+    return result;
+}
+
+int usb_sim_out(uint8_t controller, uint8_t endpoint_number,
+        const void *data, size_t length)
+{
+    SimController *c = sim_begin(controller);
+    const unsigned int qh_index = endpoint_number * 2;
+    SimEndpoint *ep = &c->endpoints[qh_index];
+
+    int result = sim_check_endpoint(c, endpoint_number, false);
+    if(result) {
+        return result;
+    }
+    if(!ep->td) {
+        REG(c, REG_ENDPTNAK)|= endpoint_bit(qh_index);
+        return USB_SIM_NAK;
+    }
+
+    const uint32_t mps = sim_max_packet(c, qh_index);
+    if((length > mps) || (length > (ep->length - ep->offset))) {
+        // babble: the packet does not fit
+        sim_retire(c, qh_index, USB_TD_DTD_TOKEN_STATUS_HALTED, false);
+        result = USB_SIM_STALL;
+    } else if(!sim_copy(ep, (uint8_t *)data, length, false)) {
+        sim_retire(c, qh_index, USB_TD_DTD_TOKEN_STATUS_BUFFER_ERROR, false);
+        result = USB_SIM_NAK;
+    } else {
+        result = length;
+        const bool short_packet = (length < mps);
+        const bool last_packet = sim_is_isochronous(c, qh_index)
+            && (++ep->packets == sim_iso_packets(c, qh_index, ep->td));
+        if(short_packet || (ep->offset == ep->length) || last_packet) {
+            sim_retire(c, qh_index, 0, short_packet);
+        }
+    }
+    sim_update_irq(c);
+    return result;
+}
+
+bool usb_sim_error(uint8_t controller, uint8_t endpoint_address,
+        uint32_t status)
+{
+    SimController *c = sim_begin(controller);
+    const unsigned int qh_index = ((endpoint_address & 0xF) * 2)
+        + ((endpoint_address >> 7) & 1);
+    if(!c->endpoints[qh_index].td) {
+        return false;
+    }
+    sim_retire(c, qh_index, status, false);
+    sim_update_irq(c);
+    return true;
+}
+
+bool usb_sim_endpoint_primed(uint8_t controller, uint8_t endpoint_address)
+{
+    SimController *c = sim_begin(controller);
+    const unsigned int qh_index = ((endpoint_address & 0xF) * 2)
+        + ((endpoint_address >> 7) & 1);
+    return REG(c, REG_ENDPTSTAT) & endpoint_bit(qh_index);
+}
+
+uint32_t usb_sim_irq_count(uint8_t controller)
+{
+    return sim_begin(controller)->irq_count;
+}
+
+uint32_t usb_sim_register_accesses(void)
+{
+    return access_count;
+}
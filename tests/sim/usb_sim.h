@@ -0,0 +1,172 @@
+#ifndef USB_SIM_H
+#define USB_SIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "mcu_usb.h"
+
+/** usb_sim: emulated LPC43xx USB device controller for host builds.
+ *
+ * When mcu_usb is compiled with MCU_USB_HOST_SIM defined, every USB0_* and
+ * USB1_* register access in lpc43xx_usb.h is routed through
+ * usb_sim_mmio32(). This module implements the register block behind it
+ * (write-1-to-clear status, prime/flush commands, controller reset) and
+ * processes the dTD lists hanging off usb_qh0/usb_qh1 the way the hardware
+ * does: walking next_dtd_pointer, decrementing total_bytes, clearing the
+ * active bit and raising ENDPTCOMPLETE/ENDPTSETUPSTAT and USBSTS.
+ *
+ * The unmodified core, queue and IRQ code run on top of it. The USB host is
+ * scripted by the test: usb_sim_setup(), usb_sim_in() and usb_sim_out()
+ * each perform one transaction, and interrupts are delivered synchronously
+ * by calling USB0_IRQHandler()/USB1_IRQHandler() whenever an enabled status
+ * bit is pending, the NVIC line is enabled and interrupts are not masked.
+ *
+ * NOTE: the controller only has 32-bit bus addresses. Everything it reads
+ * through a dTD or queue head (transfer pools, endpoints, data buffers)
+ * must therefore live in the lower 4GB of the address space: link with
+ * -no-pie and use static buffers or usb_sim_alloc(), never the stack.
+ */
+
+// usb_sim_in() / usb_sim_out() results other than a byte count
+#define USB_SIM_NAK     (-1)
+#define USB_SIM_STALL   (-2)
+
+
+/**
+ * Power-on reset of both emulated controllers.
+ *
+ * Clears all registers, detaches the port, enables interrupts and empties
+ * the usb_sim_alloc() arena. Call this before every test.
+ */
+void usb_sim_reset(void);
+
+/**
+ * Allocate memory that the emulated controller can reach.
+ *
+ * Has the signature of Alloc_cb, so it can be passed straight to
+ * usb_endpoint_create(). Memory is only reclaimed by usb_sim_reset().
+ *
+ * @return              Pointer to num_bytes of zeroed memory,
+ *                      NULL if the arena is exhausted.
+ */
+void *usb_sim_alloc(size_t num_bytes, size_t alignment);
+
+
+/**
+ * Connect the port at the given speed and signal a port change.
+ * A port forced to full speed (PORTSC1.PFSC, e.g. the on-chip PHY of
+ * USB1) does not do the high-speed handshake and comes up at full speed.
+ */
+void usb_sim_attach(uint8_t controller, USBSpeed speed);
+
+/**
+ * Drive a USB bus reset.
+ */
+void usb_sim_bus_reset(uint8_t controller);
+
+/**
+ * Stop sending SOFs: the port enters suspend and signals it.
+ */
+void usb_sim_suspend(uint8_t controller);
+
+/**
+ * Send count start-of-frame tokens, advancing FRINDEX.
+ *
+ * FRINDEX counts microframes: a full-speed frame advances it by 8, a
+ * high-speed microframe by 1. Transfer interrupts held back by the
+ * interrupt threshold (USBCMD ITC) are raised once it has elapsed.
+ *
+ * An isochronous dTD that moved some, but not all of its packets in the
+ * microframe that ends is retired with a transaction error.
+ */
+void usb_sim_sof(uint8_t controller, uint32_t count);
+
+/**
+ * Send a SETUP packet to a control endpoint.
+ */
+void usb_sim_setup(uint8_t controller, uint8_t endpoint_number,
+        const USBSetup *setup);
+
+/**
+ * Send one IN token to an endpoint.
+ *
+ * Isochronous endpoints do not NAK: without a primed transfer they return
+ * an empty packet. Their dTDs retire after MultO (or MULT) packets.
+ *
+ * @param data          Buffer for the packet the device returns.
+ * @param max_length    Size of data. Should be at least the endpoint's
+ *                      maximum packet size.
+ *
+ * @return              Length of the received packet,
+ *                      USB_SIM_NAK if no transfer is primed,
+ *                      USB_SIM_STALL if the endpoint is stalled.
+ */
+int usb_sim_in(uint8_t controller, uint8_t endpoint_number,
+        void *data, size_t max_length);
+
+/**
+ * Send one OUT packet to an endpoint.
+ *
+ * Isochronous dTDs retire after MULT packets. Without a primed transfer
+ * the packet is lost (there is no handshake, USB_SIM_NAK tells the test).
+ *
+ * @return              Number of bytes accepted,
+ *                      USB_SIM_NAK if no transfer is primed,
+ *                      USB_SIM_STALL if the endpoint is stalled.
+ */
+int usb_sim_out(uint8_t controller, uint8_t endpoint_number,
+        const void *data, size_t length);
+
+/**
+ * Retire the dTD an endpoint is working on with an error, as the
+ * controller would on e.g. a data buffer overrun.
+ *
+ * @param status        USB_TD_DTD_TOKEN_STATUS_HALTED, _BUFFER_ERROR or
+ *                      _TRANSACTION_ERROR.
+ *
+ * @return              false if the endpoint has no dTD loaded.
+ */
+bool usb_sim_error(uint8_t controller, uint8_t endpoint_address,
+        uint32_t status);
+
+
+/**
+ * Returns true if the controller has a dTD loaded for this endpoint
+ * (i.e. its ENDPTSTAT bit is set).
+ */
+bool usb_sim_endpoint_primed(uint8_t controller, uint8_t endpoint_address);
+
+/**
+ * Number of times the interrupt handler of a controller was entered.
+ */
+uint32_t usb_sim_irq_count(uint8_t controller);
+
+/**
+ * Number of USB register accesses performed by the driver so far.
+ *
+ * On the target every access is an uncached AHB bus cycle, so this is a
+ * useful hardware-independent cost measure for benchmarks.
+ */
+uint32_t usb_sim_register_accesses(void);
+
+
+/**
+ * Set the function that runs when the driver waits for an interrupt (WFI).
+ *
+ * There is no concurrent host on the emulator, so this is where a test
+ * lets the host make progress, e.g. by reading a packet. Interrupts it
+ * causes are delivered after the wait. Waiting without a hook is an error.
+ */
+void usb_sim_set_wfi_hook(void (*hook)(void));
+
+
+/* Hooks for the host stand-ins of chip.h and lpc_tools/irq.h */
+void usb_sim_nvic_enable(int irq, bool enabled);
+bool usb_sim_irq_disable(void);
+void usb_sim_irq_enable(void);
+bool usb_sim_in_interrupt(void);
+void usb_sim_wfi(void);
+
+#endif
@@ -0,0 +1,412 @@
+#include <stdbool.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "unity.h"
+#include "usb_sim.h"
+#include "mcu_usb.h"
+#include "usb_core.h"
+#include "usb_queue.h"
+#include <lpc_tools/irq.h>
+
+static USBDescriptorDevice g_device_descriptor = {
+    .bLength = sizeof(USBDescriptorDevice),
+    .bDescriptorType = USB_DESCRIPTOR_TYPE_DEVICE,
+    .bcdUSB = 0x0200,
+    .bMaxPacketSize0 = 64,
+    .idVendor = 0x1234,
+    .idProduct = 0x5678,
+    .bNumConfigurations = 1,
+};
+static const USBRequestHandlers g_request_handlers = {
+    .standard = usb_standard_request,
+};
+
+static int g_bus_resets;
+static void bus_reset_cb(void)
+{
+    g_bus_resets++;
+}
+
+static USBDevice g_device = {
+    .descriptor = &g_device_descriptor,
+    .controller = 0,
+    .request_handlers = &g_request_handlers,
+    .bus_reset = bus_reset_cb,
+};
+static USBEndpoint *g_ep0_in;
+static USBEndpoint *g_ep0_out;
+static USBEndpoint *g_bulk_in;
+
+static uint8_t g_host[512];
+static uint8_t g_buffer[64];
+static int g_completions;
+
+static void completion_cb(void *user_data, int transferred)
+{
+    g_completions++;
+}
+
+void setUp(void)
+{
+    usb_sim_reset();
+    g_bus_resets = 0;
+    g_completions = 0;
+
+    g_ep0_in = usb_endpoint_create(0x80, &g_device, usb_setup_complete,
+            usb_control_in_complete, 4, usb_sim_alloc);
+    g_ep0_out = usb_endpoint_create(0x00, &g_device, usb_setup_complete,
+            usb_control_out_complete, 4, usb_sim_alloc);
+    g_bulk_in = usb_endpoint_create(0x81, &g_device, NULL,
+            usb_queue_transfer_complete, 4, usb_sim_alloc);
+    TEST_ASSERT_TRUE(usb_pair_endpoints(g_ep0_in, g_ep0_out));
+
+    usb_device_init(&g_device);
+    usb_endpoint_init(g_ep0_out);
+    usb_endpoint_init(g_ep0_in);
+    usb_endpoint_init_without_descriptor(g_bulk_in, 512,
+            USB_TRANSFER_TYPE_BULK);
+    usb_run(&g_device);
+    usb_sim_attach(0, USB_SPEED_HIGH);
+}
+
+void tearDown(void)
+{
+}
+
+void test_speed(void)
+{
+    TEST_ASSERT_EQUAL(USB_SPEED_HIGH, usb_speed(&g_device));
+    TEST_ASSERT_TRUE(usb_device_is_attached(&g_device));
+}
+
+void test_get_device_descriptor(void)
+{
+    const USBSetup setup = {
+        .request_type = 0x80,
+        .request = 6,               // GET_DESCRIPTOR
+        .value = 0x0100,            // device descriptor
+        .length = 64,
+    };
+    usb_sim_setup(0, 0, &setup);
+    TEST_ASSERT_EQUAL(2, usb_sim_irq_count(0));
+
+    TEST_ASSERT_EQUAL(sizeof(USBDescriptorDevice),
+            usb_sim_in(0, 0, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL_MEMORY(&g_device_descriptor, g_host,
+            sizeof(USBDescriptorDevice));
+
+    // status stage
+    TEST_ASSERT_EQUAL(0, usb_sim_out(0, 0, NULL, 0));
+    TEST_ASSERT_FALSE(usb_queue_active(g_ep0_in));
+    TEST_ASSERT_FALSE(usb_queue_active(g_ep0_out));
+}
+
+void test_get_descriptor_truncated(void)
+{
+    const USBSetup setup = {
+        .request_type = 0x80,
+        .request = 6,
+        .value = 0x0100,
+        .length = 8,
+    };
+    usb_sim_setup(0, 0, &setup);
+    TEST_ASSERT_EQUAL(8, usb_sim_in(0, 0, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(USB_SIM_NAK, usb_sim_in(0, 0, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(0, usb_sim_out(0, 0, NULL, 0));
+}
+
+void test_set_address(void)
+{
+    const USBSetup setup = {
+        .request_type = 0x00,
+        .request = 5,               // SET_ADDRESS
+        .value = 42,
+    };
+    usb_sim_setup(0, 0, &setup);
+    TEST_ASSERT_EQUAL(0, usb_sim_in(0, 0, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL_HEX32(USB0_DEVICEADDR_USBADR(42) | USB0_DEVICEADDR_USBADRA,
+            USB0_DEVICEADDR);
+}
+
+void test_set_address_ack_fails(void)
+{
+    for(int i = 0; i < 4; i++) {
+        TEST_ASSERT_EQUAL(0, usb_transfer_schedule_ack(g_ep0_in));
+    }
+    USB0_DEVICEADDR = USB0_DEVICEADDR_USBADR(7);
+
+    // The address stays as it was
+    const USBSetup setup = {
+        .request_type = 0x00,
+        .request = 5,               // SET_ADDRESS
+        .value = 42,
+    };
+    usb_sim_setup(0, 0, &setup);
+    TEST_ASSERT_EQUAL_HEX32(USB0_DEVICEADDR_USBADR(7), USB0_DEVICEADDR);
+}
+
+void test_get_descriptor_ack_fails(void)
+{
+    for(int i = 0; i < 4; i++) {
+        TEST_ASSERT_EQUAL(0, usb_transfer_schedule_ack(g_ep0_out));
+    }
+
+    // The data stage does not stay queued behind the stall
+    const USBSetup setup = {
+        .request_type = 0x80,
+        .request = 6,               // GET_DESCRIPTOR
+        .value = 0x0100,
+        .length = 64,
+    };
+    usb_sim_setup(0, 0, &setup);
+    TEST_ASSERT_FALSE(usb_queue_active(g_ep0_in));
+    TEST_ASSERT_FALSE(usb_sim_endpoint_primed(0, 0x80));
+    TEST_ASSERT_EQUAL(USB_SIM_STALL, usb_sim_in(0, 0, g_host, sizeof(g_host)));
+}
+
+void test_unsupported_request_stalls(void)
+{
+    const USBSetup setup = {
+        .request_type = 0x80,
+        .request = 0xFF,
+        .length = 4,
+    };
+    usb_sim_setup(0, 0, &setup);
+    TEST_ASSERT_EQUAL(USB_SIM_STALL, usb_sim_in(0, 0, g_host, sizeof(g_host)));
+
+    // the next SETUP clears the stall
+    const USBSetup get_descriptor = {
+        .request_type = 0x80,
+        .request = 6,
+        .value = 0x0100,
+        .length = 64,
+    };
+    usb_sim_setup(0, 0, &get_descriptor);
+    TEST_ASSERT_EQUAL(sizeof(USBDescriptorDevice),
+            usb_sim_in(0, 0, g_host, sizeof(g_host)));
+}
+
+void test_bus_reset(void)
+{
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer, 64,
+                completion_cb, NULL));
+    TEST_ASSERT_TRUE(usb_sim_endpoint_primed(0, 0x81));
+
+    usb_sim_bus_reset(0);
+    TEST_ASSERT_EQUAL(1, g_bus_resets);
+    TEST_ASSERT_FALSE(usb_sim_endpoint_primed(0, 0x81));
+    TEST_ASSERT_EQUAL(0, USB0_DEVICEADDR);
+}
+
+void test_interrupt_masked(void)
+{
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer, 64,
+                completion_cb, NULL));
+
+    bool irq_state = irq_disable();
+    TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(0, g_completions);
+    irq_restore(irq_state);
+    TEST_ASSERT_EQUAL(1, g_completions);
+}
+
+void test_interrupt_disabled_when_stopped(void)
+{
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer, 64,
+                completion_cb, NULL));
+    TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(1, g_completions);
+
+    usb_stop(&g_device);
+    TEST_ASSERT_EQUAL(USB_SIM_NAK, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+}
+
+void test_interrupt_threshold(void)
+{
+    usb_set_interrupt_threshold(&g_device, 3);
+    TEST_ASSERT_EQUAL_HEX32(USB0_USBCMD_D_ITC(4),
+            USB0_USBCMD_D & USB0_USBCMD_D_ITC_MASK);
+
+    for(int i = 0; i < 3; i++) {
+        TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer, 64,
+                    completion_cb, NULL));
+    }
+    const uint32_t irqs = usb_sim_irq_count(0);
+    for(int i = 0; i < 3; i++) {
+        TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    }
+    usb_sim_sof(0, 3);
+    TEST_ASSERT_EQUAL(0, g_completions);
+
+    usb_sim_sof(0, 1);
+    TEST_ASSERT_EQUAL(1, usb_sim_irq_count(0) - irqs);
+    TEST_ASSERT_EQUAL(3, g_completions);
+
+    usb_set_interrupt_threshold(&g_device, 0);
+    TEST_ASSERT_EQUAL_HEX32(0, USB0_USBCMD_D & USB0_USBCMD_D_ITC_MASK);
+    usb_set_interrupt_threshold(&g_device, 200);
+    TEST_ASSERT_EQUAL_HEX32(USB0_USBCMD_D_ITC(64),
+            USB0_USBCMD_D & USB0_USBCMD_D_ITC_MASK);
+}
+
+// Transfer one packet on the bulk IN endpoint
+static void bulk_in_packet(void)
+{
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer, 64,
+                completion_cb, NULL));
+    TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+}
+
+void test_poll_mode(void)
+{
+    usb_set_service_mode(&g_device, USB_SERVICE_POLL);
+    TEST_ASSERT_TRUE(usb_is_polling(&g_device));
+
+    const uint32_t irqs = usb_sim_irq_count(0);
+    bulk_in_packet();
+    TEST_ASSERT_EQUAL(0, g_completions);
+    TEST_ASSERT_TRUE(usb_poll(&g_device));
+    TEST_ASSERT_EQUAL(1, g_completions);
+    TEST_ASSERT_FALSE(usb_poll(&g_device));
+    TEST_ASSERT_EQUAL(irqs, usb_sim_irq_count(0));
+
+    // Bus events are polled too
+    usb_sim_bus_reset(0);
+    TEST_ASSERT_EQUAL(0, g_bus_resets);
+    TEST_ASSERT_TRUE(usb_poll(&g_device));
+    TEST_ASSERT_EQUAL(1, g_bus_resets);
+}
+
+void test_poll_mode_back_to_interrupt(void)
+{
+    usb_set_service_mode(&g_device, USB_SERVICE_POLL);
+    bulk_in_packet();
+
+    // The event that arrived while polling is not lost
+    usb_set_service_mode(&g_device, USB_SERVICE_INTERRUPT);
+    TEST_ASSERT_FALSE(usb_is_polling(&g_device));
+    TEST_ASSERT_EQUAL(1, g_completions);
+    bulk_in_packet();
+    TEST_ASSERT_EQUAL(2, g_completions);
+}
+
+void test_adaptive_switches_to_polling(void)
+{
+    usb_set_service_mode(&g_device, USB_SERVICE_ADAPTIVE);
+
+    for(int i = 0; i < USB_ADAPTIVE_IRQS_PER_FRAME; i++) {
+        TEST_ASSERT_FALSE(usb_is_polling(&g_device));
+        bulk_in_packet();
+        TEST_ASSERT_EQUAL(i + 1, g_completions);
+    }
+    TEST_ASSERT_TRUE(usb_is_polling(&g_device));
+
+    const uint32_t irqs = usb_sim_irq_count(0);
+    bulk_in_packet();
+    TEST_ASSERT_EQUAL(USB_ADAPTIVE_IRQS_PER_FRAME, g_completions);
+    TEST_ASSERT_TRUE(usb_poll(&g_device));
+    TEST_ASSERT_EQUAL(USB_ADAPTIVE_IRQS_PER_FRAME + 1, g_completions);
+    TEST_ASSERT_EQUAL(irqs, usb_sim_irq_count(0));
+
+    // Back to the interrupt once the polls come up empty
+    for(int i = 0; i < USB_ADAPTIVE_IDLE_POLLS; i++) {
+        TEST_ASSERT_TRUE(usb_is_polling(&g_device));
+        TEST_ASSERT_FALSE(usb_poll(&g_device));
+    }
+    TEST_ASSERT_FALSE(usb_is_polling(&g_device));
+    bulk_in_packet();
+    TEST_ASSERT_EQUAL(USB_ADAPTIVE_IRQS_PER_FRAME + 2, g_completions);
+    TEST_ASSERT_EQUAL(irqs + 1, usb_sim_irq_count(0));
+}
+
+void test_adaptive_rate_is_per_frame(void)
+{
+    usb_set_service_mode(&g_device, USB_SERVICE_ADAPTIVE);
+
+    // Fewer interrupts than the limit in every frame
+    for(int frame = 0; frame < 4; frame++) {
+        for(int i = 0; i < USB_ADAPTIVE_IRQS_PER_FRAME - 1; i++) {
+            bulk_in_packet();
+        }
+        usb_sim_sof(0, 8);
+    }
+    TEST_ASSERT_FALSE(usb_is_polling(&g_device));
+    TEST_ASSERT_EQUAL(4 * (USB_ADAPTIVE_IRQS_PER_FRAME - 1), g_completions);
+}
+
+void test_poll_mode_schedule_block(void)
+{
+    usb_set_service_mode(&g_device, USB_SERVICE_POLL);
+
+    // Fill the pool, then let a blocking schedule poll for space
+    for(int i = 0; i < 4; i++) {
+        TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer, 64,
+                    completion_cb, NULL));
+    }
+    TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule_block(g_bulk_in, g_buffer, 64,
+                completion_cb, NULL));
+    TEST_ASSERT_EQUAL(1, g_completions);
+}
+
+static int g_block_result;
+
+static void schedule_block_cb(void *user_data, int transferred)
+{
+    g_completions++;
+    // The completing transfer still holds its slot: the pool is full
+    g_block_result = usb_transfer_schedule_block(g_bulk_in, g_buffer, 64,
+            completion_cb, NULL);
+}
+
+void test_poll_mode_schedule_block_from_callback(void)
+{
+    usb_set_service_mode(&g_device, USB_SERVICE_POLL);
+
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer, 64,
+                schedule_block_cb, NULL));
+    for(int i = 0; i < 3; i++) {
+        TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer, 64,
+                    completion_cb, NULL));
+    }
+    TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+
+    // Waiting would have to poll from within usb_poll()
+    g_block_result = 0;
+    TEST_ASSERT_TRUE(usb_poll(&g_device));
+    TEST_ASSERT_EQUAL(1, g_completions);
+    TEST_ASSERT_EQUAL(-1, g_block_result);
+
+    // Outside of the callback the slot is free again
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule_block(g_bulk_in, g_buffer, 64,
+                completion_cb, NULL));
+}
+
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_speed);
+    RUN_TEST(test_get_device_descriptor);
+    RUN_TEST(test_get_descriptor_truncated);
+    RUN_TEST(test_set_address);
+    RUN_TEST(test_set_address_ack_fails);
+    RUN_TEST(test_get_descriptor_ack_fails);
+    RUN_TEST(test_unsupported_request_stalls);
+    RUN_TEST(test_bus_reset);
+    RUN_TEST(test_interrupt_masked);
+    RUN_TEST(test_interrupt_disabled_when_stopped);
+    RUN_TEST(test_interrupt_threshold);
+    RUN_TEST(test_poll_mode);
+    RUN_TEST(test_poll_mode_back_to_interrupt);
+    RUN_TEST(test_adaptive_switches_to_polling);
+    RUN_TEST(test_adaptive_rate_is_per_frame);
+    RUN_TEST(test_poll_mode_schedule_block);
+    RUN_TEST(test_poll_mode_schedule_block_from_callback);
+
+    UNITY_END();
+
+    return 0;
+}
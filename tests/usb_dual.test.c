@@ -0,0 +1,284 @@
+#include <stdbool.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "unity.h"
+#include "usb_sim.h"
+#include "chip.h"
+#include "mcu_usb.h"
+#include "usb_core.h"
+#include "usb_endpoint.h"
+#include "usb_queue.h"
+
+#define POOL_SIZE 4
+
+// SCU SFSUSB bits, see usb_core.c
+#define SFSUSB_ESEA     (1 << 1)
+#define SFSUSB_EPWR     (1 << 4)
+#define SFSUSB_VBUS     (1 << 5)
+
+extern USBQueueHead usb_qh0[12];
+extern USBQueueHead usb_qh1[12];
+
+static USBDescriptorDevice g_device_descriptor = {
+    .bLength = sizeof(USBDescriptorDevice),
+    .bDescriptorType = USB_DESCRIPTOR_TYPE_DEVICE,
+    .bMaxPacketSize0 = 64,
+};
+
+static int g_bus_resets;
+static int g_suspends;
+static int g_sofs;
+
+static void bus_reset_cb(void)
+{
+    g_bus_resets++;
+}
+
+static void suspend_cb(void)
+{
+    g_suspends++;
+}
+
+static void sof_cb(void)
+{
+    g_sofs++;
+}
+
+static USBDevice g_usb0 = {
+    .descriptor = &g_device_descriptor,
+    .controller = 0,
+};
+static USBDevice g_usb1 = {
+    .descriptor = &g_device_descriptor,
+    .controller = 1,
+    .bus_reset = bus_reset_cb,
+    .suspend = suspend_cb,
+    .start_of_frame = sof_cb,
+};
+static USBEndpoint *g_usb0_in;
+static USBEndpoint *g_usb1_in;
+static USBEndpoint *g_usb1_out;
+
+static uint8_t g_buffer[4][1024];
+static uint8_t g_host[1024];
+
+static int g_completions[NUM_USB_CONTROLLERS];
+static int g_transferred[NUM_USB_CONTROLLERS];
+
+static void usb0_complete(void *user_data, int transferred)
+{
+    g_completions[0]++;
+    g_transferred[0] = transferred;
+}
+
+static void usb1_complete(void *user_data, int transferred)
+{
+    g_completions[1]++;
+    g_transferred[1] = transferred;
+}
+
+static void start(USBPhy usb1_phy, USBSpeed usb1_speed)
+{
+    usb_sim_reset();
+    g_usb1.phy = usb1_phy;
+
+    g_usb0_in = usb_endpoint_create(0x81, &g_usb0, NULL,
+            usb_queue_transfer_complete, POOL_SIZE, usb_sim_alloc);
+    g_usb1_in = usb_endpoint_create(0x81, &g_usb1, NULL,
+            usb_queue_transfer_complete, POOL_SIZE, usb_sim_alloc);
+    g_usb1_out = usb_endpoint_create(0x02, &g_usb1, NULL,
+            usb_queue_transfer_complete, POOL_SIZE, usb_sim_alloc);
+    TEST_ASSERT_NOT_NULL(g_usb0_in);
+    TEST_ASSERT_NOT_NULL(g_usb1_in);
+    TEST_ASSERT_NOT_NULL(g_usb1_out);
+
+    const uint16_t usb1_packet = (usb1_phy == USB_PHY_ULPI) ? 512 : 64;
+    usb_device_init(&g_usb0);
+    usb_device_init(&g_usb1);
+    usb_endpoint_init_without_descriptor(g_usb0_in, 512,
+            USB_TRANSFER_TYPE_BULK);
+    usb_endpoint_init_without_descriptor(g_usb1_in, usb1_packet,
+            USB_TRANSFER_TYPE_BULK);
+    usb_endpoint_init_without_descriptor(g_usb1_out, usb1_packet,
+            USB_TRANSFER_TYPE_BULK);
+    usb_run(&g_usb0);
+    usb_run(&g_usb1);
+    usb_sim_attach(0, USB_SPEED_HIGH);
+    usb_sim_attach(1, usb1_speed);
+}
+
+void setUp(void)
+{
+    g_bus_resets = 0;
+    g_suspends = 0;
+    g_sofs = 0;
+    memset(g_completions, 0, sizeof(g_completions));
+    memset(g_transferred, 0, sizeof(g_transferred));
+
+    start(USB_PHY_INTERNAL, USB_SPEED_HIGH);
+}
+
+void tearDown(void)
+{
+}
+
+void test_usb1_full_speed_phy(void)
+{
+    // The on-chip PHY of USB1 can not do the high-speed handshake
+    TEST_ASSERT_EQUAL(USB_SPEED_HIGH, usb_speed(&g_usb0));
+    TEST_ASSERT_EQUAL(USB_SPEED_FULL, usb_speed(&g_usb1));
+    TEST_ASSERT_EQUAL(SFSUSB_ESEA | SFSUSB_EPWR | SFSUSB_VBUS,
+            LPC_SCU->SFSUSB);
+}
+
+void test_usb1_ulpi(void)
+{
+    start(USB_PHY_ULPI, USB_SPEED_HIGH);
+    TEST_ASSERT_EQUAL(USB_SPEED_HIGH, usb_speed(&g_usb1));
+    TEST_ASSERT_EQUAL(0, LPC_SCU->SFSUSB);
+}
+
+void test_usb1_attached_and_suspended(void)
+{
+    TEST_ASSERT_TRUE(usb_device_is_attached(&g_usb1));
+    TEST_ASSERT_FALSE(usb_device_is_suspended(&g_usb1));
+
+    usb_sim_suspend(1);
+    TEST_ASSERT_EQUAL(1, g_suspends);
+    TEST_ASSERT_TRUE(usb_device_is_suspended(&g_usb1));
+    TEST_ASSERT_FALSE(usb_device_is_suspended(&g_usb0));
+}
+
+void test_usb1_vbus_valid(void)
+{
+    usb_set_vbus_valid(&g_usb1, false);
+    TEST_ASSERT_EQUAL(SFSUSB_ESEA | SFSUSB_EPWR, LPC_SCU->SFSUSB);
+    usb_set_vbus_valid(&g_usb1, true);
+    TEST_ASSERT_EQUAL(SFSUSB_ESEA | SFSUSB_EPWR | SFSUSB_VBUS,
+            LPC_SCU->SFSUSB);
+
+    // USB0 has a VBUS pin of its own
+    usb_set_vbus_valid(&g_usb0, false);
+    TEST_ASSERT_EQUAL(SFSUSB_ESEA | SFSUSB_EPWR | SFSUSB_VBUS,
+            LPC_SCU->SFSUSB);
+}
+
+void test_usb1_bus_reset(void)
+{
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_usb1_in, g_buffer[0], 16,
+                usb1_complete, NULL));
+    TEST_ASSERT_TRUE(usb_sim_endpoint_primed(1, 0x81));
+
+    usb_sim_bus_reset(1);
+    TEST_ASSERT_EQUAL(1, g_bus_resets);
+    TEST_ASSERT_FALSE(usb_sim_endpoint_primed(1, 0x81));
+    TEST_ASSERT_EQUAL(0, g_completions[0]);
+}
+
+void test_usb1_timeout(void)
+{
+    // At full speed each SOF moves FRINDEX by 8 microframes
+    usb_set_sof_interrupt(&g_usb1, true);
+    usb_queue_set_timeout(g_usb1_in, 16);
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_usb1_in, g_buffer[0], 16,
+                usb1_complete, NULL));
+
+    usb_sim_sof(1, 1);
+    TEST_ASSERT_EQUAL(0, g_completions[1]);
+    usb_sim_sof(1, 1);
+    TEST_ASSERT_EQUAL(2, g_sofs);
+    TEST_ASSERT_EQUAL(1, g_completions[1]);
+    TEST_ASSERT_EQUAL(USB_TRANSFER_TIMEOUT, g_transferred[1]);
+}
+
+void test_endpoint_binding(void)
+{
+    TEST_ASSERT_EQUAL_PTR(&usb_qh0[3], g_usb0_in->qh);
+    TEST_ASSERT_EQUAL_HEX32(1 << 17, g_usb0_in->mask);
+    TEST_ASSERT_EQUAL_PTR(&usb_qh1[3], g_usb1_in->qh);
+    TEST_ASSERT_EQUAL_HEX32(1 << 17, g_usb1_in->mask);
+    TEST_ASSERT_EQUAL_PTR(&usb_qh1[4], g_usb1_out->qh);
+    TEST_ASSERT_EQUAL_HEX32(1 << 2, g_usb1_out->mask);
+}
+
+void test_stream_on_both_ports(void)
+{
+    for(int i = 0; i < 1024; i++) {
+        g_buffer[0][i] = i;
+        g_buffer[1][i] = 0xFF - i;
+    }
+
+    for(int round = 0; round < 8; round++) {
+        TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_usb0_in, g_buffer[0],
+                    1024, usb0_complete, NULL));
+        TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_usb1_in, g_buffer[1],
+                    128, usb1_complete, NULL));
+
+        // Interleave the packets of both ports
+        TEST_ASSERT_EQUAL(512, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+        TEST_ASSERT_EQUAL(64, usb_sim_in(1, 1, g_host, sizeof(g_host)));
+        TEST_ASSERT_EQUAL_MEMORY(g_buffer[1], g_host, 64);
+        TEST_ASSERT_EQUAL(512, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+        TEST_ASSERT_EQUAL_MEMORY(&g_buffer[0][512], g_host, 512);
+        TEST_ASSERT_EQUAL(round + 1, g_completions[0]);
+        TEST_ASSERT_EQUAL(round, g_completions[1]);
+        TEST_ASSERT_EQUAL(64, usb_sim_in(1, 1, g_host, sizeof(g_host)));
+        TEST_ASSERT_EQUAL_MEMORY(&g_buffer[1][64], g_host, 64);
+        TEST_ASSERT_EQUAL(round + 1, g_completions[1]);
+    }
+    TEST_ASSERT_EQUAL(1024, g_transferred[0]);
+    TEST_ASSERT_EQUAL(128, g_transferred[1]);
+}
+
+void test_same_endpoint_number_is_independent(void)
+{
+    // Endpoint 0x81 exists on both controllers: flushing one must not
+    // touch the other
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_usb0_in, g_buffer[0], 100,
+                usb0_complete, NULL));
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_usb1_in, g_buffer[1], 10,
+                usb1_complete, NULL));
+
+    usb_endpoint_flush(g_usb0_in);
+    TEST_ASSERT_FALSE(usb_sim_endpoint_primed(0, 0x81));
+    TEST_ASSERT_TRUE(usb_sim_endpoint_primed(1, 0x81));
+    TEST_ASSERT_EQUAL(10, usb_sim_in(1, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(1, g_completions[1]);
+    TEST_ASSERT_EQUAL(10, g_transferred[1]);
+}
+
+void test_usb1_out(void)
+{
+    for(int i = 0; i < 100; i++) {
+        g_host[i] = i * 3;
+    }
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_usb1_out, g_buffer[2], 512,
+                usb1_complete, NULL));
+    TEST_ASSERT_EQUAL(64, usb_sim_out(1, 2, g_host, 64));
+    TEST_ASSERT_EQUAL(36, usb_sim_out(1, 2, g_host + 64, 36));
+    TEST_ASSERT_EQUAL(1, g_completions[1]);
+    TEST_ASSERT_EQUAL(100, g_transferred[1]);
+    TEST_ASSERT_EQUAL_MEMORY(g_host, g_buffer[2], 100);
+    TEST_ASSERT_EQUAL(USB_SIM_NAK, usb_sim_out(0, 2, g_host, 1));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_usb1_full_speed_phy);
+    RUN_TEST(test_usb1_ulpi);
+    RUN_TEST(test_usb1_attached_and_suspended);
+    RUN_TEST(test_usb1_vbus_valid);
+    RUN_TEST(test_usb1_bus_reset);
+    RUN_TEST(test_usb1_timeout);
+    RUN_TEST(test_endpoint_binding);
+    RUN_TEST(test_stream_on_both_ports);
+    RUN_TEST(test_same_endpoint_number_is_independent);
+    RUN_TEST(test_usb1_out);
+
+    UNITY_END();
+
+    return 0;
+}
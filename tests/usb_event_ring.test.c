@@ -0,0 +1,255 @@
+#include <stdbool.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "unity.h"
+#include "usb_sim.h"
+#include "mcu_usb.h"
+#include "usb_core.h"
+#include "usb_queue.h"
+#include "usb_event_ring.h"
+
+#define POOL_SIZE 8
+#define RING_SIZE 8
+
+static USBDescriptorDevice g_device_descriptor = {
+    .bLength = sizeof(USBDescriptorDevice),
+    .bDescriptorType = USB_DESCRIPTOR_TYPE_DEVICE,
+    .bMaxPacketSize0 = 64,
+};
+static USBDevice g_device = {
+    .descriptor = &g_device_descriptor,
+    .controller = 0,
+};
+static USBEndpoint *g_bulk_in;
+static USBEndpoint *g_bulk_out;
+
+static uint8_t g_buffer[4][2048];
+static uint8_t g_host[2048];
+
+static USBCompletionEvent g_events[RING_SIZE];
+static USBEventRing g_ring;
+static int g_completions;
+
+static void completion_cb(void *user_data, int transferred)
+{
+    g_completions++;
+}
+
+void setUp(void)
+{
+    usb_sim_reset();
+    g_completions = 0;
+
+    g_bulk_in = usb_endpoint_create(0x81, &g_device, NULL,
+            usb_queue_transfer_complete, POOL_SIZE, usb_sim_alloc);
+    g_bulk_out = usb_endpoint_create(0x01, &g_device, NULL,
+            usb_queue_transfer_complete, POOL_SIZE, usb_sim_alloc);
+    TEST_ASSERT_NOT_NULL(g_bulk_in);
+    TEST_ASSERT_NOT_NULL(g_bulk_out);
+
+    usb_device_init(&g_device);
+    usb_endpoint_init_without_descriptor(g_bulk_in, 512,
+            USB_TRANSFER_TYPE_BULK);
+    usb_endpoint_init_without_descriptor(g_bulk_out, 512,
+            USB_TRANSFER_TYPE_BULK);
+    usb_run(&g_device);
+    usb_sim_attach(0, USB_SPEED_HIGH);
+
+    TEST_ASSERT_EQUAL(0, usb_event_ring_init(&g_ring, g_events, RING_SIZE));
+}
+
+void tearDown(void)
+{
+}
+
+void test_init_size(void)
+{
+    static USBEventRing ring;
+    TEST_ASSERT_EQUAL(-1, usb_event_ring_init(&ring, g_events, 0));
+    TEST_ASSERT_EQUAL(-1, usb_event_ring_init(&ring, g_events, 6));
+    TEST_ASSERT_EQUAL(0, usb_event_ring_init(&ring, g_events, 1));
+}
+
+void test_post_and_read(void)
+{
+    USBCompletionEvent event = {0};
+    USBCompletionEvent out[RING_SIZE];
+
+    TEST_ASSERT_EQUAL(0, usb_event_ring_read(&g_ring, out, RING_SIZE));
+    for (int i = 0; i < RING_SIZE; i++) {
+        event.transferred = i;
+        TEST_ASSERT_TRUE(usb_event_ring_post(&g_ring, &event));
+    }
+    TEST_ASSERT_EQUAL(RING_SIZE, usb_event_ring_count(&g_ring));
+
+    // full: the newest event is dropped
+    event.transferred = 100;
+    TEST_ASSERT_FALSE(usb_event_ring_post(&g_ring, &event));
+    TEST_ASSERT_EQUAL(1, usb_event_ring_dropped(&g_ring));
+
+    TEST_ASSERT_EQUAL(3, usb_event_ring_read(&g_ring, out, 3));
+    TEST_ASSERT_EQUAL(0, out[0].transferred);
+    TEST_ASSERT_EQUAL(2, out[2].transferred);
+    TEST_ASSERT_EQUAL(RING_SIZE - 3, usb_event_ring_count(&g_ring));
+
+    // wrap around the end of the storage
+    for (int i = 0; i < 3; i++) {
+        event.transferred = RING_SIZE + i;
+        TEST_ASSERT_TRUE(usb_event_ring_post(&g_ring, &event));
+    }
+    TEST_ASSERT_EQUAL(RING_SIZE, usb_event_ring_read(&g_ring, out, RING_SIZE));
+    for (int i = 0; i < RING_SIZE; i++) {
+        TEST_ASSERT_EQUAL(i + 3, out[i].transferred);
+    }
+    TEST_ASSERT_EQUAL(0, usb_event_ring_count(&g_ring));
+}
+
+void test_completion_events(void)
+{
+    USBCompletionEvent out[RING_SIZE];
+
+    usb_queue_set_event_ring(g_bulk_in, &g_ring);
+    usb_queue_set_event_ring(g_bulk_out, &g_ring);
+
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0], 64,
+                completion_cb, g_buffer[0]));
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_out, g_buffer[1], 1024,
+                NULL, g_buffer[1]));
+
+    TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    usb_sim_sof(0, 2);
+    TEST_ASSERT_EQUAL(100, usb_sim_out(0, 1, g_host, 100));
+
+    // no callbacks, slots are back in the pool right away
+    TEST_ASSERT_EQUAL(0, g_completions);
+    TEST_ASSERT_EQUAL(POOL_SIZE, usb_queue_free_slots(g_bulk_in));
+    TEST_ASSERT_EQUAL(POOL_SIZE, usb_queue_free_slots(g_bulk_out));
+
+    TEST_ASSERT_EQUAL(2, usb_event_ring_read(&g_ring, out, RING_SIZE));
+    TEST_ASSERT_EQUAL_PTR(g_bulk_in, out[0].endpoint);
+    TEST_ASSERT_EQUAL_PTR(g_buffer[0], out[0].user_data);
+    TEST_ASSERT_EQUAL(64, out[0].transferred);
+    TEST_ASSERT_EQUAL(0, out[0].status);
+    TEST_ASSERT_EQUAL_PTR(g_bulk_out, out[1].endpoint);
+    TEST_ASSERT_EQUAL_PTR(g_buffer[1], out[1].user_data);
+    TEST_ASSERT_EQUAL(100, out[1].transferred);
+    TEST_ASSERT_EQUAL(0, out[1].status);
+    TEST_ASSERT_EQUAL(2, (out[1].frame - out[0].frame) & 0x3FFF);
+}
+
+void test_flush_events(void)
+{
+    static uint8_t large[2 * USB_TRANSFER_MAX_DTD_LENGTH];
+    USBCompletionEvent out[RING_SIZE];
+
+    usb_queue_set_event_ring(g_bulk_in, &g_ring);
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0], 64,
+                completion_cb, g_buffer[0]));
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, large,
+                sizeof(large), completion_cb, large));
+    usb_endpoint_flush(g_bulk_in);
+
+    // one event per transfer, not per dTD
+    TEST_ASSERT_EQUAL(2, usb_event_ring_read(&g_ring, out, RING_SIZE));
+    TEST_ASSERT_EQUAL_PTR(g_buffer[0], out[0].user_data);
+    TEST_ASSERT_EQUAL(-1, out[0].status);
+    TEST_ASSERT_EQUAL_PTR(large, out[1].user_data);
+    TEST_ASSERT_EQUAL(-1, out[1].status);
+    TEST_ASSERT_EQUAL(0, g_completions);
+    TEST_ASSERT_EQUAL(POOL_SIZE, usb_queue_free_slots(g_bulk_in));
+}
+
+void test_ring_full(void)
+{
+    USBCompletionEvent out[RING_SIZE];
+
+    usb_queue_set_event_ring(g_bulk_in, &g_ring);
+    for (int i = 0; i < RING_SIZE + 2; i++) {
+        TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0],
+                    16, NULL, NULL));
+        TEST_ASSERT_EQUAL(16, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    }
+
+    // the transfers still complete, only their events are lost
+    TEST_ASSERT_EQUAL(POOL_SIZE, usb_queue_free_slots(g_bulk_in));
+    TEST_ASSERT_EQUAL(2, usb_event_ring_dropped(&g_ring));
+    TEST_ASSERT_EQUAL(RING_SIZE, usb_event_ring_read(&g_ring, out, RING_SIZE));
+}
+
+/* Producer and consumer on their own threads, to stand in for the
+ * interrupt and the application on a real core.
+ */
+#define STRESS_EVENTS 200000
+#define STRESS_RING_SIZE 64
+
+static USBCompletionEvent g_stress_events[STRESS_RING_SIZE];
+static USBEventRing g_stress_ring;
+
+static void *stress_producer(void *arg)
+{
+    USBCompletionEvent event = {0};
+    uint32_t posted = 0;
+    while (posted < STRESS_EVENTS) {
+        event.transferred = posted;
+        event.user_data = (void*)(uintptr_t)~posted;
+        if (usb_event_ring_post(&g_stress_ring, &event)) {
+            posted++;
+        } else {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+void test_concurrent_stress(void)
+{
+    USBCompletionEvent out[16];
+    pthread_t producer;
+
+    TEST_ASSERT_EQUAL(0, usb_event_ring_init(&g_stress_ring, g_stress_events,
+                STRESS_RING_SIZE));
+    TEST_ASSERT_EQUAL(0, pthread_create(&producer, NULL,
+                stress_producer, NULL));
+
+    uint32_t expected = 0;
+    bool in_order = true;
+    while (expected < STRESS_EVENTS && in_order) {
+        const size_t count = usb_event_ring_read(&g_stress_ring,
+                out, sizeof(out)/sizeof(out[0]));
+        if (count == 0) {
+            sched_yield();
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (out[i].transferred != expected
+                    || out[i].user_data != (void*)(uintptr_t)~expected) {
+                in_order = false;
+                break;
+            }
+            expected++;
+        }
+    }
+    pthread_join(producer, NULL);
+
+    TEST_ASSERT_TRUE(in_order);
+    TEST_ASSERT_EQUAL(STRESS_EVENTS, expected);
+    TEST_ASSERT_EQUAL(0, usb_event_ring_count(&g_stress_ring));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_init_size);
+    RUN_TEST(test_post_and_read);
+    RUN_TEST(test_completion_events);
+    RUN_TEST(test_flush_events);
+    RUN_TEST(test_ring_full);
+    RUN_TEST(test_concurrent_stress);
+
+    UNITY_END();
+
+    return 0;
+}
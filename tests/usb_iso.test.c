@@ -0,0 +1,415 @@
+#include <stdbool.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "unity.h"
+#include "usb_sim.h"
+#include "mcu_usb.h"
+#include "usb_core.h"
+#include "usb_queue.h"
+#include "usb_iso.h"
+#include "usb_descriptors.h"
+#include "lpc43xx_usb.h"
+
+#define POOL_SIZE 8
+#define NUM_SLOTS 4
+
+extern USBQueueHead usb_qh0[12];
+
+static USBDescriptorDevice g_device_descriptor = {
+    .bLength = sizeof(USBDescriptorDevice),
+    .bDescriptorType = USB_DESCRIPTOR_TYPE_DEVICE,
+    .bMaxPacketSize0 = 64,
+};
+static USBDevice g_device = {
+    .descriptor = &g_device_descriptor,
+    .controller = 0,
+};
+static USBEndpoint *g_iso_in;
+static USBEndpoint *g_iso_out;
+
+static uint8_t g_slots[NUM_SLOTS * 3072];
+static uint8_t g_host[1024];
+static USBIso g_iso;
+
+static uint32_t g_callbacks;
+static uint32_t g_fill_length;
+static uint32_t g_received[32];
+
+// IN: fill every byte of the slot with the slot count
+static uint32_t fill_cb(void *user_data, uint8_t *buffer, uint32_t length)
+{
+    memset(buffer, (uint8_t)g_callbacks, length);
+    g_callbacks++;
+    return g_fill_length;
+}
+
+// OUT: remember the first byte and the length of every slot
+static uint32_t receive_cb(void *user_data, uint8_t *buffer, uint32_t length)
+{
+    g_received[g_callbacks % 32] = (buffer[0] << 16) | length;
+    g_callbacks++;
+    return 0;
+}
+
+static void init_iso(uint16_t max_packet_size)
+{
+    usb_endpoint_init_without_descriptor(g_iso_in, max_packet_size,
+            USB_TRANSFER_TYPE_ISOCHRONOUS);
+    usb_endpoint_init_without_descriptor(g_iso_out, max_packet_size,
+            USB_TRANSFER_TYPE_ISOCHRONOUS);
+}
+
+void setUp(void)
+{
+    usb_sim_reset();
+    g_callbacks = 0;
+    g_fill_length = 64;
+
+    g_iso_in = usb_endpoint_create(0x81, &g_device, NULL,
+            usb_queue_transfer_complete, POOL_SIZE, usb_sim_alloc);
+    g_iso_out = usb_endpoint_create(0x01, &g_device, NULL,
+            usb_queue_transfer_complete, POOL_SIZE, usb_sim_alloc);
+    TEST_ASSERT_NOT_NULL(g_iso_in);
+    TEST_ASSERT_NOT_NULL(g_iso_out);
+
+    usb_device_init(&g_device);
+    init_iso(64);
+    usb_run(&g_device);
+    usb_sim_attach(0, USB_SPEED_HIGH);
+}
+
+void tearDown(void)
+{
+}
+
+void test_queue_head_mult(void)
+{
+    const uint32_t mult_mask = USB_QH_CAPABILITIES_MULT_MASK;
+    const uint32_t mpl_mask = USB_QH_CAPABILITIES_MPL_MASK;
+
+    TEST_ASSERT_EQUAL_HEX32(USB_QH_CAPABILITIES_MULT(1),
+            usb_qh0[3].capabilities & mult_mask);
+
+    // two additional transactions per microframe
+    init_iso((2 << 11) | 1024);
+    TEST_ASSERT_EQUAL_HEX32(USB_QH_CAPABILITIES_MULT(3),
+            usb_qh0[3].capabilities & mult_mask);
+    TEST_ASSERT_EQUAL_HEX32(USB_QH_CAPABILITIES_MPL(1024),
+            usb_qh0[3].capabilities & mpl_mask);
+    TEST_ASSERT_EQUAL_HEX32(USB_QH_CAPABILITIES_MULT(3),
+            usb_qh0[2].capabilities & mult_mask);
+
+    usb_endpoint_init_without_descriptor(g_iso_in, 512,
+            USB_TRANSFER_TYPE_BULK);
+    TEST_ASSERT_EQUAL_HEX32(0, usb_qh0[3].capabilities & mult_mask);
+}
+
+void test_in_idle_sends_empty_packet(void)
+{
+    TEST_ASSERT_EQUAL(0, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+}
+
+void test_in_stream(void)
+{
+    usb_iso_init(&g_iso, g_iso_in, g_slots, 64, NUM_SLOTS, 1,
+            fill_cb, NULL);
+    TEST_ASSERT_EQUAL(0, usb_iso_start(&g_iso));
+    TEST_ASSERT_EQUAL(NUM_SLOTS, g_callbacks);
+
+    for(int i = 0; i < 20; i++) {
+        usb_sim_sof(0, 1);
+        TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+        TEST_ASSERT_EQUAL_UINT8(i, g_host[0]);
+        TEST_ASSERT_EQUAL_UINT8(i, g_host[63]);
+    }
+    TEST_ASSERT_EQUAL(20 + NUM_SLOTS, g_callbacks);
+
+    USBIsoStats stats;
+    usb_iso_get_stats(&g_iso, &stats);
+    TEST_ASSERT_EQUAL(20, stats.slots);
+    TEST_ASSERT_EQUAL(0, stats.missed);
+    TEST_ASSERT_EQUAL(0, stats.errors);
+
+    usb_iso_stop(&g_iso);
+    TEST_ASSERT_EQUAL(0, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(POOL_SIZE, usb_queue_free_slots(g_iso_in));
+}
+
+void test_start_pool_too_small(void)
+{
+    // Every slot needs a spare transfer to be queued again
+    usb_iso_init(&g_iso, g_iso_in, g_slots, 64, POOL_SIZE, 1,
+            fill_cb, NULL);
+    TEST_ASSERT_EQUAL(-1, usb_iso_start(&g_iso));
+    TEST_ASSERT_EQUAL(0, g_callbacks);
+    TEST_ASSERT_EQUAL(POOL_SIZE, usb_queue_free_slots(g_iso_in));
+    TEST_ASSERT_FALSE(usb_sim_endpoint_primed(0, 0x81));
+}
+
+void test_out_stream(void)
+{
+    usb_iso_init(&g_iso, g_iso_out, g_slots, 64, NUM_SLOTS, 1,
+            receive_cb, NULL);
+    TEST_ASSERT_EQUAL(0, usb_iso_start(&g_iso));
+    TEST_ASSERT_EQUAL(0, g_callbacks);
+
+    for(int i = 0; i < 20; i++) {
+        memset(g_host, i, sizeof(g_host));
+        usb_sim_sof(0, 1);
+        TEST_ASSERT_EQUAL(10 + i, usb_sim_out(0, 1, g_host, 10 + i));
+    }
+    TEST_ASSERT_EQUAL(20, g_callbacks);
+    for(int i = 0; i < 20; i++) {
+        TEST_ASSERT_EQUAL_HEX32((i << 16) | (10 + i), g_received[i]);
+    }
+    usb_iso_stop(&g_iso);
+}
+
+void test_missed_slots(void)
+{
+    USBIsoStats stats;
+
+    usb_iso_init(&g_iso, g_iso_in, g_slots, 64, NUM_SLOTS, 1,
+            fill_cb, NULL);
+    TEST_ASSERT_EQUAL(0, usb_iso_start(&g_iso));
+
+    usb_sim_sof(0, 1);
+    TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    usb_sim_sof(0, 1);
+    TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+
+    // the host skips three microframes
+    usb_sim_sof(0, 4);
+    TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    usb_iso_get_stats(&g_iso, &stats);
+    TEST_ASSERT_EQUAL(3, stats.slots);
+    TEST_ASSERT_EQUAL(3, stats.missed);
+
+    // a service interval of 8 microframes
+    usb_iso_stop(&g_iso);
+    usb_iso_init(&g_iso, g_iso_in, g_slots, 64, NUM_SLOTS, 8,
+            fill_cb, NULL);
+    TEST_ASSERT_EQUAL(0, usb_iso_start(&g_iso));
+    for(int i = 0; i < 4; i++) {
+        usb_sim_sof(0, (i == 3) ? 24 : 8);
+        TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    }
+    usb_iso_get_stats(&g_iso, &stats);
+    TEST_ASSERT_EQUAL(4, stats.slots);
+    TEST_ASSERT_EQUAL(2, stats.missed);
+}
+
+void test_high_bandwidth_in(void)
+{
+    init_iso((1 << 11) | 512);
+    g_fill_length = 1024;
+    usb_iso_init(&g_iso, g_iso_in, g_slots, 1024, NUM_SLOTS, 1,
+            fill_cb, NULL);
+    TEST_ASSERT_EQUAL(0, usb_iso_start(&g_iso));
+
+    // two packets in one microframe complete one slot
+    usb_sim_sof(0, 1);
+    TEST_ASSERT_EQUAL(512, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(NUM_SLOTS, g_callbacks);
+    TEST_ASSERT_EQUAL(512, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(NUM_SLOTS + 1, g_callbacks);
+
+    // a slot that needs one packet only takes one
+    g_fill_length = 100;
+    usb_iso_stop(&g_iso);
+    TEST_ASSERT_EQUAL(0, usb_iso_start(&g_iso));
+    usb_sim_sof(0, 1);
+    TEST_ASSERT_EQUAL(100, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    usb_sim_sof(0, 1);
+    TEST_ASSERT_EQUAL(100, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+
+    USBIsoStats stats;
+    usb_iso_get_stats(&g_iso, &stats);
+    TEST_ASSERT_EQUAL(2, stats.slots);
+    TEST_ASSERT_EQUAL(0, stats.errors);
+}
+
+void test_incomplete_microframe(void)
+{
+    init_iso((1 << 11) | 512);
+    g_fill_length = 1024;
+    usb_iso_init(&g_iso, g_iso_in, g_slots, 1024, NUM_SLOTS, 1,
+            fill_cb, NULL);
+    TEST_ASSERT_EQUAL(0, usb_iso_start(&g_iso));
+
+    // the host only takes one of two packets: the slot is lost
+    usb_sim_sof(0, 1);
+    TEST_ASSERT_EQUAL(512, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    usb_sim_sof(0, 1);
+    TEST_ASSERT_EQUAL(512, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(512, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+
+    USBIsoStats stats;
+    usb_iso_get_stats(&g_iso, &stats);
+    TEST_ASSERT_EQUAL(2, stats.slots);
+    TEST_ASSERT_EQUAL(1, stats.errors);
+    TEST_ASSERT_EQUAL(0, stats.missed);
+}
+
+void test_timeout_requeues_slot(void)
+{
+    usb_set_sof_interrupt(&g_device, true);
+    usb_queue_set_timeout(g_iso_in, 4);
+    usb_iso_init(&g_iso, g_iso_in, g_slots, 64, NUM_SLOTS, 1,
+            fill_cb, NULL);
+    TEST_ASSERT_EQUAL(0, usb_iso_start(&g_iso));
+
+    // the host does not read: every slot expires and goes round again
+    usb_sim_sof(0, 4);
+    TEST_ASSERT_EQUAL(2 * NUM_SLOTS, g_callbacks);
+    TEST_ASSERT_EQUAL(POOL_SIZE - NUM_SLOTS, usb_queue_free_slots(g_iso_in));
+
+    USBIsoStats stats;
+    usb_iso_get_stats(&g_iso, &stats);
+    TEST_ASSERT_EQUAL(NUM_SLOTS, stats.slots);
+    TEST_ASSERT_EQUAL(NUM_SLOTS, stats.errors);
+
+    usb_queue_set_timeout(g_iso_in, 0);
+    TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL_UINT8(NUM_SLOTS, g_host[0]);
+}
+
+static int g_completions;
+static int g_transferred;
+
+static void completion_cb(void *user_data, int transferred)
+{
+    g_completions++;
+    g_transferred = transferred;
+}
+
+void test_iso_transfer_per_microframe(void)
+{
+    init_iso(HIGH_BANDWIDTH_PACKET_SIZE(1024, 3));
+    g_completions = 0;
+
+    // 6K is two microframes of three packets
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_iso_in, g_slots, 6144,
+                completion_cb, NULL));
+    TEST_ASSERT_EQUAL(POOL_SIZE - 2, usb_queue_free_slots(g_iso_in));
+    for(int frame = 0; frame < 2; frame++) {
+        usb_sim_sof(0, 1);
+        for(int i = 0; i < 3; i++) {
+            TEST_ASSERT_EQUAL(1024, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+        }
+    }
+    TEST_ASSERT_EQUAL(1, g_completions);
+    TEST_ASSERT_EQUAL(6144, g_transferred);
+
+    // a short microframe does not end an isochronous OUT transfer
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_iso_out, g_slots, 6144,
+                completion_cb, NULL));
+    usb_sim_sof(0, 1);
+    TEST_ASSERT_EQUAL(500, usb_sim_out(0, 1, g_host, 500));
+    TEST_ASSERT_EQUAL(1, g_completions);
+    usb_sim_sof(0, 1);
+    for(int i = 0; i < 3; i++) {
+        TEST_ASSERT_EQUAL(1024, usb_sim_out(0, 1, g_host, 1024));
+    }
+    TEST_ASSERT_EQUAL(2, g_completions);
+    TEST_ASSERT_EQUAL(500 + 3072, g_transferred);
+}
+
+void test_high_bandwidth_interrupt(void)
+{
+    usb_endpoint_init_without_descriptor(g_iso_in,
+            HIGH_BANDWIDTH_PACKET_SIZE(1024, 3), USB_TRANSFER_TYPE_INTERRUPT);
+    TEST_ASSERT_EQUAL_HEX32(0,
+            usb_qh0[3].capabilities & USB_QH_CAPABILITIES_MULT_MASK);
+    TEST_ASSERT_EQUAL_HEX32(USB_QH_CAPABILITIES_MPL(1024),
+            usb_qh0[3].capabilities & USB_QH_CAPABILITIES_MPL_MASK);
+
+    // one dTD answers all three tokens of the microframe
+    g_completions = 0;
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_iso_in, g_slots, 3072,
+                completion_cb, NULL));
+    TEST_ASSERT_EQUAL(POOL_SIZE - 1, usb_queue_free_slots(g_iso_in));
+    usb_sim_sof(0, 1);
+    for(int i = 0; i < 3; i++) {
+        TEST_ASSERT_EQUAL(1024, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    }
+    TEST_ASSERT_EQUAL(1, g_completions);
+    TEST_ASSERT_EQUAL(3072, g_transferred);
+}
+
+void test_high_bandwidth_descriptor(void)
+{
+    USBDescriptorDevice *device = descriptor_make_device(0x1234, 0x5678, 0x100);
+    USBDescriptorConfiguration *config = descriptor_make_configuration(
+            device, 1, 0x80, 50);
+    USBDescriptorInterface *interface = descriptor_make_interface(config, 0, 0);
+
+    TEST_ASSERT_TRUE(descriptor_make_endpoint(config, interface, 0x81,
+                USB_TRANSFER_TYPE_ISOCHRONOUS,
+                HIGH_BANDWIDTH_PACKET_SIZE(1024, 3), 1));
+    TEST_ASSERT_TRUE(descriptor_make_endpoint(config, interface, 0x82,
+                USB_TRANSFER_TYPE_INTERRUPT,
+                HIGH_BANDWIDTH_PACKET_SIZE(512, 2), 1));
+    TEST_ASSERT_TRUE(descriptor_ok());
+    TEST_ASSERT_EQUAL_HEX32(0x1400, HIGH_BANDWIDTH_PACKET_SIZE(1024, 3));
+
+    // bulk endpoints have one transaction per microframe at most
+    TEST_ASSERT_FALSE(descriptor_make_endpoint(config, interface, 0x83,
+                USB_TRANSFER_TYPE_BULK,
+                HIGH_BANDWIDTH_PACKET_SIZE(512, 2), 0));
+    TEST_ASSERT_FALSE(descriptor_ok());
+}
+
+// Whether a single endpoint descriptor is accepted
+static bool endpoint_descriptor_ok(uint8_t type, uint16_t max_packet_size)
+{
+    USBDescriptorDevice *device = descriptor_make_device(0x1234, 0x5678, 0x100);
+    USBDescriptorConfiguration *config = descriptor_make_configuration(
+            device, 1, 0x80, 50);
+    USBDescriptorInterface *interface = descriptor_make_interface(config, 0, 0);
+    descriptor_make_endpoint(config, interface, 0x81, type,
+            max_packet_size, 1);
+    return descriptor_ok();
+}
+
+void test_periodic_descriptor_limits(void)
+{
+    TEST_ASSERT_TRUE(endpoint_descriptor_ok(USB_TRANSFER_TYPE_ISOCHRONOUS,
+                1024));
+    TEST_ASSERT_TRUE(endpoint_descriptor_ok(USB_TRANSFER_TYPE_INTERRUPT,
+                HIGH_BANDWIDTH_PACKET_SIZE(1024, 3)));
+
+    // also without additional transactions
+    TEST_ASSERT_FALSE(endpoint_descriptor_ok(USB_TRANSFER_TYPE_ISOCHRONOUS,
+                1025));
+    TEST_ASSERT_FALSE(endpoint_descriptor_ok(USB_TRANSFER_TYPE_INTERRUPT,
+                HIGH_BANDWIDTH_PACKET_SIZE(1025, 2)));
+
+    // bits 12:11 == 3 is reserved
+    TEST_ASSERT_FALSE(endpoint_descriptor_ok(USB_TRANSFER_TYPE_ISOCHRONOUS,
+                HIGH_BANDWIDTH_PACKET_SIZE(256, 4)));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_queue_head_mult);
+    RUN_TEST(test_in_idle_sends_empty_packet);
+    RUN_TEST(test_in_stream);
+    RUN_TEST(test_start_pool_too_small);
+    RUN_TEST(test_out_stream);
+    RUN_TEST(test_missed_slots);
+    RUN_TEST(test_high_bandwidth_in);
+    RUN_TEST(test_incomplete_microframe);
+    RUN_TEST(test_timeout_requeues_slot);
+    RUN_TEST(test_iso_transfer_per_microframe);
+    RUN_TEST(test_high_bandwidth_interrupt);
+    RUN_TEST(test_high_bandwidth_descriptor);
+    RUN_TEST(test_periodic_descriptor_limits);
+
+    UNITY_END();
+
+    return 0;
+}
@@ -0,0 +1,313 @@
+#include <stdbool.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "unity.h"
+#include "usb_sim.h"
+#include "mcu_usb.h"
+#include "usb_core.h"
+#include "usb_endpoint.h"
+#include "usb_queue.h"
+#include "usb_pump.h"
+
+#define POOL_SIZE 8
+#define ELEM_SIZE 512
+#define NUM_ELEMS 4
+
+void assert(bool sane)
+{
+    TEST_ASSERT_MESSAGE(sane, "Assertion failed!");
+}
+
+static USBDescriptorDevice g_device_descriptor = {
+    .bLength = sizeof(USBDescriptorDevice),
+    .bDescriptorType = USB_DESCRIPTOR_TYPE_DEVICE,
+    .bMaxPacketSize0 = 64,
+};
+static USBDevice g_device = {
+    .descriptor = &g_device_descriptor,
+    .controller = 0,
+};
+static USBEndpoint *g_bulk_in;
+static USBEndpoint *g_bulk_out;
+
+static uint8_t g_elems[NUM_ELEMS][ELEM_SIZE];
+static Ringbuffer g_rb;
+static USBRingbuffer g_usb_rb;
+static USBPump g_pump;
+static uint8_t g_host[ELEM_SIZE];
+
+void setUp(void)
+{
+    usb_sim_reset();
+
+    g_bulk_in = usb_endpoint_create(0x81, &g_device, NULL,
+            usb_queue_transfer_complete, POOL_SIZE, usb_sim_alloc);
+    g_bulk_out = usb_endpoint_create(0x01, &g_device, NULL,
+            usb_queue_transfer_complete, POOL_SIZE, usb_sim_alloc);
+    TEST_ASSERT_NOT_NULL(g_bulk_in);
+    TEST_ASSERT_NOT_NULL(g_bulk_out);
+
+    usb_device_init(&g_device);
+    usb_endpoint_init_without_descriptor(g_bulk_in, 512,
+            USB_TRANSFER_TYPE_BULK);
+    usb_endpoint_init_without_descriptor(g_bulk_out, 512,
+            USB_TRANSFER_TYPE_BULK);
+    usb_run(&g_device);
+    usb_sim_attach(0, USB_SPEED_HIGH);
+
+    ringbuffer_init(&g_rb, g_elems, ELEM_SIZE, NUM_ELEMS);
+    usb_ringbuffer_init(&g_usb_rb, &g_rb);
+}
+
+void tearDown(void)
+{
+}
+
+static const uint32_t g_errors[] = {
+    USB_TD_DTD_TOKEN_STATUS_HALTED,
+    USB_TD_DTD_TOKEN_STATUS_BUFFER_ERROR,
+    USB_TD_DTD_TOKEN_STATUS_TRANSACTION_ERROR,
+};
+
+static void host_send(uint8_t value, size_t length)
+{
+    memset(g_host, value, length);
+    TEST_ASSERT_EQUAL(length, usb_sim_out(0, 1, g_host, length));
+}
+
+// The handle of the transfer at the head of the queue, as
+// usb_transfer_schedule_handle() would have returned it
+static USBTransferHandle head_handle(const USBEndpoint *endpoint)
+{
+    const usb_queue_t *queue = endpoint->queue;
+    const usb_transfer_t *t = queue->active;
+    return ((uint32_t)t->generation << 16) | (t - queue->transfers + 1);
+}
+
+void test_out_stream(void)
+{
+    usb_pump_init(&g_pump, g_bulk_out, &g_usb_rb, NUM_ELEMS);
+    TEST_ASSERT_EQUAL(0, usb_pump_start(&g_pump));
+    TEST_ASSERT_EQUAL(NUM_ELEMS, usb_pump_queued(&g_pump));
+    TEST_ASSERT_NULL(ringbuffer_get_readable(&g_rb));
+
+    host_send(0xA0, ELEM_SIZE);
+    host_send(0xA1, ELEM_SIZE);
+
+    // received elements are committed in place, no room to re-arm
+    TEST_ASSERT_EQUAL(NUM_ELEMS - 2, usb_pump_queued(&g_pump));
+    uint8_t *elem = ringbuffer_get_readable(&g_rb);
+    TEST_ASSERT_EQUAL_PTR(g_elems[0], elem);
+    TEST_ASSERT_EQUAL_UINT8(0xA0, elem[ELEM_SIZE - 1]);
+
+    // reading makes room for the pump
+    TEST_ASSERT_TRUE(ringbuffer_advance(&g_rb));
+    usb_pump_update(&g_pump);
+    TEST_ASSERT_EQUAL(NUM_ELEMS - 1, usb_pump_queued(&g_pump));
+
+    elem = ringbuffer_get_readable(&g_rb);
+    TEST_ASSERT_EQUAL_PTR(g_elems[1], elem);
+    TEST_ASSERT_EQUAL_UINT8(0xA1, elem[0]);
+}
+
+void test_out_short_packet(void)
+{
+    usb_pump_init(&g_pump, g_bulk_out, &g_usb_rb, 2);
+    TEST_ASSERT_EQUAL(0, usb_pump_start(&g_pump));
+    TEST_ASSERT_EQUAL(2, usb_pump_queued(&g_pump));
+
+    host_send(0x55, 100);
+    TEST_ASSERT_EQUAL_PTR(g_elems[0], ringbuffer_get_readable(&g_rb));
+    TEST_ASSERT_EQUAL_UINT8(0x55, g_elems[0][99]);
+
+    // re-armed with the next free element
+    TEST_ASSERT_EQUAL(2, usb_pump_queued(&g_pump));
+}
+
+void test_out_short_then_full_packet(void)
+{
+    uint32_t lengths[NUM_ELEMS];
+    usb_pump_init(&g_pump, g_bulk_out, &g_usb_rb, NUM_ELEMS);
+    usb_pump_set_lengths(&g_pump, lengths);
+    TEST_ASSERT_EQUAL(0, usb_pump_start(&g_pump));
+
+    host_send(0x55, 100);
+    host_send(0x66, ELEM_SIZE);
+
+    uint8_t *elem = ringbuffer_get_readable(&g_rb);
+    TEST_ASSERT_EQUAL_PTR(g_elems[0], elem);
+    TEST_ASSERT_EQUAL(100, usb_pump_length(&g_pump, elem));
+    TEST_ASSERT_TRUE(ringbuffer_advance(&g_rb));
+
+    elem = ringbuffer_get_readable(&g_rb);
+    TEST_ASSERT_EQUAL_PTR(g_elems[1], elem);
+    TEST_ASSERT_EQUAL(ELEM_SIZE, usb_pump_length(&g_pump, elem));
+    TEST_ASSERT_EQUAL_UINT8(0x66, elem[ELEM_SIZE - 1]);
+}
+
+void test_in_stream(void)
+{
+    for(int i = 0; i < 3; i++) {
+        uint8_t *elem = ringbuffer_get_writeable(&g_rb);
+        memset(elem, 0xB0 + i, ELEM_SIZE);
+        TEST_ASSERT_TRUE(ringbuffer_commit(&g_rb));
+    }
+
+    usb_pump_init(&g_pump, g_bulk_in, &g_usb_rb, 2);
+    TEST_ASSERT_EQUAL(0, usb_pump_start(&g_pump));
+    TEST_ASSERT_EQUAL(2, usb_pump_queued(&g_pump));
+
+    for(int i = 0; i < 3; i++) {
+        TEST_ASSERT_EQUAL(ELEM_SIZE, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+        TEST_ASSERT_EQUAL_UINT8(0xB0 + i, g_host[0]);
+    }
+    TEST_ASSERT_EQUAL(0, usb_pump_queued(&g_pump));
+    TEST_ASSERT_NULL(ringbuffer_get_readable(&g_rb));
+    TEST_ASSERT_EQUAL(USB_SIM_NAK, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+
+    // a drained stream continues after an update
+    uint8_t *elem = ringbuffer_get_writeable(&g_rb);
+    memset(elem, 0xC0, ELEM_SIZE);
+    TEST_ASSERT_TRUE(ringbuffer_commit(&g_rb));
+    usb_pump_update(&g_pump);
+    TEST_ASSERT_EQUAL(ELEM_SIZE, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL_UINT8(0xC0, g_host[0]);
+}
+
+void test_depth_limited_by_pool(void)
+{
+    static uint8_t elems[2 * POOL_SIZE][64];
+    ringbuffer_init(&g_rb, elems, sizeof(elems[0]), 2 * POOL_SIZE);
+    usb_ringbuffer_init(&g_usb_rb, &g_rb);
+
+    // the slot of a completing element is only free after its callback
+    usb_pump_init(&g_pump, g_bulk_out, &g_usb_rb, POOL_SIZE);
+    TEST_ASSERT_EQUAL(-1, usb_pump_start(&g_pump));
+    TEST_ASSERT_EQUAL(0, usb_pump_queued(&g_pump));
+    TEST_ASSERT_FALSE(usb_sim_endpoint_primed(0, 0x01));
+
+    // one slot to spare keeps the stream full
+    usb_pump_init(&g_pump, g_bulk_out, &g_usb_rb, POOL_SIZE - 1);
+    TEST_ASSERT_EQUAL(0, usb_pump_start(&g_pump));
+    for(int i = 0; i < 2 * POOL_SIZE; i++) {
+        memset(g_host, i, 64);
+        TEST_ASSERT_EQUAL(64, usb_sim_out(0, 1, g_host, 64));
+        TEST_ASSERT_EQUAL(POOL_SIZE - 1, usb_pump_queued(&g_pump));
+        TEST_ASSERT_EQUAL_UINT8(i, elems[i][0]);
+        TEST_ASSERT_TRUE(ringbuffer_advance(&g_rb));
+    }
+}
+
+void test_stop(void)
+{
+    usb_pump_init(&g_pump, g_bulk_out, &g_usb_rb, NUM_ELEMS);
+    TEST_ASSERT_EQUAL(0, usb_pump_start(&g_pump));
+    host_send(0xD0, ELEM_SIZE);
+
+    usb_pump_stop(&g_pump);
+    TEST_ASSERT_EQUAL(0, usb_pump_queued(&g_pump));
+    TEST_ASSERT_FALSE(usb_sim_endpoint_primed(0, 0x01));
+    TEST_ASSERT_EQUAL(USB_SIM_NAK, usb_sim_out(0, 1, g_host, ELEM_SIZE));
+
+    // the received element stays, the others are free to claim again
+    TEST_ASSERT_EQUAL_PTR(g_elems[0], ringbuffer_get_readable(&g_rb));
+    TEST_ASSERT_EQUAL(0, usb_pump_start(&g_pump));
+    TEST_ASSERT_EQUAL(NUM_ELEMS - 1, usb_pump_queued(&g_pump));
+    host_send(0xD1, ELEM_SIZE);
+    TEST_ASSERT_EQUAL_UINT8(0xD1, g_elems[1][0]);
+}
+
+
+void test_out_errors(void)
+{
+    uint32_t lengths[NUM_ELEMS];
+    usb_pump_init(&g_pump, g_bulk_out, &g_usb_rb, 2);
+    usb_pump_set_lengths(&g_pump, lengths);
+    TEST_ASSERT_EQUAL(0, usb_pump_start(&g_pump));
+
+    for(int i = 0; i < 3; i++) {
+        // committed without data and replaced by the next free element
+        TEST_ASSERT_TRUE(usb_sim_error(0, 0x01, g_errors[i]));
+        uint8_t *elem = ringbuffer_get_readable(&g_rb);
+        TEST_ASSERT_EQUAL_PTR(g_elems[i], elem);
+        TEST_ASSERT_EQUAL(0, usb_pump_length(&g_pump, elem));
+        TEST_ASSERT_TRUE(ringbuffer_advance(&g_rb));
+        TEST_ASSERT_EQUAL(2, usb_pump_queued(&g_pump));
+    }
+
+    host_send(0x77, 100);
+    uint8_t *elem = ringbuffer_get_readable(&g_rb);
+    TEST_ASSERT_EQUAL_PTR(g_elems[3], elem);
+    TEST_ASSERT_EQUAL(100, usb_pump_length(&g_pump, elem));
+    TEST_ASSERT_EQUAL_UINT8(0x77, elem[99]);
+}
+
+void test_in_errors(void)
+{
+    for(int i = 0; i < NUM_ELEMS; i++) {
+        uint8_t *elem = ringbuffer_get_writeable(&g_rb);
+        memset(elem, 0xE0 + i, ELEM_SIZE);
+        TEST_ASSERT_TRUE(ringbuffer_commit(&g_rb));
+    }
+    usb_pump_init(&g_pump, g_bulk_in, &g_usb_rb, 2);
+    TEST_ASSERT_EQUAL(0, usb_pump_start(&g_pump));
+
+    // failed elements are released unsent
+    for(int i = 0; i < 3; i++) {
+        TEST_ASSERT_TRUE(usb_sim_error(0, 0x81, g_errors[i]));
+    }
+    TEST_ASSERT_EQUAL(1, usb_pump_queued(&g_pump));
+    TEST_ASSERT_EQUAL(ELEM_SIZE, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL_UINT8(0xE3, g_host[0]);
+    TEST_ASSERT_NULL(ringbuffer_get_readable(&g_rb));
+}
+
+void test_out_cancel_and_timeout(void)
+{
+    uint32_t lengths[NUM_ELEMS];
+    usb_set_sof_interrupt(&g_device, true);
+    usb_queue_set_timeout(g_bulk_out, 8);
+    usb_pump_init(&g_pump, g_bulk_out, &g_usb_rb, 2);
+    usb_pump_set_lengths(&g_pump, lengths);
+    TEST_ASSERT_EQUAL(0, usb_pump_start(&g_pump));
+
+    // both elements time out, the next two are queued with a new deadline
+    usb_sim_sof(0, 8);
+    TEST_ASSERT_EQUAL(2, usb_pump_queued(&g_pump));
+    usb_queue_set_timeout(g_bulk_out, 0);
+
+    // no free element left to replace it
+    TEST_ASSERT_EQUAL(0, usb_transfer_cancel(g_bulk_out,
+                head_handle(g_bulk_out)));
+    TEST_ASSERT_EQUAL(1, usb_pump_queued(&g_pump));
+
+    for(int i = 0; i < 3; i++) {
+        uint8_t *elem = ringbuffer_get_readable(&g_rb);
+        TEST_ASSERT_EQUAL_PTR(g_elems[i], elem);
+        TEST_ASSERT_EQUAL(0, usb_pump_length(&g_pump, elem));
+        TEST_ASSERT_TRUE(ringbuffer_advance(&g_rb));
+    }
+    host_send(0x88, ELEM_SIZE);
+    TEST_ASSERT_EQUAL(ELEM_SIZE, usb_pump_length(&g_pump, g_elems[3]));
+    TEST_ASSERT_EQUAL_UINT8(0x88, g_elems[3][0]);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_out_stream);
+    RUN_TEST(test_out_short_packet);
+    RUN_TEST(test_out_short_then_full_packet);
+    RUN_TEST(test_in_stream);
+    RUN_TEST(test_depth_limited_by_pool);
+    RUN_TEST(test_stop);
+    RUN_TEST(test_out_errors);
+    RUN_TEST(test_in_errors);
+    RUN_TEST(test_out_cancel_and_timeout);
+
+    UNITY_END();
+
+    return 0;
+}
@@ -0,0 +1,1181 @@
+#include <stdbool.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "unity.h"
+#include "usb_sim.h"
+#include "mcu_usb.h"
+#include "usb_core.h"
+#include "usb_endpoint.h"
+#include "usb_critical.h"
+#include "usb_queue.h"
+
+#define POOL_SIZE 8
+
+static USBDescriptorDevice g_device_descriptor = {
+    .bLength = sizeof(USBDescriptorDevice),
+    .bDescriptorType = USB_DESCRIPTOR_TYPE_DEVICE,
+    .bMaxPacketSize0 = 64,
+};
+static USBDevice g_device = {
+    .descriptor = &g_device_descriptor,
+    .controller = 0,
+};
+static USBEndpoint *g_bulk_in;
+static USBEndpoint *g_bulk_out;
+
+static uint8_t g_buffer[4][2048];
+static uint8_t g_host[2048];
+static uint8_t g_large[3 * USB_TRANSFER_MAX_DTD_LENGTH];
+
+static int g_completions;
+static int g_transferred[64];
+static void *g_user_data[64];
+
+static void completion_cb(void *user_data, int transferred)
+{
+    g_user_data[g_completions] = user_data;
+    g_transferred[g_completions] = transferred;
+    g_completions++;
+}
+
+void setUp(void)
+{
+    usb_sim_reset();
+    g_completions = 0;
+    g_device.events_pending = NULL;
+
+    g_bulk_in = usb_endpoint_create(0x81, &g_device, NULL,
+            usb_queue_transfer_complete, POOL_SIZE, usb_sim_alloc);
+    g_bulk_out = usb_endpoint_create(0x01, &g_device, NULL,
+            usb_queue_transfer_complete, POOL_SIZE, usb_sim_alloc);
+    TEST_ASSERT_NOT_NULL(g_bulk_in);
+    TEST_ASSERT_NOT_NULL(g_bulk_out);
+
+    usb_device_init(&g_device);
+    usb_endpoint_init_without_descriptor(g_bulk_in, 512,
+            USB_TRANSFER_TYPE_BULK);
+    usb_endpoint_init_without_descriptor(g_bulk_out, 512,
+            USB_TRANSFER_TYPE_BULK);
+    usb_run(&g_device);
+    usb_sim_attach(0, USB_SPEED_HIGH);
+}
+
+void tearDown(void)
+{
+}
+
+void test_nak_when_idle(void)
+{
+    TEST_ASSERT_FALSE(usb_sim_endpoint_primed(0, 0x81));
+    TEST_ASSERT_EQUAL(USB_SIM_NAK, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(USB_SIM_NAK, usb_sim_out(0, 1, g_host, 1));
+}
+
+void test_bulk_in(void)
+{
+    for(int i = 0; i < 1000; i++) {
+        g_buffer[0][i] = i;
+    }
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0], 1000,
+                completion_cb, g_buffer[0]));
+    TEST_ASSERT_TRUE(usb_sim_endpoint_primed(0, 0x81));
+
+    TEST_ASSERT_EQUAL(512, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(0, g_completions);
+    TEST_ASSERT_EQUAL(488, usb_sim_in(0, 1, g_host + 512, sizeof(g_host)));
+
+    TEST_ASSERT_EQUAL(1, g_completions);
+    TEST_ASSERT_EQUAL(1000, g_transferred[0]);
+    TEST_ASSERT_EQUAL_PTR(g_buffer[0], g_user_data[0]);
+    TEST_ASSERT_EQUAL_MEMORY(g_buffer[0], g_host, 1000);
+    TEST_ASSERT_FALSE(usb_queue_active(g_bulk_in));
+    TEST_ASSERT_FALSE(usb_sim_endpoint_primed(0, 0x81));
+}
+
+void test_bulk_out_short_packet(void)
+{
+    for(int i = 0; i < 100; i++) {
+        g_host[i] = 0xFF - i;
+    }
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_out, g_buffer[0], 1024,
+                completion_cb, NULL));
+
+    TEST_ASSERT_EQUAL(100, usb_sim_out(0, 1, g_host, 100));
+    TEST_ASSERT_EQUAL(1, g_completions);
+    TEST_ASSERT_EQUAL(100, g_transferred[0]);
+    TEST_ASSERT_EQUAL_MEMORY(g_host, g_buffer[0], 100);
+}
+
+void test_append_to_running_queue(void)
+{
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0], 512,
+                completion_cb, g_buffer[0]));
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[1], 100,
+                completion_cb, g_buffer[1]));
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[2], 0,
+                completion_cb, g_buffer[2]));
+
+    TEST_ASSERT_EQUAL(512, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(100, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(0, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(USB_SIM_NAK, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+
+    TEST_ASSERT_EQUAL(3, g_completions);
+    TEST_ASSERT_EQUAL_PTR(g_buffer[0], g_user_data[0]);
+    TEST_ASSERT_EQUAL_PTR(g_buffer[1], g_user_data[1]);
+    TEST_ASSERT_EQUAL_PTR(g_buffer[2], g_user_data[2]);
+    TEST_ASSERT_EQUAL(512, g_transferred[0]);
+    TEST_ASSERT_EQUAL(100, g_transferred[1]);
+    TEST_ASSERT_EQUAL(0, g_transferred[2]);
+}
+
+void test_reprime_after_idle(void)
+{
+    for(int i = 0; i < 3; i++) {
+        TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0], 64,
+                    completion_cb, NULL));
+        TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+        TEST_ASSERT_EQUAL(i + 1, g_completions);
+        TEST_ASSERT_FALSE(usb_sim_endpoint_primed(0, 0x81));
+    }
+}
+
+void test_pool_exhausted(void)
+{
+    TEST_ASSERT_EQUAL(POOL_SIZE, queue_free_space(g_bulk_in));
+    for(int i = 0; i < POOL_SIZE; i++) {
+        TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0], 8,
+                    completion_cb, NULL));
+    }
+    TEST_ASSERT_EQUAL(0, queue_free_space(g_bulk_in));
+    TEST_ASSERT_EQUAL(-1, usb_transfer_schedule(g_bulk_in, g_buffer[0], 8,
+                completion_cb, NULL));
+
+    TEST_ASSERT_EQUAL(8, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(1, queue_free_space(g_bulk_in));
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0], 8,
+                completion_cb, NULL));
+}
+
+void test_flush(void)
+{
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0], 64,
+                completion_cb, NULL));
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[1], 64,
+                completion_cb, NULL));
+
+    usb_endpoint_flush(g_bulk_in);
+
+    TEST_ASSERT_EQUAL(2, g_completions);
+    TEST_ASSERT_EQUAL(-1, g_transferred[0]);
+    TEST_ASSERT_EQUAL(-1, g_transferred[1]);
+    TEST_ASSERT_EQUAL(POOL_SIZE, queue_free_space(g_bulk_in));
+    TEST_ASSERT_FALSE(usb_sim_endpoint_primed(0, 0x81));
+    TEST_ASSERT_EQUAL(USB_SIM_NAK, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+}
+
+void test_schedule_after_flush(void)
+{
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0], 64,
+                completion_cb, NULL));
+    usb_endpoint_flush(g_bulk_in);
+
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[1], 32,
+                completion_cb, g_buffer[1]));
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[2], 16,
+                completion_cb, g_buffer[2]));
+    TEST_ASSERT_TRUE(usb_sim_endpoint_primed(0, 0x81));
+
+    TEST_ASSERT_EQUAL(32, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(16, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(3, g_completions);
+    TEST_ASSERT_EQUAL_PTR(g_buffer[2], g_user_data[2]);
+}
+
+void test_cancel_queued(void)
+{
+    USBTransferHandle handles[3];
+    for(int i = 0; i < 3; i++) {
+        handles[i] = usb_transfer_schedule_handle(g_bulk_in, g_buffer[i],
+                16 * (i + 1), completion_cb, g_buffer[i]);
+        TEST_ASSERT_NOT_EQUAL(USB_TRANSFER_HANDLE_NONE, handles[i]);
+    }
+    TEST_ASSERT_EQUAL(0, usb_transfer_cancel(g_bulk_in, handles[1]));
+    TEST_ASSERT_EQUAL(1, g_completions);
+    TEST_ASSERT_EQUAL_PTR(g_buffer[1], g_user_data[0]);
+    TEST_ASSERT_EQUAL(USB_TRANSFER_CANCELLED, g_transferred[0]);
+    TEST_ASSERT_EQUAL(POOL_SIZE - 2, queue_free_space(g_bulk_in));
+
+    TEST_ASSERT_EQUAL(16, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(48, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(USB_SIM_NAK, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(3, g_completions);
+    TEST_ASSERT_EQUAL_PTR(g_buffer[0], g_user_data[1]);
+    TEST_ASSERT_EQUAL_PTR(g_buffer[2], g_user_data[2]);
+}
+
+void test_cancel_tail(void)
+{
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0], 16,
+                completion_cb, g_buffer[0]));
+    const USBTransferHandle handle = usb_transfer_schedule_handle(g_bulk_in,
+            g_buffer[1], 32, completion_cb, g_buffer[1]);
+    TEST_ASSERT_EQUAL(0, usb_transfer_cancel(g_bulk_in, handle));
+
+    // appending goes behind the new tail
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[2], 48,
+                completion_cb, g_buffer[2]));
+    TEST_ASSERT_EQUAL(16, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(48, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(USB_SIM_NAK, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(3, g_completions);
+    TEST_ASSERT_EQUAL_PTR(g_buffer[2], g_user_data[2]);
+}
+
+void test_cancel_in_progress(void)
+{
+    for(int i = 0; i < 100; i++) {
+        g_host[i] = i;
+    }
+    const USBTransferHandle handle = usb_transfer_schedule_handle(g_bulk_out,
+            g_buffer[0], 1024, completion_cb, g_buffer[0]);
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_out, g_buffer[1], 512,
+                completion_cb, g_buffer[1]));
+    TEST_ASSERT_EQUAL(512, usb_sim_out(0, 1, g_host, 512));
+
+    TEST_ASSERT_EQUAL(0, usb_transfer_cancel(g_bulk_out, handle));
+    TEST_ASSERT_EQUAL(1, g_completions);
+    TEST_ASSERT_EQUAL(USB_TRANSFER_CANCELLED, g_transferred[0]);
+    TEST_ASSERT_TRUE(usb_sim_endpoint_primed(0, 0x01));
+
+    // the endpoint restarted at the next transfer
+    TEST_ASSERT_EQUAL(100, usb_sim_out(0, 1, g_host, 100));
+    TEST_ASSERT_EQUAL(2, g_completions);
+    TEST_ASSERT_EQUAL_PTR(g_buffer[1], g_user_data[1]);
+    TEST_ASSERT_EQUAL(100, g_transferred[1]);
+    TEST_ASSERT_EQUAL_MEMORY(g_host, g_buffer[1], 100);
+}
+
+void test_cancel_last_in_progress(void)
+{
+    const USBTransferHandle handle = usb_transfer_schedule_handle(g_bulk_in,
+            g_buffer[0], 1024, completion_cb, g_buffer[0]);
+    TEST_ASSERT_EQUAL(512, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+
+    TEST_ASSERT_EQUAL(0, usb_transfer_cancel(g_bulk_in, handle));
+    TEST_ASSERT_FALSE(usb_queue_active(g_bulk_in));
+    TEST_ASSERT_FALSE(usb_sim_endpoint_primed(0, 0x81));
+    TEST_ASSERT_EQUAL(USB_SIM_NAK, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[1], 8,
+                completion_cb, g_buffer[1]));
+    TEST_ASSERT_EQUAL(8, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(2, g_completions);
+    TEST_ASSERT_EQUAL(8, g_transferred[1]);
+}
+
+void test_cancel_behind_finished(void)
+{
+    // Without interrupts the first transfer is only retired by the cancel
+    usb_queue_set_irq_policy(g_bulk_in, USB_IRQ_LAST_OF_BATCH, 0);
+    const USBTransferRequest batch[] = {
+        {g_buffer[0], 16, completion_cb, g_buffer[0]},
+        {g_buffer[1], 32, completion_cb, g_buffer[1]},
+        {g_buffer[2], 48, completion_cb, g_buffer[2]},
+    };
+    USBTransferHandle handles[3];
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule_batch_handles(g_bulk_in, batch,
+                3, handles));
+    TEST_ASSERT_EQUAL(16, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(0, g_completions);
+
+    TEST_ASSERT_EQUAL(0, usb_transfer_cancel(g_bulk_in, handles[1]));
+    TEST_ASSERT_EQUAL(2, g_completions);
+    TEST_ASSERT_EQUAL(16, g_transferred[0]);
+    TEST_ASSERT_EQUAL(USB_TRANSFER_CANCELLED, g_transferred[1]);
+
+    TEST_ASSERT_EQUAL(48, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(3, g_completions);
+    TEST_ASSERT_EQUAL_PTR(g_buffer[2], g_user_data[2]);
+}
+
+void test_cancel_large(void)
+{
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0], 16,
+                completion_cb, g_buffer[0]));
+    const USBTransferHandle handle = usb_transfer_schedule_handle(g_bulk_in,
+            g_large, sizeof(g_large), completion_cb, g_large);
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[2], 48,
+                completion_cb, g_buffer[2]));
+    TEST_ASSERT_EQUAL(POOL_SIZE - 5, queue_free_space(g_bulk_in));
+
+    TEST_ASSERT_EQUAL(0, usb_transfer_cancel(g_bulk_in, handle));
+    TEST_ASSERT_EQUAL(POOL_SIZE - 2, queue_free_space(g_bulk_in));
+
+    TEST_ASSERT_EQUAL(16, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(48, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(3, g_completions);
+    TEST_ASSERT_EQUAL(POOL_SIZE, queue_free_space(g_bulk_in));
+}
+
+void test_cancel_not_queued(void)
+{
+    TEST_ASSERT_EQUAL(-1, usb_transfer_cancel(g_bulk_in,
+                USB_TRANSFER_HANDLE_NONE));
+    TEST_ASSERT_EQUAL(-1, usb_transfer_cancel(g_bulk_in, 1));
+    TEST_ASSERT_EQUAL(-1, usb_transfer_cancel(g_bulk_in, POOL_SIZE + 1));
+
+    const USBTransferHandle handle = usb_transfer_schedule_handle(g_bulk_in,
+            g_buffer[0], 16, completion_cb, g_buffer[0]);
+    TEST_ASSERT_NOT_EQUAL(USB_TRANSFER_HANDLE_NONE, handle);
+    TEST_ASSERT_EQUAL(16, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(-1, usb_transfer_cancel(g_bulk_in, handle));
+    TEST_ASSERT_EQUAL(1, g_completions);
+    TEST_ASSERT_EQUAL(16, g_transferred[0]);
+}
+
+void test_cancel_shared_user_data(void)
+{
+    USBTransferHandle handles[3];
+    for(int i = 0; i < 3; i++) {
+        handles[i] = usb_transfer_schedule_handle(g_bulk_in, g_buffer[i],
+                16 * (i + 1), completion_cb, NULL);
+    }
+    TEST_ASSERT_EQUAL(0, usb_transfer_cancel(g_bulk_in, handles[1]));
+    TEST_ASSERT_EQUAL(1, g_completions);
+    TEST_ASSERT_EQUAL(USB_TRANSFER_CANCELLED, g_transferred[0]);
+    TEST_ASSERT_EQUAL(-1, usb_transfer_cancel(g_bulk_in, handles[1]));
+
+    TEST_ASSERT_EQUAL(16, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(48, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(3, g_completions);
+}
+
+void test_cancel_reused_slot(void)
+{
+    // The pool hands out the slot of a completed transfer again
+    const USBTransferHandle old = usb_transfer_schedule_handle(g_bulk_in,
+            g_buffer[0], 16, completion_cb, g_buffer[0]);
+    TEST_ASSERT_EQUAL(16, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    const USBTransferHandle handle = usb_transfer_schedule_handle(g_bulk_in,
+            g_buffer[1], 32, completion_cb, g_buffer[1]);
+    TEST_ASSERT_EQUAL(old & 0xFFFF, handle & 0xFFFF);
+    TEST_ASSERT_NOT_EQUAL(old, handle);
+
+    TEST_ASSERT_EQUAL(-1, usb_transfer_cancel(g_bulk_in, old));
+    TEST_ASSERT_EQUAL(1, g_completions);
+    TEST_ASSERT_EQUAL(0, usb_transfer_cancel(g_bulk_in, handle));
+    TEST_ASSERT_EQUAL(2, g_completions);
+    TEST_ASSERT_EQUAL_PTR(g_buffer[1], g_user_data[1]);
+    TEST_ASSERT_EQUAL(USB_TRANSFER_CANCELLED, g_transferred[1]);
+}
+
+void test_timeout(void)
+{
+    usb_set_sof_interrupt(&g_device, true);
+    usb_queue_set_timeout(g_bulk_in, 8);
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0], 16,
+                completion_cb, g_buffer[0]));
+
+    usb_sim_sof(0, 7);
+    TEST_ASSERT_EQUAL(0, g_completions);
+    usb_sim_sof(0, 1);
+    TEST_ASSERT_EQUAL(1, g_completions);
+    TEST_ASSERT_EQUAL(USB_TRANSFER_TIMEOUT, g_transferred[0]);
+    TEST_ASSERT_EQUAL(POOL_SIZE, queue_free_space(g_bulk_in));
+    TEST_ASSERT_FALSE(usb_sim_endpoint_primed(0, 0x81));
+    TEST_ASSERT_EQUAL(USB_SIM_NAK, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+}
+
+void test_timeout_keeps_streaming(void)
+{
+    usb_set_sof_interrupt(&g_device, true);
+    usb_queue_set_timeout(g_bulk_in, 8);
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0], 16,
+                completion_cb, g_buffer[0]));
+    usb_sim_sof(0, 4);
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[1], 32,
+                completion_cb, g_buffer[1]));
+    usb_sim_sof(0, 4);
+    TEST_ASSERT_EQUAL(1, g_completions);
+    TEST_ASSERT_EQUAL_PTR(g_buffer[0], g_user_data[0]);
+
+    TEST_ASSERT_EQUAL(32, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(2, g_completions);
+    TEST_ASSERT_EQUAL(32, g_transferred[1]);
+    usb_sim_sof(0, 8);
+    TEST_ASSERT_EQUAL(2, g_completions);
+}
+
+void test_timeout_polled(void)
+{
+    // Deadlines wrap around with the frame counter
+    usb_sim_sof(0, 0x3FFC);
+    usb_queue_set_timeout(g_bulk_out, 8);
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_out, g_buffer[0], 1024,
+                completion_cb, g_buffer[0]));
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_out, g_buffer[1], 1024,
+                completion_cb, g_buffer[1]));
+    TEST_ASSERT_EQUAL(512, usb_sim_out(0, 1, g_host, 512));
+
+    usb_sim_sof(0, 7);
+    usb_queue_check_timeouts(&g_device);
+    TEST_ASSERT_EQUAL(0, g_completions);
+    usb_sim_sof(0, 1);
+    usb_queue_check_timeouts(&g_device);
+    TEST_ASSERT_EQUAL(2, g_completions);
+    TEST_ASSERT_EQUAL(USB_TRANSFER_TIMEOUT, g_transferred[0]);
+    TEST_ASSERT_EQUAL(USB_TRANSFER_TIMEOUT, g_transferred[1]);
+    TEST_ASSERT_FALSE(usb_queue_active(g_bulk_out));
+}
+
+void test_timeout_disabled(void)
+{
+    usb_set_sof_interrupt(&g_device, true);
+    usb_queue_set_timeout(g_bulk_in, 8);
+    usb_queue_set_timeout(g_bulk_in, 0);
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0], 16,
+                completion_cb, g_buffer[0]));
+    usb_sim_sof(0, 0x3000);
+    TEST_ASSERT_EQUAL(0, g_completions);
+    TEST_ASSERT_EQUAL(16, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(1, g_completions);
+}
+
+void test_error_restarts_endpoint(void)
+{
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_out, g_buffer[0], 100,
+                completion_cb, g_buffer[0]));
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_out, g_buffer[1], 512,
+                completion_cb, g_buffer[1]));
+
+    // babble: the packet does not fit the first transfer
+    TEST_ASSERT_EQUAL(USB_SIM_STALL, usb_sim_out(0, 1, g_host, 512));
+    TEST_ASSERT_EQUAL(1, g_completions);
+    TEST_ASSERT_EQUAL(USB_TRANSFER_HALTED, g_transferred[0]);
+    TEST_ASSERT_TRUE(usb_sim_endpoint_primed(0, 0x01));
+
+    TEST_ASSERT_EQUAL(100, usb_sim_out(0, 1, g_host, 100));
+    TEST_ASSERT_EQUAL(2, g_completions);
+    TEST_ASSERT_EQUAL_PTR(g_buffer[1], g_user_data[1]);
+    TEST_ASSERT_EQUAL(100, g_transferred[1]);
+    TEST_ASSERT_EQUAL(POOL_SIZE, queue_free_space(g_bulk_out));
+
+    USBQueueErrors errors;
+    usb_queue_get_errors(g_bulk_out, &errors);
+    TEST_ASSERT_EQUAL(1, errors.halted);
+    TEST_ASSERT_EQUAL(0, errors.buffer_errors);
+    TEST_ASSERT_EQUAL(0, errors.transaction_errors);
+}
+
+void test_error_in_large_transfer(void)
+{
+    static USBCompletionEvent events[4];
+    static USBEventRing ring;
+    TEST_ASSERT_EQUAL(0, usb_event_ring_init(&ring, events, 4));
+    usb_queue_set_event_ring(g_bulk_out, &ring);
+
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_out, g_large,
+                sizeof(g_large), completion_cb, g_large));
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_out, g_buffer[1], 512,
+                completion_cb, g_buffer[1]));
+    TEST_ASSERT_EQUAL(512, usb_sim_out(0, 1, g_host, 512));
+    TEST_ASSERT_EQUAL(USB_SIM_STALL, usb_sim_out(0, 1, g_host, 600));
+
+    // the rest of the large transfer is dropped
+    TEST_ASSERT_EQUAL(8, usb_sim_out(0, 1, g_host, 8));
+    USBCompletionEvent event[2];
+    TEST_ASSERT_EQUAL(2, usb_event_ring_read(&ring, event, 2));
+    TEST_ASSERT_EQUAL_PTR(g_large, event[0].user_data);
+    TEST_ASSERT_EQUAL(USB_TRANSFER_HALTED, event[0].status);
+    TEST_ASSERT_EQUAL(512, event[0].transferred);
+    TEST_ASSERT_EQUAL_PTR(g_buffer[1], event[1].user_data);
+    TEST_ASSERT_EQUAL(USB_TRANSFER_OK, event[1].status);
+    TEST_ASSERT_EQUAL(8, event[1].transferred);
+    TEST_ASSERT_EQUAL(POOL_SIZE, queue_free_space(g_bulk_out));
+}
+
+void test_endpoint_without_queue(void)
+{
+    static USBEndpoint endpoint = {
+        .address = 0x82,
+        .device = &g_device,
+    };
+    TEST_ASSERT_EQUAL(-1, usb_transfer_schedule(&endpoint, g_buffer[0], 16,
+                completion_cb, NULL));
+    TEST_ASSERT_EQUAL(USB_TRANSFER_HANDLE_NONE,
+            usb_transfer_schedule_handle(&endpoint, g_buffer[0], 16,
+                completion_cb, NULL));
+    TEST_ASSERT_EQUAL(-1, usb_transfer_cancel(&endpoint, 1));
+    TEST_ASSERT_EQUAL(0, usb_queue_free_slots(&endpoint));
+    TEST_ASSERT_FALSE(usb_queue_active(&endpoint));
+    usb_queue_flush_endpoint(&endpoint);
+    usb_queue_transfer_complete(&endpoint);
+    TEST_ASSERT_EQUAL(0, g_completions);
+}
+
+void test_critical_section_nests(void)
+{
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0], 16,
+                completion_cb, g_buffer[0]));
+
+    const usb_critical_t outer = usb_critical_enter();
+    const usb_critical_t inner = usb_critical_enter();
+    usb_critical_exit(inner);
+
+    // still masked: the completion waits for the outer section
+    TEST_ASSERT_EQUAL(16, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(0, g_completions);
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[1], 8,
+                completion_cb, g_buffer[1]));
+    TEST_ASSERT_EQUAL(0, g_completions);
+
+    usb_critical_exit(outer);
+    TEST_ASSERT_EQUAL(1, g_completions);
+    TEST_ASSERT_EQUAL(8, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(2, g_completions);
+}
+
+void test_deep_queue_order(void)
+{
+    for(int round = 0; round < 3; round++) {
+        for(int i = 0; i < POOL_SIZE; i++) {
+            TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in,
+                        g_buffer[0], i + 1, completion_cb, NULL));
+        }
+        for(int i = 0; i < POOL_SIZE; i++) {
+            TEST_ASSERT_EQUAL(i + 1,
+                    usb_sim_in(0, 1, g_host, sizeof(g_host)));
+        }
+        TEST_ASSERT_FALSE(usb_queue_active(g_bulk_in));
+    }
+    TEST_ASSERT_EQUAL(3 * POOL_SIZE, g_completions);
+}
+
+void test_batch(void)
+{
+    const USBTransferRequest batch[] = {
+        {g_buffer[0], 512, completion_cb, g_buffer[0]},
+        {g_buffer[1], 100, completion_cb, g_buffer[1]},
+        {g_buffer[2], 0, completion_cb, g_buffer[2]},
+    };
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule_batch(g_bulk_in, batch, 3));
+    TEST_ASSERT_EQUAL(POOL_SIZE - 3, queue_free_space(g_bulk_in));
+    TEST_ASSERT_TRUE(usb_sim_endpoint_primed(0, 0x81));
+
+    TEST_ASSERT_EQUAL(512, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(100, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(0, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(USB_SIM_NAK, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+
+    TEST_ASSERT_EQUAL(3, g_completions);
+    TEST_ASSERT_EQUAL_PTR(g_buffer[0], g_user_data[0]);
+    TEST_ASSERT_EQUAL_PTR(g_buffer[1], g_user_data[1]);
+    TEST_ASSERT_EQUAL_PTR(g_buffer[2], g_user_data[2]);
+    TEST_ASSERT_EQUAL(512, g_transferred[0]);
+    TEST_ASSERT_EQUAL(100, g_transferred[1]);
+    TEST_ASSERT_EQUAL(0, g_transferred[2]);
+    TEST_ASSERT_EQUAL(POOL_SIZE, queue_free_space(g_bulk_in));
+}
+
+void test_batch_append_to_running_queue(void)
+{
+    const USBTransferRequest batch[] = {
+        {g_buffer[1], 16, completion_cb, g_buffer[1]},
+        {g_buffer[2], 32, completion_cb, g_buffer[2]},
+    };
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0], 8,
+                completion_cb, g_buffer[0]));
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule_batch(g_bulk_in, batch, 2));
+
+    TEST_ASSERT_EQUAL(8, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(16, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(32, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(3, g_completions);
+    TEST_ASSERT_EQUAL_PTR(g_buffer[2], g_user_data[2]);
+
+    // the queue ran empty, the next batch primes again
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule_batch(g_bulk_in, batch, 2));
+    TEST_ASSERT_EQUAL(16, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(32, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(5, g_completions);
+}
+
+void test_batch_pool_exhausted(void)
+{
+    USBTransferRequest batch[POOL_SIZE + 1];
+    for(int i = 0; i < POOL_SIZE + 1; i++) {
+        batch[i] = (USBTransferRequest){g_buffer[0], 8, completion_cb, NULL};
+    }
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0], 8,
+                completion_cb, NULL));
+    TEST_ASSERT_EQUAL(-1, usb_transfer_schedule_batch(g_bulk_in, batch,
+                POOL_SIZE));
+    TEST_ASSERT_EQUAL(POOL_SIZE - 1, queue_free_space(g_bulk_in));
+
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule_batch(g_bulk_in, batch,
+                POOL_SIZE - 1));
+    TEST_ASSERT_EQUAL(0, queue_free_space(g_bulk_in));
+    for(int i = 0; i < POOL_SIZE; i++) {
+        TEST_ASSERT_EQUAL(8, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    }
+    TEST_ASSERT_EQUAL(POOL_SIZE, g_completions);
+}
+
+void test_large_in(void)
+{
+    const uint32_t length = 2 * USB_TRANSFER_MAX_DTD_LENGTH + 1000;
+    for(uint32_t i = 0; i < length; i++) {
+        g_large[i] = i ^ (i >> 8);
+    }
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_large + 3,
+                length, completion_cb, g_large));
+    TEST_ASSERT_EQUAL(POOL_SIZE - 3, queue_free_space(g_bulk_in));
+
+    const uint32_t irqs = usb_sim_irq_count(0);
+    uint32_t received = 0;
+    while(received < length) {
+        int n = usb_sim_in(0, 1, g_host, sizeof(g_host));
+        TEST_ASSERT_TRUE(n > 0);
+        TEST_ASSERT_EQUAL_MEMORY(g_large + 3 + received, g_host, n);
+        received+= n;
+    }
+    TEST_ASSERT_EQUAL(length, received);
+    TEST_ASSERT_EQUAL(USB_SIM_NAK, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+
+    TEST_ASSERT_EQUAL(1, usb_sim_irq_count(0) - irqs);
+    TEST_ASSERT_EQUAL(1, g_completions);
+    TEST_ASSERT_EQUAL(length, g_transferred[0]);
+    TEST_ASSERT_EQUAL_PTR(g_large, g_user_data[0]);
+    TEST_ASSERT_EQUAL(POOL_SIZE, queue_free_space(g_bulk_in));
+}
+
+void test_large_out_short_packet(void)
+{
+    const uint32_t length = 2 * USB_TRANSFER_MAX_DTD_LENGTH + 1000;
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_out, g_large, length,
+                completion_cb, g_large));
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_out, g_buffer[0], 512,
+                completion_cb, g_buffer[0]));
+
+    // one full dTD, then a short packet in the second one
+    uint32_t sent = 0;
+    while(sent < USB_TRANSFER_MAX_DTD_LENGTH + 512) {
+        memset(g_host, sent / 512, 512);
+        TEST_ASSERT_EQUAL(512, usb_sim_out(0, 1, g_host, 512));
+        sent+= 512;
+    }
+    TEST_ASSERT_EQUAL(0, g_completions);
+    memset(g_host, 0xAA, 100);
+    TEST_ASSERT_EQUAL(100, usb_sim_out(0, 1, g_host, 100));
+    sent+= 100;
+
+    TEST_ASSERT_EQUAL(1, g_completions);
+    TEST_ASSERT_EQUAL(sent, g_transferred[0]);
+    TEST_ASSERT_EQUAL_PTR(g_large, g_user_data[0]);
+    TEST_ASSERT_EQUAL_UINT8(USB_TRANSFER_MAX_DTD_LENGTH / 512,
+            g_large[USB_TRANSFER_MAX_DTD_LENGTH]);
+    TEST_ASSERT_EQUAL_UINT8(0xAA, g_large[sent - 1]);
+
+    // the rest of the large transfer was dropped, the next one is live
+    TEST_ASSERT_EQUAL(POOL_SIZE - 1, queue_free_space(g_bulk_out));
+    memset(g_host, 0x55, 10);
+    TEST_ASSERT_EQUAL(10, usb_sim_out(0, 1, g_host, 10));
+    TEST_ASSERT_EQUAL(2, g_completions);
+    TEST_ASSERT_EQUAL(10, g_transferred[1]);
+    TEST_ASSERT_EQUAL_UINT8(0x55, g_buffer[0][0]);
+}
+
+void test_large_exceeds_pool(void)
+{
+    TEST_ASSERT_EQUAL(-1, usb_transfer_schedule(g_bulk_in, g_large,
+                POOL_SIZE * USB_TRANSFER_MAX_DTD_LENGTH + 1,
+                completion_cb, NULL));
+    TEST_ASSERT_EQUAL(POOL_SIZE, queue_free_space(g_bulk_in));
+    TEST_ASSERT_FALSE(usb_queue_active(g_bulk_in));
+}
+
+void test_large_flush(void)
+{
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_large,
+                sizeof(g_large), completion_cb, NULL));
+    TEST_ASSERT_EQUAL(512, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+
+    usb_endpoint_flush(g_bulk_in);
+    TEST_ASSERT_EQUAL(1, g_completions);
+    TEST_ASSERT_EQUAL(-1, g_transferred[0]);
+    TEST_ASSERT_EQUAL(POOL_SIZE, queue_free_space(g_bulk_in));
+}
+
+static void schedule_batch_of(uint32_t count)
+{
+    USBTransferRequest batch[POOL_SIZE];
+    for(uint32_t i = 0; i < count; i++) {
+        batch[i] = (USBTransferRequest){g_buffer[0], 64, completion_cb, NULL};
+    }
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule_batch(g_bulk_in, batch, count));
+}
+
+void test_irq_policy_last_of_batch(void)
+{
+    usb_queue_set_irq_policy(g_bulk_in, USB_IRQ_LAST_OF_BATCH, 0);
+    schedule_batch_of(POOL_SIZE);
+
+    const uint32_t irqs = usb_sim_irq_count(0);
+    for(int i = 0; i < POOL_SIZE - 1; i++) {
+        TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    }
+    TEST_ASSERT_EQUAL(0, g_completions);
+    TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+
+    TEST_ASSERT_EQUAL(1, usb_sim_irq_count(0) - irqs);
+    TEST_ASSERT_EQUAL(POOL_SIZE, g_completions);
+    TEST_ASSERT_EQUAL(POOL_SIZE, queue_free_space(g_bulk_in));
+}
+
+void test_irq_policy_every_n(void)
+{
+    usb_queue_set_irq_policy(g_bulk_in, USB_IRQ_EVERY_N, 3);
+    schedule_batch_of(POOL_SIZE);
+
+    const uint32_t irqs = usb_sim_irq_count(0);
+    const int expected[POOL_SIZE] = {0, 0, 3, 3, 3, 6, 6, 8};
+    for(int i = 0; i < POOL_SIZE; i++) {
+        TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+        TEST_ASSERT_EQUAL(expected[i], g_completions);
+    }
+    TEST_ASSERT_EQUAL(3, usb_sim_irq_count(0) - irqs);
+}
+
+void test_irq_policy_single_transfers(void)
+{
+    // the last transfer of a submission always interrupts
+    usb_queue_set_irq_policy(g_bulk_in, USB_IRQ_LAST_OF_BATCH, 0);
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0], 64,
+                completion_cb, NULL));
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0], 64,
+                completion_cb, NULL));
+    TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(1, g_completions);
+    TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(2, g_completions);
+}
+
+static void fill_pool(void)
+{
+    for(int i = 0; i < POOL_SIZE; i++) {
+        TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0], 64,
+                    completion_cb, NULL));
+    }
+}
+
+static int g_waits;
+
+static void wfi_host_reads(void)
+{
+    g_waits++;
+    TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+}
+
+static void wfi_host_idle(void)
+{
+    g_waits++;
+    usb_sim_sof(0, 8);
+}
+
+void test_schedule_block_waits_for_space(void)
+{
+    fill_pool();
+    g_waits = 0;
+    usb_sim_set_wfi_hook(wfi_host_reads);
+
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule_block(g_bulk_in, g_buffer[1],
+                64, completion_cb, g_buffer[1]));
+    TEST_ASSERT_EQUAL(1, g_waits);
+    TEST_ASSERT_EQUAL(1, g_completions);
+    TEST_ASSERT_EQUAL(0, queue_free_space(g_bulk_in));
+}
+
+void test_schedule_wait_timeout(void)
+{
+    fill_pool();
+    g_waits = 0;
+    usb_sim_set_wfi_hook(wfi_host_idle);
+
+    TEST_ASSERT_EQUAL(-1, usb_transfer_schedule_wait(g_bulk_in, g_buffer[1],
+                64, completion_cb, NULL, 3));
+    TEST_ASSERT_EQUAL(3, g_waits);
+    TEST_ASSERT_EQUAL(0, g_completions);
+
+    usb_sim_set_wfi_hook(wfi_host_reads);
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule_wait(g_bulk_in, g_buffer[1],
+                64, completion_cb, NULL, 3));
+}
+
+void test_schedule_wait_timeout_limit(void)
+{
+    fill_pool();
+    g_waits = 0;
+    usb_sim_set_wfi_hook(wfi_host_idle);
+
+    // FRINDEX can not measure it
+    TEST_ASSERT_EQUAL(-1, usb_transfer_schedule_wait(g_bulk_in, g_buffer[1],
+                64, completion_cb, NULL, USB_TRANSFER_WAIT_MAX_MS + 1));
+    TEST_ASSERT_EQUAL(0, g_waits);
+}
+
+void test_schedule_block_suspended(void)
+{
+    fill_pool();
+    g_waits = 0;
+    usb_sim_set_wfi_hook(wfi_host_idle);
+
+    // No completions and no frames until the host resumes
+    usb_sim_suspend(0);
+    TEST_ASSERT_EQUAL(-1, usb_transfer_schedule_block(g_bulk_in, g_buffer[1],
+                64, completion_cb, NULL));
+    TEST_ASSERT_EQUAL(-1, usb_transfer_schedule_wait(g_bulk_in, g_buffer[1],
+                64, completion_cb, NULL, 10));
+    TEST_ASSERT_EQUAL(0, g_waits);
+}
+
+static int g_block_result;
+
+static void block_in_completion_cb(void *user_data, int transferred)
+{
+    completion_cb(user_data, transferred);
+    // the pool is still full: the completed transfer is freed afterwards
+    g_block_result = usb_transfer_schedule_block(g_bulk_in, g_buffer[1], 64,
+            NULL, NULL);
+}
+
+void test_schedule_block_in_interrupt(void)
+{
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0], 64,
+                block_in_completion_cb, NULL));
+    for(int i = 1; i < POOL_SIZE; i++) {
+        TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0], 64,
+                    completion_cb, NULL));
+    }
+    g_block_result = 0;
+
+    // no WFI hook: waiting in the interrupt handler would fail the test
+    TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(1, g_completions);
+    TEST_ASSERT_EQUAL(-1, g_block_result);
+}
+
+static int g_space_available;
+
+static void space_available_cb(USBEndpoint *endpoint)
+{
+    TEST_ASSERT_EQUAL_PTR(g_bulk_in, endpoint);
+    g_space_available++;
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(endpoint, g_buffer[1], 64,
+                completion_cb, NULL));
+}
+
+void test_space_available_cb(void)
+{
+    g_space_available = 0;
+    usb_queue_set_space_available_cb(g_bulk_in, space_available_cb);
+    fill_pool();
+
+    // only notifies after a submission was rejected
+    TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(0, g_space_available);
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0], 64,
+                completion_cb, NULL));
+
+    TEST_ASSERT_EQUAL(-1, usb_transfer_schedule(g_bulk_in, g_buffer[0], 64,
+                completion_cb, NULL));
+    TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(1, g_space_available);
+    TEST_ASSERT_EQUAL(0, queue_free_space(g_bulk_in));
+
+    TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(1, g_space_available);
+}
+
+void test_stats(void)
+{
+    USBQueueStats stats;
+    TEST_ASSERT_TRUE(usb_queue_get_stats(g_bulk_in, &stats));
+    TEST_ASSERT_EQUAL(0, stats.transfers);
+    TEST_ASSERT_EQUAL(0, stats.max_depth);
+
+    fill_pool();
+    TEST_ASSERT_EQUAL(-1, usb_transfer_schedule(g_bulk_in, g_buffer[0], 64,
+                completion_cb, NULL));
+    usb_sim_sof(0, 16);
+    TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+
+    usb_queue_get_stats(g_bulk_in, &stats);
+    TEST_ASSERT_EQUAL(128, stats.bytes);
+    TEST_ASSERT_EQUAL(2, stats.transfers);
+    TEST_ASSERT_EQUAL(0, stats.short_packets);
+    TEST_ASSERT_EQUAL(1, stats.pool_exhausted);
+    TEST_ASSERT_EQUAL(POOL_SIZE, stats.max_depth);
+    TEST_ASSERT_EQUAL(2 * 16, stats.latency_microframes);
+
+    usb_queue_reset_stats(g_bulk_in);
+    usb_queue_get_stats(g_bulk_in, &stats);
+    TEST_ASSERT_EQUAL(0, stats.transfers);
+    TEST_ASSERT_EQUAL(POOL_SIZE - 2, stats.max_depth);
+
+    usb_endpoint_flush(g_bulk_in);
+    usb_queue_reset_stats(g_bulk_in);
+    usb_queue_get_stats(g_bulk_in, &stats);
+    TEST_ASSERT_EQUAL(0, stats.max_depth);
+    TEST_ASSERT_EQUAL(0, stats.transfers);
+}
+
+void test_stats_short_packet(void)
+{
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_out, g_large,
+                sizeof(g_large), completion_cb, NULL));
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_out, g_buffer[0], 512,
+                completion_cb, NULL));
+    TEST_ASSERT_EQUAL(100, usb_sim_out(0, 1, g_host, 100));
+    TEST_ASSERT_EQUAL(512, usb_sim_out(0, 1, g_host, 512));
+
+    USBQueueStats stats;
+    usb_queue_get_stats(g_bulk_out, &stats);
+    TEST_ASSERT_EQUAL(2, stats.transfers);
+    TEST_ASSERT_EQUAL(1, stats.short_packets);
+    TEST_ASSERT_EQUAL(612, stats.bytes);
+    TEST_ASSERT_EQUAL(2, stats.max_depth);
+}
+
+void test_pool_layout(void)
+{
+    const usb_queue_t *queue = g_bulk_in->queue;
+    TEST_ASSERT_EQUAL_PTR(g_bulk_in, queue->endpoint);
+    TEST_ASSERT_EQUAL(0, sizeof(USBTransferDescriptor) % USB_TD_ALIGNMENT);
+    TEST_ASSERT_EQUAL(0, (uintptr_t)queue->tds % USB_TD_ALIGNMENT);
+
+    // dTDs are packed: consecutive transfers use consecutive slots
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0], 64,
+                completion_cb, NULL));
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[1], 64,
+                completion_cb, NULL));
+    TEST_ASSERT_EQUAL_PTR(&queue->tds[1], queue->tds[0].next_dtd_pointer);
+}
+
+void test_pool_occupancy(void)
+{
+    TEST_ASSERT_EQUAL(POOL_SIZE, usb_queue_free_slots(g_bulk_in));
+    TEST_ASSERT_EQUAL(0, usb_queue_used_slots(g_bulk_in));
+    TEST_ASSERT_EQUAL(0, usb_queue_max_used_slots(g_bulk_in));
+
+    // 3 dTDs for the large transfer, 1 for the small one
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_large,
+                sizeof(g_large), completion_cb, NULL));
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0], 64,
+                completion_cb, NULL));
+    TEST_ASSERT_EQUAL(POOL_SIZE - 4, usb_queue_free_slots(g_bulk_in));
+    TEST_ASSERT_EQUAL(4, usb_queue_used_slots(g_bulk_in));
+
+    usb_endpoint_flush(g_bulk_in);
+    TEST_ASSERT_EQUAL(POOL_SIZE, usb_queue_free_slots(g_bulk_in));
+    TEST_ASSERT_EQUAL(4, usb_queue_max_used_slots(g_bulk_in));
+
+    usb_queue_reset_max_used_slots(g_bulk_in);
+    TEST_ASSERT_EQUAL(0, usb_queue_max_used_slots(g_bulk_in));
+
+    // a rejected large transfer leaves the count untouched
+    fill_pool();
+    TEST_ASSERT_EQUAL(-1, usb_transfer_schedule(g_bulk_in, g_large,
+                sizeof(g_large), completion_cb, NULL));
+    TEST_ASSERT_EQUAL(0, usb_queue_free_slots(g_bulk_in));
+    TEST_ASSERT_EQUAL(POOL_SIZE, usb_queue_max_used_slots(g_bulk_in));
+    TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(1, usb_queue_free_slots(g_bulk_in));
+}
+
+static int g_events_pending;
+
+static void events_pending_cb(void)
+{
+    g_events_pending++;
+}
+
+void test_deferred_completion(void)
+{
+    g_device.events_pending = events_pending_cb;
+    g_events_pending = 0;
+    usb_queue_set_deferred_completion(g_bulk_in, true);
+    usb_queue_set_deferred_completion(g_bulk_out, true);
+
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0], 64,
+                completion_cb, g_buffer[0]));
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[1], 100,
+                completion_cb, g_buffer[1]));
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_out, g_large,
+                sizeof(g_large), completion_cb, g_large));
+    TEST_ASSERT_FALSE(usb_events_pending(&g_device));
+
+    TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(100, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(512, usb_sim_out(0, 1, g_host, 512));
+    TEST_ASSERT_EQUAL(10, usb_sim_out(0, 1, g_host, 10));
+
+    // retired in the interrupt, but nothing called back or freed yet
+    TEST_ASSERT_EQUAL(0, g_completions);
+    TEST_ASSERT_EQUAL(3, g_events_pending);
+    TEST_ASSERT_TRUE(usb_events_pending(&g_device));
+    TEST_ASSERT_FALSE(usb_queue_active(g_bulk_in));
+    TEST_ASSERT_EQUAL(POOL_SIZE - 2, usb_queue_free_slots(g_bulk_in));
+    TEST_ASSERT_EQUAL(POOL_SIZE - 1, usb_queue_free_slots(g_bulk_out));
+
+    usb_process_events(&g_device);
+    TEST_ASSERT_FALSE(usb_events_pending(&g_device));
+    TEST_ASSERT_EQUAL(3, g_completions);
+    TEST_ASSERT_EQUAL_PTR(g_large, g_user_data[0]);
+    TEST_ASSERT_EQUAL(522, g_transferred[0]);
+    TEST_ASSERT_EQUAL_PTR(g_buffer[0], g_user_data[1]);
+    TEST_ASSERT_EQUAL(64, g_transferred[1]);
+    TEST_ASSERT_EQUAL_PTR(g_buffer[1], g_user_data[2]);
+    TEST_ASSERT_EQUAL(100, g_transferred[2]);
+    TEST_ASSERT_EQUAL(POOL_SIZE, usb_queue_free_slots(g_bulk_in));
+    TEST_ASSERT_EQUAL(POOL_SIZE, usb_queue_free_slots(g_bulk_out));
+
+    usb_process_events(&g_device);
+    TEST_ASSERT_EQUAL(3, g_completions);
+}
+
+static void wfi_host_reads_deferred(void)
+{
+    g_waits++;
+    TEST_ASSERT_EQUAL(64, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+    TEST_ASSERT_EQUAL(0, g_completions);
+}
+
+void test_deferred_schedule_block(void)
+{
+    usb_queue_set_deferred_completion(g_bulk_in, true);
+    fill_pool();
+    g_waits = 0;
+    usb_sim_set_wfi_hook(wfi_host_reads_deferred);
+
+    // the waiting thread processes the completion that frees the space
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule_block(g_bulk_in, g_buffer[1],
+                64, completion_cb, NULL));
+    TEST_ASSERT_EQUAL(1, g_waits);
+    TEST_ASSERT_EQUAL(1, g_completions);
+}
+
+void test_deferred_cancel(void)
+{
+    // Without interrupts the first transfer is only retired by the cancel
+    usb_queue_set_deferred_completion(g_bulk_in, true);
+    usb_queue_set_irq_policy(g_bulk_in, USB_IRQ_LAST_OF_BATCH, 0);
+    const USBTransferRequest batch[] = {
+        {g_buffer[0], 16, completion_cb, g_buffer[0]},
+        {g_buffer[1], 32, completion_cb, g_buffer[1]},
+    };
+    USBTransferHandle handles[2];
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule_batch_handles(g_bulk_in, batch,
+                2, handles));
+    TEST_ASSERT_EQUAL(16, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+
+    // the cancel is reported behind the transfer that finished before it
+    TEST_ASSERT_EQUAL(0, usb_transfer_cancel(g_bulk_in, handles[1]));
+    TEST_ASSERT_EQUAL(0, g_completions);
+    TEST_ASSERT_TRUE(usb_events_pending(&g_device));
+
+    usb_process_events(&g_device);
+    TEST_ASSERT_EQUAL(2, g_completions);
+    TEST_ASSERT_EQUAL_PTR(g_buffer[0], g_user_data[0]);
+    TEST_ASSERT_EQUAL(16, g_transferred[0]);
+    TEST_ASSERT_EQUAL_PTR(g_buffer[1], g_user_data[1]);
+    TEST_ASSERT_EQUAL(USB_TRANSFER_CANCELLED, g_transferred[1]);
+    TEST_ASSERT_EQUAL(POOL_SIZE, usb_queue_free_slots(g_bulk_in));
+}
+
+void test_deferred_timeout(void)
+{
+    usb_queue_set_deferred_completion(g_bulk_in, true);
+    usb_set_sof_interrupt(&g_device, true);
+    usb_queue_set_timeout(g_bulk_in, 8);
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[0], 16,
+                completion_cb, g_buffer[0]));
+    TEST_ASSERT_EQUAL(0, usb_transfer_schedule(g_bulk_in, g_buffer[1], 32,
+                completion_cb, g_buffer[1]));
+    TEST_ASSERT_EQUAL(16, usb_sim_in(0, 1, g_host, sizeof(g_host)));
+
+    // the second transfer expires in the SOF interrupt: no callback there
+    usb_sim_sof(0, 8);
+    TEST_ASSERT_EQUAL(0, g_completions);
+    TEST_ASSERT_FALSE(usb_queue_active(g_bulk_in));
+
+    usb_process_events(&g_device);
+    TEST_ASSERT_EQUAL(2, g_completions);
+    TEST_ASSERT_EQUAL_PTR(g_buffer[0], g_user_data[0]);
+    TEST_ASSERT_EQUAL(16, g_transferred[0]);
+    TEST_ASSERT_EQUAL_PTR(g_buffer[1], g_user_data[1]);
+    TEST_ASSERT_EQUAL(USB_TRANSFER_TIMEOUT, g_transferred[1]);
+    TEST_ASSERT_EQUAL(POOL_SIZE, usb_queue_free_slots(g_bulk_in));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_nak_when_idle);
+    RUN_TEST(test_bulk_in);
+    RUN_TEST(test_bulk_out_short_packet);
+    RUN_TEST(test_append_to_running_queue);
+    RUN_TEST(test_reprime_after_idle);
+    RUN_TEST(test_pool_exhausted);
+    RUN_TEST(test_flush);
+    RUN_TEST(test_schedule_after_flush);
+    RUN_TEST(test_cancel_queued);
+    RUN_TEST(test_cancel_tail);
+    RUN_TEST(test_cancel_in_progress);
+    RUN_TEST(test_cancel_last_in_progress);
+    RUN_TEST(test_cancel_behind_finished);
+    RUN_TEST(test_cancel_large);
+    RUN_TEST(test_cancel_not_queued);
+    RUN_TEST(test_cancel_shared_user_data);
+    RUN_TEST(test_cancel_reused_slot);
+    RUN_TEST(test_timeout);
+    RUN_TEST(test_timeout_keeps_streaming);
+    RUN_TEST(test_timeout_polled);
+    RUN_TEST(test_timeout_disabled);
+    RUN_TEST(test_error_restarts_endpoint);
+    RUN_TEST(test_error_in_large_transfer);
+    RUN_TEST(test_endpoint_without_queue);
+    RUN_TEST(test_critical_section_nests);
+    RUN_TEST(test_deep_queue_order);
+    RUN_TEST(test_batch);
+    RUN_TEST(test_batch_append_to_running_queue);
+    RUN_TEST(test_batch_pool_exhausted);
+    RUN_TEST(test_large_in);
+    RUN_TEST(test_large_out_short_packet);
+    RUN_TEST(test_large_exceeds_pool);
+    RUN_TEST(test_large_flush);
+    RUN_TEST(test_irq_policy_last_of_batch);
+    RUN_TEST(test_irq_policy_every_n);
+    RUN_TEST(test_irq_policy_single_transfers);
+    RUN_TEST(test_schedule_block_waits_for_space);
+    RUN_TEST(test_schedule_wait_timeout);
+    RUN_TEST(test_schedule_wait_timeout_limit);
+    RUN_TEST(test_schedule_block_suspended);
+    RUN_TEST(test_schedule_block_in_interrupt);
+    RUN_TEST(test_space_available_cb);
+    RUN_TEST(test_stats);
+    RUN_TEST(test_stats_short_packet);
+    RUN_TEST(test_pool_layout);
+    RUN_TEST(test_pool_occupancy);
+    RUN_TEST(test_deferred_completion);
+    RUN_TEST(test_deferred_schedule_block);
+    RUN_TEST(test_deferred_cancel);
+    RUN_TEST(test_deferred_timeout);
+
+    UNITY_END();
+
+    return 0;
+}
@@ -0,0 +1,277 @@
+#include <stdbool.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "unity.h"
+#include "usb_sim.h"
+#include "mcu_usb.h"
+#include "usb_core.h"
+#include "usb_endpoint.h"
+#include "usb_queue.h"
+#include "usb_rx_ring.h"
+
+#define POOL_SIZE 8
+#define NUM_BUFFERS 4
+#define BUFFER_SIZE 1024
+
+static USBDescriptorDevice g_device_descriptor = {
+    .bLength = sizeof(USBDescriptorDevice),
+    .bDescriptorType = USB_DESCRIPTOR_TYPE_DEVICE,
+    .bMaxPacketSize0 = 64,
+};
+static USBDevice g_device = {
+    .descriptor = &g_device_descriptor,
+    .controller = 0,
+};
+static USBEndpoint *g_bulk_out;
+
+static uint8_t g_buffers[NUM_BUFFERS * BUFFER_SIZE];
+static uint8_t g_host[512];
+static USBRxRing g_ring;
+static int g_ready;
+
+static void ready_cb(void *user_data)
+{
+    g_ready++;
+}
+
+void setUp(void)
+{
+    usb_sim_reset();
+    g_ready = 0;
+
+    g_bulk_out = usb_endpoint_create(0x01, &g_device, NULL,
+            usb_queue_transfer_complete, POOL_SIZE, usb_sim_alloc);
+    TEST_ASSERT_NOT_NULL(g_bulk_out);
+
+    usb_device_init(&g_device);
+    usb_endpoint_init_without_descriptor(g_bulk_out, 512,
+            USB_TRANSFER_TYPE_BULK);
+    usb_run(&g_device);
+    usb_sim_attach(0, USB_SPEED_HIGH);
+
+    TEST_ASSERT_EQUAL(0, usb_rx_ring_init(&g_ring, g_bulk_out, g_buffers,
+                BUFFER_SIZE, NUM_BUFFERS, 2, ready_cb, NULL));
+}
+
+void tearDown(void)
+{
+}
+
+static int host_send(uint8_t value, size_t length)
+{
+    memset(g_host, value, length);
+    return usb_sim_out(0, 1, g_host, length);
+}
+
+// The handle of the transfer at the head of the queue, as
+// usb_transfer_schedule_handle() would have returned it
+static USBTransferHandle head_handle(const USBEndpoint *endpoint)
+{
+    const usb_queue_t *queue = endpoint->queue;
+    const usb_transfer_t *t = queue->active;
+    return ((uint32_t)t->generation << 16) | (t - queue->transfers + 1);
+}
+
+void test_receive_in_order(void)
+{
+    uint32_t length;
+
+    TEST_ASSERT_EQUAL(0, usb_rx_ring_start(&g_ring));
+    TEST_ASSERT_EQUAL(2, usb_rx_ring_primed(&g_ring));
+    TEST_ASSERT_NULL(usb_rx_ring_receive(&g_ring, &length));
+
+    // a full buffer, then a short packet
+    TEST_ASSERT_EQUAL(512, host_send(1, 512));
+    TEST_ASSERT_EQUAL(512, host_send(1, 512));
+    TEST_ASSERT_EQUAL(100, host_send(2, 100));
+    TEST_ASSERT_EQUAL(2, g_ready);
+
+    // filled buffers were replaced right away
+    TEST_ASSERT_EQUAL(2, usb_rx_ring_primed(&g_ring));
+
+    uint8_t *first = usb_rx_ring_receive(&g_ring, &length);
+    TEST_ASSERT_EQUAL_PTR(&g_buffers[0], first);
+    TEST_ASSERT_EQUAL(1024, length);
+    TEST_ASSERT_EQUAL_UINT8(1, first[1023]);
+
+    uint8_t *second = usb_rx_ring_receive(&g_ring, &length);
+    TEST_ASSERT_EQUAL_PTR(&g_buffers[BUFFER_SIZE], second);
+    TEST_ASSERT_EQUAL(100, length);
+    TEST_ASSERT_EQUAL_UINT8(2, second[99]);
+
+    TEST_ASSERT_NULL(usb_rx_ring_receive(&g_ring, &length));
+}
+
+void test_release_reposts(void)
+{
+    uint32_t length;
+    uint8_t *received[NUM_BUFFERS];
+
+    TEST_ASSERT_EQUAL(0, usb_rx_ring_start(&g_ring));
+    for(int i = 0; i < NUM_BUFFERS; i++) {
+        TEST_ASSERT_EQUAL(10, host_send(i, 10));
+        received[i] = usb_rx_ring_receive(&g_ring, &length);
+        TEST_ASSERT_NOT_NULL(received[i]);
+        TEST_ASSERT_EQUAL_UINT8(i, received[i][0]);
+    }
+
+    // every buffer is with the application: the host gets NAKed
+    TEST_ASSERT_EQUAL(0, usb_rx_ring_primed(&g_ring));
+    TEST_ASSERT_EQUAL(USB_SIM_NAK, host_send(9, 10));
+
+    // out of order is fine, a released buffer is primed right away
+    usb_rx_ring_release(&g_ring, received[2]);
+    TEST_ASSERT_EQUAL(1, usb_rx_ring_primed(&g_ring));
+    TEST_ASSERT_TRUE(usb_sim_endpoint_primed(0, 0x01));
+    TEST_ASSERT_EQUAL(10, host_send(9, 10));
+    TEST_ASSERT_EQUAL_PTR(received[2], usb_rx_ring_receive(&g_ring, &length));
+
+    for(int i = 0; i < NUM_BUFFERS; i++) {
+        usb_rx_ring_release(&g_ring, received[i]);
+    }
+    TEST_ASSERT_EQUAL(2, usb_rx_ring_primed(&g_ring));
+    TEST_ASSERT_EQUAL(POOL_SIZE - 2, usb_queue_free_slots(g_bulk_out));
+}
+
+void test_stream(void)
+{
+    uint32_t length;
+
+    TEST_ASSERT_EQUAL(0, usb_rx_ring_start(&g_ring));
+    for(int i = 0; i < 100; i++) {
+        TEST_ASSERT_EQUAL(1 + i, host_send(i, 1 + i));
+        uint8_t *buffer = usb_rx_ring_receive(&g_ring, &length);
+        TEST_ASSERT_NOT_NULL(buffer);
+        TEST_ASSERT_EQUAL(1 + i, length);
+        TEST_ASSERT_EQUAL_UINT8(i, buffer[i]);
+        usb_rx_ring_release(&g_ring, buffer);
+    }
+    TEST_ASSERT_EQUAL(100, g_ready);
+    TEST_ASSERT_EQUAL(2, usb_rx_ring_primed(&g_ring));
+}
+
+void test_stop(void)
+{
+    uint32_t length;
+
+    TEST_ASSERT_EQUAL(0, usb_rx_ring_start(&g_ring));
+    TEST_ASSERT_EQUAL(10, host_send(1, 10));
+    usb_rx_ring_stop(&g_ring);
+
+    TEST_ASSERT_EQUAL(0, usb_rx_ring_primed(&g_ring));
+    TEST_ASSERT_EQUAL(USB_SIM_NAK, host_send(2, 10));
+    TEST_ASSERT_EQUAL(POOL_SIZE, usb_queue_free_slots(g_bulk_out));
+
+    // the received buffer stays valid, releasing it does not prime
+    uint8_t *buffer = usb_rx_ring_receive(&g_ring, &length);
+    TEST_ASSERT_NOT_NULL(buffer);
+    TEST_ASSERT_EQUAL(10, length);
+    usb_rx_ring_release(&g_ring, buffer);
+    TEST_ASSERT_EQUAL(0, usb_rx_ring_primed(&g_ring));
+
+    TEST_ASSERT_EQUAL(0, usb_rx_ring_start(&g_ring));
+    TEST_ASSERT_EQUAL(2, usb_rx_ring_primed(&g_ring));
+    TEST_ASSERT_EQUAL(10, host_send(3, 10));
+    buffer = usb_rx_ring_receive(&g_ring, &length);
+    TEST_ASSERT_NOT_NULL(buffer);
+    TEST_ASSERT_EQUAL_UINT8(3, buffer[0]);
+}
+
+void test_bad_configuration(void)
+{
+    USBRxRing ring;
+    TEST_ASSERT_EQUAL(-1, usb_rx_ring_init(&ring, g_bulk_out, g_buffers,
+                BUFFER_SIZE, 0, 2, NULL, NULL));
+    TEST_ASSERT_EQUAL(-1, usb_rx_ring_init(&ring, g_bulk_out, g_buffers,
+                BUFFER_SIZE, USB_RX_RING_MAX_BUFFERS + 1, 2, NULL, NULL));
+
+    // Needs one dTD more than it primes
+    TEST_ASSERT_EQUAL(0, usb_rx_ring_init(&ring, g_bulk_out, g_buffers,
+                BUFFER_SIZE, POOL_SIZE, POOL_SIZE, NULL, NULL));
+    TEST_ASSERT_EQUAL(-1, usb_rx_ring_start(&ring));
+    TEST_ASSERT_EQUAL(0, usb_rx_ring_primed(&ring));
+    TEST_ASSERT_FALSE(usb_sim_endpoint_primed(0, 0x01));
+}
+
+void test_transfer_errors(void)
+{
+    static const uint32_t errors[] = {
+        USB_TD_DTD_TOKEN_STATUS_HALTED,
+        USB_TD_DTD_TOKEN_STATUS_BUFFER_ERROR,
+        USB_TD_DTD_TOKEN_STATUS_TRANSACTION_ERROR,
+    };
+    uint32_t length;
+
+    TEST_ASSERT_EQUAL(0, usb_rx_ring_start(&g_ring));
+    for(int i = 0; i < 3; i++) {
+        // nothing to hand out, the buffer is primed again behind the other
+        TEST_ASSERT_TRUE(usb_sim_error(0, 0x01, errors[i]));
+        TEST_ASSERT_EQUAL(0, g_ready);
+        TEST_ASSERT_NULL(usb_rx_ring_receive(&g_ring, &length));
+        TEST_ASSERT_EQUAL(2, usb_rx_ring_primed(&g_ring));
+    }
+    USBQueueErrors counted;
+    usb_queue_get_errors(g_bulk_out, &counted);
+    TEST_ASSERT_EQUAL(1, counted.halted);
+    TEST_ASSERT_EQUAL(1, counted.buffer_errors);
+    TEST_ASSERT_EQUAL(1, counted.transaction_errors);
+
+    // buffer 0 failed last
+    TEST_ASSERT_EQUAL(10, host_send(1, 10));
+    TEST_ASSERT_EQUAL(20, host_send(2, 20));
+    uint8_t *buffer = usb_rx_ring_receive(&g_ring, &length);
+    TEST_ASSERT_EQUAL_PTR(&g_buffers[BUFFER_SIZE], buffer);
+    TEST_ASSERT_EQUAL(10, length);
+    TEST_ASSERT_EQUAL_UINT8(1, buffer[0]);
+    buffer = usb_rx_ring_receive(&g_ring, &length);
+    TEST_ASSERT_EQUAL_PTR(&g_buffers[0], buffer);
+    TEST_ASSERT_EQUAL(20, length);
+    TEST_ASSERT_EQUAL_UINT8(2, buffer[0]);
+}
+
+void test_cancel_and_timeout(void)
+{
+    uint32_t length;
+
+    usb_set_sof_interrupt(&g_device, true);
+    usb_queue_set_timeout(g_bulk_out, 8);
+    TEST_ASSERT_EQUAL(0, usb_rx_ring_start(&g_ring));
+
+    // both buffers time out and are primed again, with a new deadline
+    usb_sim_sof(0, 8);
+    TEST_ASSERT_EQUAL(2, usb_rx_ring_primed(&g_ring));
+    TEST_ASSERT_NULL(usb_rx_ring_receive(&g_ring, &length));
+    usb_queue_set_timeout(g_bulk_out, 0);
+
+    TEST_ASSERT_EQUAL(0, usb_transfer_cancel(g_bulk_out,
+                head_handle(g_bulk_out)));
+    TEST_ASSERT_EQUAL(2, usb_rx_ring_primed(&g_ring));
+    TEST_ASSERT_NULL(usb_rx_ring_receive(&g_ring, &length));
+    TEST_ASSERT_EQUAL(0, g_ready);
+
+    TEST_ASSERT_EQUAL(10, host_send(3, 10));
+    TEST_ASSERT_EQUAL(1, g_ready);
+    uint8_t *buffer = usb_rx_ring_receive(&g_ring, &length);
+    TEST_ASSERT_NOT_NULL(buffer);
+    TEST_ASSERT_EQUAL(10, length);
+    TEST_ASSERT_EQUAL_UINT8(3, buffer[0]);
+    TEST_ASSERT_EQUAL(2, usb_rx_ring_primed(&g_ring));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_receive_in_order);
+    RUN_TEST(test_release_reposts);
+    RUN_TEST(test_stream);
+    RUN_TEST(test_stop);
+    RUN_TEST(test_bad_configuration);
+    RUN_TEST(test_transfer_errors);
+    RUN_TEST(test_cancel_and_timeout);
+
+    UNITY_END();
+
+    return 0;
+}